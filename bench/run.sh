@@ -0,0 +1,52 @@
+#!/bin/sh
+# Runs the workloads in this directory, or the ones named, and prints one
+# JSON object per run: wall time, peak heap, peak RSS, and the number of
+# instructions dispatched when lox was built with DEBUG_PROFILE and
+# PROFILE=1 is set.
+#
+#   LOX=path/to/lox RUNS=5 bench/run.sh [calls maps ...]
+#
+# make -C bench builds lox from src/ first, see the Makefile.
+
+LOX=${LOX:-./lox}
+RUNS=${RUNS:-3}
+DIR=$(cd "$(dirname "$0")" && pwd)
+
+FLAGS="-t"
+if [ -n "$OPT" ]; then FLAGS="$FLAGS -O$OPT"; fi
+if [ "$PROFILE" = "1" ]; then FLAGS="$FLAGS -p"; fi
+
+if [ ! -x "$LOX" ]; then
+    echo "bench: no lox binary at '$LOX', set LOX" >&2
+    exit 1
+fi
+
+if [ $# -eq 0 ]; then
+    set -- $(cd "$DIR" && ls *.lox | sed 's/\.lox$//')
+fi
+
+status=0
+for name in "$@"; do
+    script="$DIR/$name.lox"
+    if [ ! -f "$script" ]; then
+        echo "bench: no workload '$name'" >&2
+        status=1
+        continue
+    fi
+
+    run=1
+    while [ $run -le $RUNS ]; do
+        # Compiled code gets cached next to the script, keep runs comparable.
+        rm -f "${script}c"
+        line=$("$LOX" $FLAGS "$script" 2>&1 >/dev/null | grep '^{"status"')
+        if [ -z "$line" ]; then
+            line='{"status": -1}'
+            status=1
+        fi
+        echo "$line" | sed "s/^{/{\"bench\": \"$name\", \"run\": $run, /"
+        run=$((run + 1))
+    done
+    rm -f "${script}c"
+done
+
+exit $status
@@ -0,0 +1,151 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "alloc.h"
+
+struct _cell {
+    cell_t *next;
+};
+
+// Padded so whatever follows a page header stays aligned.
+struct _page {
+    page_t *next;
+    uint8_t pad[SLAB_GRAIN - sizeof(page_t *)];
+};
+
+#define SLAB_MAX            (SLAB_GRAIN * SLAB_CLASSES)
+#define SIZE_CLASS(size)    (((size) - 1) / SLAB_GRAIN)
+#define ALIGN(size)         (((size) + SLAB_GRAIN - 1) & ~(size_t)(SLAB_GRAIN - 1))
+
+static page_t *newPage(page_t **pages, size_t size)
+{
+    page_t *page = malloc(sizeof(page_t) + size);
+    if (page == NULL) exit(1);
+
+    page->next = *pages;
+    *pages = page;
+    return page;
+}
+
+static void freePages(page_t *page)
+{
+    while (page != NULL) {
+        page_t *next = page->next;
+        free(page);
+        page = next;
+    }
+}
+
+void slab_init(slab_t *slab)
+{
+    for (int i = 0; i < SLAB_CLASSES; i++) slab->free[i] = NULL;
+    slab->pages = NULL;
+    slab->cursor = NULL;
+    slab->end = NULL;
+}
+
+void slab_free(slab_t *slab)
+{
+    freePages(slab->pages);
+    slab_init(slab);
+}
+
+void *slab_alloc(slab_t *slab, size_t size)
+{
+    if (size > SLAB_MAX) return malloc(size);
+    if (size == 0) size = 1;
+
+    int class = SIZE_CLASS(size);
+    cell_t *cell = slab->free[class];
+    if (cell != NULL) {
+        slab->free[class] = cell->next;
+        return cell;
+    }
+
+    // What is left of a page after the last cell is given up.
+    size_t cellSize = (class + 1) * SLAB_GRAIN;
+    if (slab->cursor == NULL || slab->cursor + cellSize > slab->end) {
+        page_t *page = newPage(&slab->pages, SLAB_PAGE);
+        slab->cursor = (uint8_t *)(page + 1);
+        slab->end = slab->cursor + SLAB_PAGE;
+    }
+
+    void *ptr = slab->cursor;
+    slab->cursor += cellSize;
+    return ptr;
+}
+
+void slab_release(slab_t *slab, void *ptr, size_t size)
+{
+    if (ptr == NULL) return;
+    if (size > SLAB_MAX) {
+        free(ptr);
+        return;
+    }
+    if (size == 0) size = 1;
+
+    cell_t *cell = ptr;
+    int class = SIZE_CLASS(size);
+    cell->next = slab->free[class];
+    slab->free[class] = cell;
+}
+
+void *slab_realloc(slab_t *slab, void *ptr, size_t old, size_t new)
+{
+    if (ptr == NULL) return slab_alloc(slab, new);
+    if (old > SLAB_MAX && new > SLAB_MAX) return realloc(ptr, new);
+    if (old != 0 && new != 0 && old <= SLAB_MAX && new <= SLAB_MAX &&
+        SIZE_CLASS(old) == SIZE_CLASS(new)) {
+        return ptr;
+    }
+
+    void *moved = slab_alloc(slab, new);
+    memcpy(moved, ptr, old < new ? old : new);
+    slab_release(slab, ptr, old);
+    return moved;
+}
+
+void arena_init(arena_t *arena)
+{
+    arena->blocks = NULL;
+    arena->cursor = NULL;
+    arena->end = NULL;
+    arena->last = NULL;
+}
+
+void arena_free(arena_t *arena)
+{
+    freePages(arena->blocks);
+    arena_init(arena);
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    size = ALIGN(size);
+
+    if (arena->cursor == NULL || arena->cursor + size > arena->end) {
+        size_t blockSize = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        page_t *block = newPage(&arena->blocks, blockSize);
+        arena->cursor = (uint8_t *)(block + 1);
+        arena->end = arena->cursor + blockSize;
+    }
+
+    arena->last = arena->cursor;
+    arena->cursor += size;
+    return arena->last;
+}
+
+void *arena_realloc(arena_t *arena, void *ptr, size_t old, size_t new)
+{
+    if (ptr == NULL) return arena_alloc(arena, new);
+
+    // The latest allocation grows into the rest of its block.
+    if (ptr == arena->last && (uint8_t *)ptr + ALIGN(new) <= arena->end) {
+        arena->cursor = (uint8_t *)ptr + ALIGN(new);
+        return ptr;
+    }
+
+    void *moved = arena_alloc(arena, new);
+    memcpy(moved, ptr, old < new ? old : new);
+    return moved;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "common.h"
+
+#define SLAB_GRAIN          16
+#define SLAB_CLASSES        16                      // sizes up to SLAB_GRAIN * SLAB_CLASSES
+#define SLAB_PAGE           (64 * 1024)
+#define ARENA_BLOCK         (64 * 1024)
+
+typedef struct _cell cell_t;
+typedef struct _page page_t;
+
+// Small blocks carved out of big pages, kept on one free list per size
+// class once released. Pages go back only when the slab is freed, bigger
+// sizes are passed on to malloc.
+typedef struct {
+    cell_t *free[SLAB_CLASSES];
+    page_t *pages;
+    uint8_t *cursor;    // unused part of the newest page
+    uint8_t *end;
+} slab_t;
+
+void slab_init(slab_t *slab);
+void slab_free(slab_t *slab);
+
+void *slab_alloc(slab_t *slab, size_t size);
+void slab_release(slab_t *slab, void *ptr, size_t size);
+void *slab_realloc(slab_t *slab, void *ptr, size_t old, size_t new);
+
+// Bump allocator whose blocks are only ever freed all at once.
+typedef struct {
+    page_t *blocks;
+    uint8_t *cursor;
+    uint8_t *end;
+    void *last;         // latest allocation, the one that can grow in place
+} arena_t;
+
+void arena_init(arena_t *arena);
+void arena_free(arena_t *arena);
+
+void *arena_alloc(arena_t *arena, size_t size);
+void *arena_realloc(arena_t *arena, void *ptr, size_t old, size_t new);
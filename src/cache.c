@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "cache.h"
+#include "dump.h"
+#include "object.h"
+#include "vm.h"
+
+typedef struct {
+    char magic[4];
+    uint16_t version;
+    uint16_t opcodes;   // any change to the instruction set invalidates
+    uint32_t valsize;   // and so does a different value layout
+    uint32_t hash;
+    uint32_t optimize;  // code differs between optimizer levels
+    uint32_t debug;     // positions were kept
+    int64_t mtime;
+    uint64_t size;
+    uint64_t length;    // bytes of dump after the header
+} header_t;
+
+static void makeHeader(vm_t *vm, header_t *header, src_t *source, const char *path)
+{
+    struct stat st;
+
+    memset(header, 0, sizeof(header_t));
+    memcpy(header->magic, "LOXC", 4);
+    header->version = CACHE_VERSION;
+    header->opcodes = OPCODE_COUNT;
+    header->valsize = sizeof(val_t);
+    header->hash = hash_bytes(source->buffer, source->size);
+    header->optimize = vm->optimize;
+    header->debug = vm->debug != 0;
+    header->mtime = (stat(path, &st) == 0) ? (int64_t)st.st_mtime : 0;
+    header->size = source->size;
+}
+
+static char *cachePath(const char *path)
+{
+    size_t length = strlen(path);
+    char *cpath = malloc(length + 2);
+    memcpy(cpath, path, length);
+    cpath[length] = 'c';
+    cpath[length + 1] = '\0';
+    return cpath;
+}
+
+#ifdef _WIN32
+static uint8_t *mapFile(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+
+    uint8_t *bytes = malloc(*size);
+    if (bytes != NULL && fread(bytes, 1, *size, file) < *size) {
+        free(bytes);
+        bytes = NULL;
+    }
+
+    fclose(file);
+    return bytes;
+}
+
+static void unmapFile(uint8_t *bytes, size_t size)
+{
+    free(bytes);
+}
+#else
+static uint8_t *mapFile(const char *path, size_t *size)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    void *bytes = NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        *size = st.st_size;
+        bytes = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (bytes == MAP_FAILED) bytes = NULL;
+    }
+
+    close(fd);
+    return bytes;
+}
+
+static void unmapFile(uint8_t *bytes, size_t size)
+{
+    munmap(bytes, size);
+}
+#endif
+
+fun_t *cache_load(vm_t *vm, src_t *source, const char *path)
+{
+    char *cpath = cachePath(path);
+    size_t size = 0;
+    uint8_t *bytes = mapFile(cpath, &size);
+    free(cpath);
+    if (bytes == NULL) return NULL;
+
+    header_t header;
+    makeHeader(vm, &header, source, path);
+    header.length = size - sizeof(header_t);
+
+    if (size < sizeof(header_t) || memcmp(bytes, &header, sizeof(header_t)) != 0) {
+        unmapFile(bytes, size);
+        return NULL;
+    }
+
+    dump_t dump;
+    dump_init(&dump);
+    dump.source = source;
+    dump_load(&dump, bytes + sizeof(header_t), (int)header.length);
+
+    // The code addresses globals by slot, they have to land where they
+    // were when the script got compiled.
+    fun_t *function = NULL;
+    if (vm_loadslots(vm, &dump)) {
+        function = AS_FUN(dump_read(vm, &dump));
+    }
+
+    dump_free(&dump);
+    unmapFile(bytes, size);
+    return function;
+}
+
+void cache_save(vm_t *vm, fun_t *function, src_t *source, const char *path)
+{
+    dump_t dump;
+    dump_init(&dump);
+    dump.source = source;
+    dump.strip = !vm->debug;
+
+    vm_dumpslots(vm, &dump);
+    dump_write(&dump, VAL_OBJ(function));
+
+    header_t header;
+    makeHeader(vm, &header, source, path);
+    header.length = dump.count;
+
+    // Written aside and renamed, so a concurrent run never maps half a file.
+    char *cpath = cachePath(path);
+    char *tmp = malloc(strlen(cpath) + 16);
+    sprintf(tmp, "%s.%d", cpath, (int)getpid());
+
+    FILE *file = fopen(tmp, "wb");
+    if (file != NULL) {
+        bool written = fwrite(&header, sizeof(header_t), 1, file) == 1 &&
+                       fwrite(dump.bytes, 1, dump.count, file) == (size_t)dump.count;
+        fclose(file);
+#ifdef _WIN32
+        if (written) remove(cpath);
+#endif
+        if (!written || rename(tmp, cpath) != 0) remove(tmp);
+    }
+
+    free(tmp);
+    free(cpath);
+    dump_free(&dump);
+}
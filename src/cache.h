@@ -0,0 +1,12 @@
+#pragma once
+
+#include "common.h"
+#include "value.h"
+
+#define CACHE_VERSION   4
+
+// Compiled scripts are kept next to their source as <fname>c, valid as
+// long as the source keeps its mtime, size and hash and the optimizer
+// level stays the same. Positions are left out when vm->debug is 0.
+fun_t *cache_load(vm_t *vm, src_t *source, const char *path);
+void cache_save(vm_t *vm, fun_t *function, src_t *source, const char *path);
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 
@@ -9,15 +10,24 @@ void chunk_init(chunk_t *chunk, src_t *source)
     chunk->capacity = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->positions = NULL;
+    chunk->positionSize = 0;
     chunk->source = source;
+    chunk->cacheCount = 0;
+    chunk->caches = NULL;
+    chunk->arena = NULL;
 
     arr_init(&chunk->constants);
 }
 
 void chunk_free(chunk_t *chunk)
 {
-    free(chunk->code);
+    if (chunk->arena == NULL) {
+        free(chunk->code);
+        free(chunk->positions);
+    }
     free(chunk->lines);
+    free(chunk->caches);
 
     arr_free(&chunk->constants);
     chunk_init(chunk, NULL);
@@ -26,13 +36,179 @@ void chunk_free(chunk_t *chunk)
 void chunk_emit(chunk_t *chunk, uint8_t byte, int ln, int col)
 {
     if (chunk->count >= chunk->capacity) {
-        chunk->capacity += CHUNK_CODEPAGE;
-        chunk->code = realloc(chunk->code, chunk->capacity * sizeof(uint8_t));
-        chunk->lines = realloc(chunk->lines, chunk->capacity * sizeof(uint32_t));
+        int old = chunk->capacity;
+        chunk->capacity = old < CHUNK_CODEPAGE ? CHUNK_CODEPAGE : old * 2;
+
+        if (chunk->arena != NULL) {
+            chunk->code = arena_realloc(chunk->arena, chunk->code,
+                old * sizeof(uint8_t), chunk->capacity * sizeof(uint8_t));
+        }
+        else {
+            chunk->code = realloc(chunk->code, chunk->capacity * sizeof(uint8_t));
+        }
+        // Freed once sealed, even where the code lives in the arena.
+        chunk->lines = realloc(chunk->lines, chunk->capacity * sizeof(pos_t));
     }
 
-    uint32_t line = ((ln & 0xFFFF) << 16) | (col & 0xFFFF);
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
+    chunk->lines[chunk->count].line = ln;
+    chunk->lines[chunk->count].column = col;
     chunk->count++;
 }
+
+// The table holds a run for every stretch of bytes at the same position:
+// its length, then the line and the column as differences to the run
+// before. Each is a varint of 7 bits a byte, the differences zigzagged
+// so small negative ones stay small too.
+static int putVarint(uint8_t *out, uint32_t value)
+{
+    int length = 0;
+    while (value >= 0x80) {
+        out[length++] = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (uint8_t)value;
+    return length;
+}
+
+static uint32_t getVarint(const uint8_t **in)
+{
+    uint32_t value = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+        byte = *(*in)++;
+        value |= (uint32_t)(byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+static uint32_t zigzag(int value)
+{
+    return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static int unzigzag(uint32_t value)
+{
+    return (int)(value >> 1) ^ -(int)(value & 1);
+}
+
+void chunk_seal(chunk_t *chunk)
+{
+    if (chunk->lines == NULL) return;
+
+    // At most three varints of 5 bytes for every byte of code.
+    uint8_t *table = malloc(chunk->count * 15 + 1);
+    int size = 0, line = 0, column = 0;
+
+    for (int start = 0; start < chunk->count; ) {
+        pos_t position = chunk->lines[start];
+        int end = start + 1;
+        while (end < chunk->count && chunk->lines[end].line == position.line &&
+               chunk->lines[end].column == position.column) end++;
+
+        int ln = position.line, col = position.column;
+        size += putVarint(table + size, end - start);
+        size += putVarint(table + size, zigzag(ln - line));
+        size += putVarint(table + size, zigzag(col - column));
+        line = ln;
+        column = col;
+        start = end;
+    }
+
+    if (chunk->arena != NULL) {
+        chunk->positions = arena_alloc(chunk->arena, size);
+        memcpy(chunk->positions, table, size);
+        free(table);
+    } else {
+        chunk->positions = realloc(table, size > 0 ? size : 1);
+    }
+    chunk->positionSize = size;
+
+    free(chunk->lines);
+    chunk->lines = NULL;
+}
+
+pos_t chunk_position(const chunk_t *chunk, int offset)
+{
+    if (chunk->lines != NULL) return chunk->lines[offset];
+
+    const uint8_t *in = chunk->positions, *end = in + chunk->positionSize;
+    pos_t position = { 0, 0 };
+    int start = 0;
+    while (in < end) {
+        start += getVarint(&in);
+        position.line += unzigzag(getVarint(&in));
+        position.column += unzigzag(getVarint(&in));
+        if (offset < start) return position;
+    }
+
+    position.line = position.column = 0;
+    return position;
+}
+
+int chunk_cache(chunk_t *chunk)
+{
+    chunk->caches = realloc(chunk->caches, (chunk->cacheCount + 1) * sizeof(icache_t));
+
+    icache_t *cache = &chunk->caches[chunk->cacheCount];
+    cache->shape = NULL;
+    cache->next = NULL;
+    cache->offset = 0;
+    return chunk->cacheCount++;
+}
+
+int chunk_oplen(uint8_t op)
+{
+    switch (op) {
+        case OP_PRINT:
+        case OP_CALL:
+        case OP_TAILCALL:
+        case OP_ABS:
+        case OP_FLOOR:
+        case OP_SQRT:
+        case OP_CONST:
+        case OP_LD:
+        case OP_ST:
+        case OP_STP:
+        case OP_MAP:
+            return 2;
+        case OP_DEFS:
+        case OP_GLDS:
+        case OP_GSTS:
+        case OP_GSTSP:
+        case OP_JMP:
+        case OP_JMPF:
+        case OP_JMPFP:
+        case OP_LOOP:
+        case OP_CONST_W:
+            return 3;
+        case OP_GET:
+        case OP_GET_FIELD:
+        case OP_SET:
+        case OP_RADD:
+        case OP_RSUB:
+        case OP_RMUL:
+        case OP_RDIV:
+        case OP_RGETI:
+        case OP_JMP_W:
+        case OP_JMPF_W:
+        case OP_JMPFP_W:
+        case OP_LOOP_W:
+            return 4;
+        case OP_RLT:
+        case OP_RLE:
+        case OP_REQ:
+        case OP_RNE:
+        case OP_RGT:
+        case OP_RGE:
+            return 5;
+        case OP_FORPREP:
+            return 6;
+        case OP_FORLOOP:
+            return 7;
+        default:
+            return 1;
+    }
+}
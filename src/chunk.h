@@ -2,12 +2,14 @@
 
 #include "common.h"
 #include "value.h"
+#include "alloc.h"
 
 #define OPCODES() \
 /*        opcodes      args     stack       description */ \
     _CODE(PRINT)   	/* []       [-1, +0]    pop a value from stack */ \
     _CODE(POP)     	/* []       [-1, +0]    pop a value from stack and print it */ \
     _CODE(CALL)    	/* [n]      [-n, +1]    */ \
+    _CODE(TAILCALL)	/* [n]      [-n, +1]    CALL that reuses the frame of the caller, a RET follows */ \
     _CODE(RET)     	/* []       [-1, +0]    */ \
     _CODE(NIL)     	/* []       [-0, +1]    push nil to stack */ \
     _CODE(TRUE)    	/* []       [-0, +1]    push true to stack */ \
@@ -18,43 +20,116 @@
     _CODE(LT)      	/* []       [-1, +1]    */ \
     _CODE(LE)      	/* []       [-1, +1]    */ \
     _CODE(EQ)      	/* []       [-1, +1]    */ \
+    _CODE(NE)      	/* []       [-1, +1]    EQ, NOT */ \
+    _CODE(GT)      	/* []       [-1, +1]    LE, NOT */ \
+    _CODE(GE)      	/* []       [-1, +1]    LT, NOT */ \
     _CODE(ADD)     	/* []       [-2, +1]    */ \
     _CODE(SUB)     	/* []       [-2, +1]    */ \
     _CODE(MUL)     	/* []       [-2, +1]    */ \
     _CODE(DIV)     	/* []       [-2, +1]    */ \
-    _CODE(DEF)     	/* [k]      [-1, +0]    pop a value from stack and define as (k) in global */ \
-    _CODE(GLD)     	/* [k]      [-0, +1]    push a from (k) in global to stack */ \
-    _CODE(GST)     	/* [k]      [-0, +0]    set a value from stack as (k) in global */ \
+    _CODE(DEFS)    	/* [g, g]   [-1, +0]    pop a value from stack and define it in global slot (g) */ \
+    _CODE(GLDS)    	/* [g, g]   [-0, +1]    push the value of global slot (g) to stack */ \
+    _CODE(GSTS)    	/* [g, g]   [-0, +0]    set a value from stack to global slot (g) */ \
     _CODE(JMP)     	/* [s, s]   [-0, +0]    */ \
     _CODE(JMPF)    	/* [s, s]   [-1, +0]    */ \
+    _CODE(JMPFP)   	/* [s, s]   [-1, +0]    pop a value from stack, jump if it is false */ \
+    _CODE(LOOP)    	/* [s, s]   [-0, +0]    jump back by (s) */ \
     _CODE(LD)      	/* [s]      [-0, +1]    */ \
     _CODE(ST)      	/* [s]      [-0, +0]    */ \
+    _CODE(STP)     	/* [s]      [-1, +0]    ST, POP */ \
+    _CODE(GSTSP)   	/* [g, g]   [-1, +0]    GSTS, POP */ \
     _CODE(MAP)      /* []       [-0, +1]    */ \
-    _CODE(GET)      \
-    _CODE(SET)      \
+    _CODE(GET)      /* [k, c, c]        get field (k) of a map, through inline cache (c) */ \
+    _CODE(SET)      /* [k, c, c]        set field (k) of a map, through inline cache (c) */ \
     _CODE(GETI)     \
-    _CODE(SETI)
+    _CODE(SETI)     \
+/*        register forms, operands: a = register, b/c = register or constant (RK) */ \
+    _CODE(RADD)     /* [a, b, c]        R(a) = RK(b) + RK(c) */ \
+    _CODE(RSUB)     /* [a, b, c]        R(a) = RK(b) - RK(c) */ \
+    _CODE(RMUL)     /* [a, b, c]        R(a) = RK(b) * RK(c) */ \
+    _CODE(RDIV)     /* [a, b, c]        R(a) = RK(b) / RK(c) */ \
+    _CODE(RGETI)    /* [a, b, c]        R(a) = R(b)[RK(c)] */ \
+    _CODE(RLT)      /* [b, c, s, s]     jump if not RK(b) < RK(c) */ \
+    _CODE(RLE)      /* [b, c, s, s]     jump if not RK(b) <= RK(c) */ \
+    _CODE(REQ)      /* [b, c, s, s]     jump if not RK(b) == RK(c) */ \
+    _CODE(RNE)      /* [b, c, s, s]     jump if not RK(b) != RK(c) */ \
+    _CODE(RGT)      /* [b, c, s, s]     jump if not RK(b) > RK(c) */ \
+    _CODE(RGE)      /* [b, c, s, s]     jump if not RK(b) >= RK(c) */ \
+/*        numeric for loops, m is the comparison of the condition (OP_LT, OP_LE, OP_GT or OP_GE) */ \
+    _CODE(FORPREP)  /* [a, b, m, s, s]      jump if not R(a) m RK(b) */ \
+    _CODE(FORLOOP)  /* [a, b, c, m, s, s]   R(a) += RK(c), jump back if R(a) m RK(b) */ \
+/*        quickened forms, the generic opcode rewrites itself into one after seeing its operands, */ \
+/*        they turn back into it when their guard fails */ \
+    _CODE(ADD_NN)   /* []       [-2, +1]    ADD of two numbers */ \
+    _CODE(SUB_NN)   /* []       [-2, +1]    SUB of two numbers */ \
+    _CODE(MUL_NN)   /* []       [-2, +1]    MUL of two numbers */ \
+    _CODE(DIV_NN)   /* []       [-2, +1]    DIV of two numbers */ \
+    _CODE(LT_NN)    /* []       [-1, +1]    LT of two numbers */ \
+    _CODE(LE_NN)    /* []       [-1, +1]    LE of two numbers */ \
+    _CODE(GETI_ARR) /* []       [-2, +1]    GETI of a number within the array part of a map */ \
+    _CODE(GET_FIELD)/* [k, c, c]        GET of a map whose shape is in cache (c) */ \
+    _CODE(ABS)      /* [n]      [-2, +1]    CALL of the abs intrinsic on a number */ \
+    _CODE(FLOOR)    /* [n]      [-2, +1]    CALL of the floor intrinsic on a number */ \
+    _CODE(SQRT)     /* [n]      [-2, +1]    CALL of the sqrt intrinsic on a number */ \
+/*        wide forms, for functions with more constants or code than the operands above reach */ \
+    _CODE(CONST_W)  /* [k, k]   [-0, +1]    CONST of a 16 bit index */ \
+    _CODE(JMP_W)    /* [s, s, s]    [-0, +0]    JMP by a 24 bit offset */ \
+    _CODE(JMPF_W)   /* [s, s, s]    [-1, +0]    JMPF by a 24 bit offset */ \
+    _CODE(JMPFP_W)  /* [s, s, s]    [-1, +0]    JMPFP by a 24 bit offset */ \
+    _CODE(LOOP_W)   /* [s, s, s]    [-0, +0]    LOOP by a 24 bit offset */
 
 #define _CODE(x)    OP_##x,
 typedef enum { OPCODES() OPCODE_COUNT } opcode_t;
 #undef _CODE
 
+// Register operands are frame slots. An RK operand with the high bit
+// set names a constant instead, a destination of R_PUSH pushes the
+// result to the stack.
+#define RK_CONST            0x80
+#define R_PUSH              0xFF
+
+// Inline cache of a GET/SET site, remembers where the field lives
+// in maps of the last seen shape.
+typedef struct {
+    struct _shape *shape;
+    struct _shape *next;    // shape after the field was added, SET only
+    int offset;
+} icache_t;
+
+// Where a byte of code came from, line 0 where unknown.
+typedef struct {
+    int line;
+    int column;
+} pos_t;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t *code;
-    uint32_t *lines;
+    pos_t *lines;           // position of every byte while compiling, NULL once sealed
+    uint8_t *positions;     // encoded by chunk_seal, NULL if left out of a cache
+    int positionSize;
     src_t *source;
     arr_t constants;
+    int cacheCount;
+    icache_t *caches;
+    arena_t *arena;     // if set, code and positions live there or in a program and are not freed with the chunk
 } chunk_t;
 
 void chunk_init(chunk_t *chunk, src_t *source);
 void chunk_free(chunk_t *chunk);
 void chunk_emit(chunk_t *chunk, uint8_t byte, int ln, int col);
+// Replaces the positions of the bytes by a compact table once the code
+// is final. Only errors, the profiler and the sampler read them back.
+void chunk_seal(chunk_t *chunk);
+pos_t chunk_position(const chunk_t *chunk, int offset);
+int chunk_cache(chunk_t *chunk);
+// Bytes taken by an instruction, opcode included.
+int chunk_oplen(uint8_t op);
 
 #define CHUNK_CODEPAGE      256
-#define CHUNK_GETLN(c, i)   (((c)->lines)[i] >> 16 & 0xFFFF)
-#define CHUNK_GETCOL(c, i)  (((c)->lines)[i] & 0xFFFF)
+#define CHUNK_GETLN(c, i)   (chunk_position(c, i).line)
+#define CHUNK_GETCOL(c, i)  (chunk_position(c, i).column)
 
 static const char *opcode_tostr(opcode_t opcode) {
 #define _CODE(x) #x,
@@ -16,17 +16,33 @@
 
 #define GROW_CAPACITY(x)    ((x) < 8 ? 8 : (x) * 2)
 
-#define FRAMES_MAX          64
+// Both stacks start small and grow on demand, up to the limits of the
+// vm which default to the _MAX values.
+#define FRAMES_INIT         16
+#define FRAMES_MAX          4096
+#define STACK_FRAME         (2 * UINT8_COUNT)   // values a call may push on top of its arguments
+#define STACK_INIT          (2 * STACK_FRAME)
 #define STACK_MAX           (FRAMES_MAX * UINT8_COUNT)
 
 #define VM_INIT_ERROR       -1
 #define VM_OK               0
 #define VM_COMPILE_ERROR    1
 #define VM_RUNTIME_ERROR    2
+#define VM_SUSPENDED        3
 
 #define DEBUG_PRINT_CODE
+//#define DEBUG_STRESS_GC
+// Count and time every dispatched instruction, see profile.h.
+//#define DEBUG_PROFILE
 
+// Pack every value into a single 64-bit word.
+//#define NAN_BOXING
+
+#ifdef NAN_BOXING
+typedef uint64_t val_t;
+#else
 typedef struct _val val_t;
+#endif
 typedef struct _vm  vm_t;
 typedef struct _gc  gc_t;
 
@@ -0,0 +1,354 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "dump.h"
+#include "object.h"
+#include "vm.h"
+#include "gc.h"
+
+typedef enum {
+    DUMP_VAL,
+    DUMP_REF,
+    DUMP_STR,
+    DUMP_FUN,
+    DUMP_MAP
+} tag_t;
+
+void dump_init(dump_t *dump)
+{
+    dump->count = 0;
+    dump->capacity = 0;
+    dump->bytes = NULL;
+    dump->offset = 0;
+    hash_init(&dump->written);
+    arr_init(&dump->loaded);
+    dump->source = NULL;
+    dump->borrowed = false;
+    dump->strip = false;
+    dump->arena = NULL;
+}
+
+void dump_free(dump_t *dump)
+{
+    if (!dump->borrowed) free(dump->bytes);
+    hash_free(&dump->written);
+    arr_free(&dump->loaded);
+    dump_init(dump);
+}
+
+static void writeBytes(dump_t *dump, const void *bytes, int size)
+{
+    if (dump->count + size > dump->capacity) {
+        while (dump->count + size > dump->capacity) {
+            dump->capacity = GROW_CAPACITY(dump->capacity);
+        }
+        dump->bytes = realloc(dump->bytes, dump->capacity);
+    }
+
+    memcpy(dump->bytes + dump->count, bytes, size);
+    dump->count += size;
+}
+
+static void writeInt(dump_t *dump, int value)
+{
+    int32_t i = value;
+    writeBytes(dump, &i, sizeof(i));
+}
+
+static void writeStr(dump_t *dump, obj_t *string)
+{
+    int length;
+    const char *chars = str_chars(string, &length);
+    writeInt(dump, length);
+    writeBytes(dump, chars, length);
+}
+
+// Writes a reference if the object was written before, otherwise
+// numbers it and lets the caller write it out.
+static bool writeRef(dump_t *dump, obj_t *object)
+{
+    uint64_t key = (uintptr_t)object;
+    val_t index;
+
+    if (hash_get(&dump->written, key, &index)) {
+        uint8_t tag = DUMP_REF;
+        writeBytes(dump, &tag, 1);
+        writeInt(dump, AS_INT(index));
+        return true;
+    }
+
+    hash_set(&dump->written, key, VAL_NUM(dump->written.count));
+    return false;
+}
+
+static void writeFields(dump_t *dump, map_t *map, shape_t *shape)
+{
+    if (shape->parent == NULL) return;
+
+    // In insertion order, so the reader rebuilds the same shape.
+    writeFields(dump, map, shape->parent);
+    writeStr(dump, (obj_t *)shape->key);
+    dump_write(dump, map->fields[shape->count - 1]);
+}
+
+static void writeFunction(dump_t *dump, fun_t *function)
+{
+    chunk_t *chunk = &function->chunk;
+
+    writeInt(dump, function->arity);
+    dump_write(dump, function->name != NULL ? VAL_OBJ(function->name) : VAL_NIL);
+    if (dump->source == NULL) {
+        writeBytes(dump, &chunk->source, sizeof(chunk->source));
+    }
+    writeInt(dump, chunk->count);
+    writeBytes(dump, chunk->code, chunk->count * sizeof(uint8_t));
+    int positions = dump->strip ? 0 : chunk->positionSize;
+    writeInt(dump, positions);
+    if (positions > 0) writeBytes(dump, chunk->positions, positions);
+    writeInt(dump, chunk->cacheCount);
+    writeInt(dump, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        dump_write(dump, chunk->constants.values[i]);
+    }
+}
+
+static void writeMap(dump_t *dump, map_t *map)
+{
+    writeInt(dump, map->arrayCount);
+    for (int i = 0; i < map->arrayCount; i++) {
+        dump_write(dump, map->array[i]);
+    }
+
+    int count = 0;
+    for (int i = 0; i < map->hash.capacity; i++) {
+        if (map->hash.indexes[i].key != HASH_UNUSED) count++;
+    }
+    writeInt(dump, count);
+    for (int i = 0; i < map->hash.capacity; i++) {
+        index_t *index = &map->hash.indexes[i];
+        if (index->key == HASH_UNUSED) continue;
+        writeBytes(dump, &index->key, sizeof(index->key));
+        dump_write(dump, index->value);
+    }
+
+    if (map->shape != NULL) {
+        writeInt(dump, map->shape->count);
+        writeFields(dump, map, map->shape);
+    }
+    else {
+        // A negative count marks a dictionary.
+        count = 0;
+        for (int i = 0; i < map->table.capacity; i++) {
+            if (map->table.entries[i].key != NULL) count++;
+        }
+        writeInt(dump, -1 - count);
+        for (int i = 0; i < map->table.capacity; i++) {
+            ent_t *entry = &map->table.entries[i];
+            if (entry->key == NULL) continue;
+            writeStr(dump, (obj_t *)entry->key);
+            dump_write(dump, entry->value);
+        }
+    }
+}
+
+void dump_write(dump_t *dump, val_t value)
+{
+    // Fibers run on the heap they were spawned on, elsewhere they are nil.
+    if (IS_OBJ(value) && OBJ_TYPE(value) == OT_FIBER) value = VAL_NIL;
+
+    if (!IS_OBJ(value)) {
+        uint8_t tag = DUMP_VAL;
+        writeBytes(dump, &tag, 1);
+        writeBytes(dump, &value, sizeof(val_t));
+        return;
+    }
+
+    obj_t *object = AS_OBJ(value);
+    if (writeRef(dump, object)) return;
+
+    uint8_t tag;
+    switch (object->type) {
+        case OT_STR:
+        case OT_ROPE:
+            tag = DUMP_STR;
+            writeBytes(dump, &tag, 1);
+            writeStr(dump, object);
+            break;
+        case OT_FUN:
+            tag = DUMP_FUN;
+            writeBytes(dump, &tag, 1);
+            writeFunction(dump, (fun_t *)object);
+            break;
+        case OT_MAP:
+            tag = DUMP_MAP;
+            writeBytes(dump, &tag, 1);
+            writeMap(dump, (map_t *)object);
+            break;
+        case OT_FIBER:
+            // Written as nil above, before it could take a number.
+            break;
+    }
+}
+
+void dump_list(dump_t *dump, val_t *values, int count)
+{
+    // Laid out as a map holding only an array part, the number it
+    // takes is not used by the written values.
+    uint8_t tag = DUMP_MAP;
+    writeBytes(dump, &tag, 1);
+    hash_set(&dump->written, HASH_UNUSED - 1 - dump->written.count, VAL_NIL);
+
+    writeInt(dump, count);
+    for (int i = 0; i < count; i++) {
+        dump_write(dump, values[i]);
+    }
+    writeInt(dump, 0);
+    writeInt(dump, 0);
+}
+
+static void readBytes(dump_t *dump, void *bytes, int size)
+{
+    memcpy(bytes, dump->bytes + dump->offset, size);
+    dump->offset += size;
+}
+
+static int readInt(dump_t *dump)
+{
+    int32_t i;
+    readBytes(dump, &i, sizeof(i));
+    return i;
+}
+
+static str_t *readStr(vm_t *vm, dump_t *dump)
+{
+    int length = readInt(dump);
+    const char *chars = (const char *)dump->bytes + dump->offset;
+    dump->offset += length;
+    return str_copy(vm, chars, length);
+}
+
+static fun_t *readFunction(vm_t *vm, dump_t *dump)
+{
+    src_t *source = dump->source;
+    fun_t *function = fun_new(vm, NULL);
+    chunk_t *chunk = &function->chunk;
+    arr_add(&dump->loaded, VAL_OBJ(function), true);
+
+    function->arity = readInt(dump);
+    val_t name = dump_read(vm, dump);
+    function->name = IS_NIL(name) ? NULL : AS_STR(name);
+    if (dump->source == NULL) {
+        readBytes(dump, &source, sizeof(source));
+    }
+    chunk->source = source;
+
+    // The code gets quickened in place, only the positions can be shared.
+    chunk->count = chunk->capacity = readInt(dump);
+    chunk->arena = dump->arena;
+    if (chunk->arena != NULL) {
+        chunk->code = arena_alloc(chunk->arena, chunk->count * sizeof(uint8_t));
+    }
+    else {
+        chunk->code = malloc(chunk->count * sizeof(uint8_t));
+    }
+    readBytes(dump, chunk->code, chunk->count * sizeof(uint8_t));
+    chunk->positionSize = readInt(dump);
+    if (chunk->positionSize > 0 && chunk->arena != NULL) {
+        chunk->positions = dump->bytes + dump->offset;
+        dump->offset += chunk->positionSize;
+    }
+    else if (chunk->positionSize > 0) {
+        chunk->positions = malloc(chunk->positionSize);
+        readBytes(dump, chunk->positions, chunk->positionSize);
+    }
+
+    // Caches refer to shapes of the writing heap, start them cold.
+    int caches = readInt(dump);
+    for (int i = 0; i < caches; i++) {
+        chunk_cache(chunk);
+    }
+
+    int constants = readInt(dump);
+    for (int i = 0; i < constants; i++) {
+        arr_add(&chunk->constants, dump_read(vm, dump), true);
+    }
+
+    return function;
+}
+
+static map_t *readMap(vm_t *vm, dump_t *dump)
+{
+    int count = readInt(dump);
+    map_t *map = map_new(vm, count, 0);
+    arr_add(&dump->loaded, VAL_OBJ(map), true);
+
+    for (int i = 0; i < count; i++) {
+        map->array[i] = dump_read(vm, dump);
+    }
+    map->arrayCount = count;
+
+    count = readInt(dump);
+    for (int i = 0; i < count; i++) {
+        uint64_t key;
+        readBytes(dump, &key, sizeof(key));
+        hash_set(&map->hash, key, dump_read(vm, dump));
+    }
+
+    count = readInt(dump);
+    bool dictionary = count < 0;
+    if (dictionary) count = -1 - count;
+
+    for (int i = 0; i < count; i++) {
+        str_t *key = readStr(vm, dump);
+        val_t value = dump_read(vm, dump);
+        if (dictionary) {
+            map_setstr(vm, map, key, value);
+        }
+        else {
+            map_setfield(vm, map, key, value, NULL);
+        }
+    }
+
+    return map;
+}
+
+val_t dump_read(vm_t *vm, dump_t *dump)
+{
+    uint8_t tag;
+    val_t value = VAL_NIL;
+
+    // Objects are only reachable from the dump until the read is done.
+    vm->gc->paused++;
+    readBytes(dump, &tag, 1);
+
+    switch (tag) {
+        case DUMP_VAL:
+            readBytes(dump, &value, sizeof(val_t));
+            break;
+        case DUMP_REF:
+            value = dump->loaded.values[readInt(dump)];
+            break;
+        case DUMP_STR:
+            value = VAL_OBJ(readStr(vm, dump));
+            arr_add(&dump->loaded, value, true);
+            break;
+        case DUMP_FUN:
+            value = VAL_OBJ(readFunction(vm, dump));
+            break;
+        case DUMP_MAP:
+            value = VAL_OBJ(readMap(vm, dump));
+            break;
+    }
+
+    vm->gc->paused--;
+    return value;
+}
+
+void dump_load(dump_t *dump, const uint8_t *bytes, int count)
+{
+    if (!dump->borrowed) free(dump->bytes);
+    dump->bytes = (uint8_t *)bytes;
+    dump->count = dump->capacity = count;
+    dump->offset = 0;
+    dump->borrowed = true;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "common.h"
+#include "value.h"
+#include "hash.h"
+#include "alloc.h"
+
+// Values flattened into bytes, so they can be handed to a vm that runs
+// on another heap. Objects written twice are stored once and referenced.
+typedef struct {
+    int count;
+    int capacity;
+    uint8_t *bytes;
+    int offset;         // read position
+    hash_t written;     // object -> index, while writing
+    arr_t loaded;       // objects by index, while reading
+    src_t *source;      // if set, functions belong to it and their source is not stored
+    bool borrowed;      // bytes are owned by someone else
+    bool strip;         // functions are written without their positions
+    arena_t *arena;     // if set, functions read have their code there and read their
+                        // positions from the bytes, which must outlive them
+} dump_t;
+
+void dump_init(dump_t *dump);
+void dump_free(dump_t *dump);
+
+void dump_write(dump_t *dump, val_t value);
+void dump_list(dump_t *dump, val_t *values, int count);
+
+// Starts reading bytes written by another dump, they are not copied and
+// must outlive the reads.
+void dump_load(dump_t *dump, const uint8_t *bytes, int count);
+
+// Reads the next value into the heap of vm. Objects referenced from an
+// earlier read must still be reachable.
+val_t dump_read(vm_t *vm, dump_t *dump);
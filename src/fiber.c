@@ -0,0 +1,484 @@
+// For clock_gettime and CLOCK_MONOTONIC under -std=c11.
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fiber.h"
+#include "gc.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+#if defined(FIBER_EPOLL)
+#include <sys/epoll.h>
+#elif defined(FIBER_KQUEUE)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#elif defined(FIBER_POLL)
+#include <poll.h>
+#endif
+
+// Milliseconds since some point in the past.
+static uint64_t clockMs()
+{
+#ifdef _WIN32
+    return GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static sched_t *getSched(vm_t *vm)
+{
+    if (vm->sched != NULL) return vm->sched;
+
+    sched_t *sched = calloc(1, sizeof(sched_t));
+    sched->watch.fd = -1;
+    sched->watch.fiber = NULL;
+#if defined(FIBER_EPOLL)
+    sched->poller = epoll_create1(EPOLL_CLOEXEC);
+#elif defined(FIBER_KQUEUE)
+    sched->poller = kqueue();
+#else
+    sched->poller = -1;
+#endif
+
+    vm->sched = sched;
+    return sched;
+}
+
+void sched_free(sched_t *sched)
+{
+    if (sched == NULL) return;
+
+#if defined(FIBER_EPOLL) || defined(FIBER_KQUEUE)
+    if (sched->poller >= 0) close(sched->poller);
+#endif
+#ifdef FIBER_POLL
+    free(sched->watches);
+    free(sched->writes);
+#endif
+    free(sched->live);
+    free(sched->timers);
+    free(sched);
+}
+
+// Moves the stacks of the vm into ctx.
+static void park(vm_t *vm, ctx_t *ctx)
+{
+    ctx->stack = vm->stack;
+    ctx->top = vm->top;
+    ctx->stackCapacity = vm->stackCapacity;
+    ctx->frames = vm->frames;
+    ctx->frameCount = vm->frameCount;
+    ctx->frameCapacity = vm->frameCapacity;
+}
+
+// Moves the stacks in ctx into the vm, leaving ctx empty.
+static void unpark(vm_t *vm, ctx_t *ctx)
+{
+    vm->stack = ctx->stack;
+    vm->top = ctx->top;
+    vm->stackCapacity = ctx->stackCapacity;
+    vm->frames = ctx->frames;
+    vm->frameCount = ctx->frameCount;
+    vm->frameCapacity = ctx->frameCapacity;
+    memset(ctx, 0, sizeof(ctx_t));
+}
+
+static void addLive(sched_t *s, fiber_t *fiber)
+{
+    if (s->liveCount >= s->liveCapacity) {
+        s->liveCapacity = GROW_CAPACITY(s->liveCapacity);
+        s->live = realloc(s->live, s->liveCapacity * sizeof(fiber_t *));
+    }
+    fiber->index = s->liveCount;
+    s->live[s->liveCount++] = fiber;
+}
+
+static void removeLive(sched_t *s, fiber_t *fiber)
+{
+    fiber_t *last = s->live[--s->liveCount];
+    s->live[fiber->index] = last;
+    last->index = fiber->index;
+    fiber->index = -1;
+}
+
+static void enqueue(sched_t *s, fiber_t *fiber)
+{
+    fiber->state = FIBER_READY;
+    fiber->next = NULL;
+    if (s->readyTail != NULL) {
+        s->readyTail->next = fiber;
+    } else {
+        s->ready = fiber;
+    }
+    s->readyTail = fiber;
+    s->readyCount++;
+}
+
+static fiber_t *dequeue(sched_t *s)
+{
+    fiber_t *fiber = s->ready;
+    s->ready = fiber->next;
+    if (s->ready == NULL) s->readyTail = NULL;
+    fiber->next = NULL;
+    s->readyCount--;
+    return fiber;
+}
+
+static void pushTimer(sched_t *s, fiber_t *fiber)
+{
+    if (s->timerCount >= s->timerCapacity) {
+        s->timerCapacity = GROW_CAPACITY(s->timerCapacity);
+        s->timers = realloc(s->timers, s->timerCapacity * sizeof(fiber_t *));
+    }
+
+    int i = s->timerCount++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (s->timers[parent]->deadline <= fiber->deadline) break;
+        s->timers[i] = s->timers[parent];
+        i = parent;
+    }
+    s->timers[i] = fiber;
+}
+
+static fiber_t *popTimer(sched_t *s)
+{
+    fiber_t *first = s->timers[0];
+    fiber_t *last = s->timers[--s->timerCount];
+    int count = s->timerCount;
+    if (count == 0) return first;
+
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= count) break;
+        if (child + 1 < count && s->timers[child + 1]->deadline < s->timers[child]->deadline) {
+            child++;
+        }
+        if (last->deadline <= s->timers[child]->deadline) break;
+        s->timers[i] = s->timers[child];
+        i = child;
+    }
+    s->timers[i] = last;
+    return first;
+}
+
+// Gets whoever waits on the watch going again: a suspended fiber is
+// queued, one running a native below gets signaled, as does the main
+// stack.
+static void wake(sched_t *s, fiber_t *fiber)
+{
+    if (fiber == NULL) {
+        s->signaled = true;
+    } else if (fiber->state == FIBER_RUNNING) {
+        fiber->signaled = true;
+    } else {
+        enqueue(s, fiber);
+    }
+}
+
+static bool watchFd(sched_t *s, watch_t *watch, int fd, bool write)
+{
+#if defined(FIBER_EPOLL)
+    struct epoll_event event;
+    event.events = (write ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+    event.data.ptr = watch;
+    if (epoll_ctl(s->poller, EPOLL_CTL_ADD, fd, &event) != 0) return false;
+#elif defined(FIBER_KQUEUE)
+    struct kevent event;
+    EV_SET(&event, fd, write ? EVFILT_WRITE : EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0, watch);
+    if (kevent(s->poller, &event, 1, NULL, 0, NULL) != 0) return false;
+#elif defined(FIBER_POLL)
+    if (s->watchCount >= s->watchCapacity) {
+        s->watchCapacity = GROW_CAPACITY(s->watchCapacity);
+        s->watches = realloc(s->watches, s->watchCapacity * sizeof(watch_t *));
+        s->writes = realloc(s->writes, s->watchCapacity * sizeof(bool));
+    }
+    s->watches[s->watchCount] = watch;
+    s->writes[s->watchCount] = write;
+    s->watchCount++;
+#else
+    return false;
+#endif
+
+    watch->fd = fd;
+    s->watching++;
+    return true;
+}
+
+static void fired(sched_t *s, watch_t *watch)
+{
+#if defined(FIBER_EPOLL)
+    epoll_ctl(s->poller, EPOLL_CTL_DEL, watch->fd, NULL);
+#endif
+    watch->fd = -1;
+    s->watching--;
+    wake(s, watch->fiber);
+}
+
+// Waits up to timeout ms for watched descriptors, or for ever when it
+// is negative, and wakes those waiting on the ones that got ready.
+static void pollEvents(sched_t *s, int timeout)
+{
+#if defined(FIBER_EPOLL)
+    struct epoll_event events[FIBER_EVENTS];
+    int count = epoll_wait(s->poller, events, FIBER_EVENTS, timeout);
+    for (int i = 0; i < count; i++) {
+        fired(s, events[i].data.ptr);
+    }
+#elif defined(FIBER_KQUEUE)
+    struct kevent events[FIBER_EVENTS];
+    struct timespec ts = { timeout / 1000, (timeout % 1000) * 1000000L };
+    int count = kevent(s->poller, NULL, 0, events, FIBER_EVENTS, timeout < 0 ? NULL : &ts);
+    for (int i = 0; i < count; i++) {
+        fired(s, events[i].udata);
+    }
+#elif defined(FIBER_POLL)
+    struct pollfd *fds = malloc((s->watchCount + 1) * sizeof(struct pollfd));
+    for (int i = 0; i < s->watchCount; i++) {
+        fds[i].fd = s->watches[i]->fd;
+        fds[i].events = s->writes[i] ? POLLOUT : POLLIN;
+        fds[i].revents = 0;
+    }
+
+    // Those that fired leave the array, the others keep their order.
+    int count = poll(fds, s->watchCount, timeout), kept = 0;
+    for (int i = 0; i < s->watchCount; i++) {
+        if (count > 0 && fds[i].revents != 0) {
+            fired(s, s->watches[i]);
+        } else {
+            s->watches[kept] = s->watches[i];
+            s->writes[kept] = s->writes[i];
+            kept++;
+        }
+    }
+    s->watchCount = kept;
+    free(fds);
+#else
+    if (timeout > 0) Sleep(timeout);
+#endif
+}
+
+// Runs fiber until it waits or returns, on the stacks of its own. The
+// stacks it ran on meanwhile are parked in the fiber underneath, or in
+// main when there is none.
+static void resume(vm_t *vm, sched_t *s, fiber_t *fiber)
+{
+    fiber_t *outer = s->current;
+    ctx_t *home = outer != NULL ? &outer->ctx : &s->main;
+
+    park(vm, home);
+    if (outer != NULL) GC_BARRIER(vm->gc, outer);
+    unpark(vm, &fiber->ctx);
+    s->current = fiber;
+    fiber->state = FIBER_RUNNING;
+
+    int status;
+    if (fiber->argc >= 0) {
+        int argc = fiber->argc;
+        fiber->argc = -1;
+        status = vm_call(vm, vm->stack[0], argc) ? vm_resume(vm) : VM_RUNTIME_ERROR;
+    } else {
+        status = vm_resume(vm);
+    }
+
+    if (status == VM_SUSPENDED) {
+        vm->suspend = false;
+        park(vm, &fiber->ctx);
+    } else {
+        fiber->result = status == VM_OK ? vm->top[-1] : VAL_NIL;
+        fiber->state = FIBER_DONE;
+        free(vm->stack);
+        free(vm->frames);
+        removeLive(s, fiber);
+
+        while (fiber->waiters != NULL) {
+            fiber_t *waiter = fiber->waiters;
+            fiber->waiters = waiter->next;
+            enqueue(s, waiter);
+        }
+    }
+    GC_BARRIER(vm->gc, fiber);
+
+    unpark(vm, home);
+    s->current = outer;
+}
+
+// Expires timers, then runs the fibers that were ready when it began.
+static void runRound(vm_t *vm, sched_t *s)
+{
+    uint64_t now = clockMs();
+    while (s->timerCount > 0 && s->timers[0]->deadline <= now) {
+        enqueue(s, popTimer(s));
+    }
+
+    // Those getting ready meanwhile wait for the next round.
+    for (int count = s->readyCount; count > 0 && s->ready != NULL; count--) {
+        resume(vm, s, dequeue(s));
+    }
+}
+
+// Runs fibers for a stack that cannot suspend, until target is done,
+// the deadline passed or the signal came, whichever of them is given.
+// Returns early once nothing is left that could change anything.
+static void drive(vm_t *vm, sched_t *s, fiber_t *target, uint64_t deadline, bool *signal)
+{
+    for (;;) {
+        if (target != NULL && target->state == FIBER_DONE) return;
+        if (signal != NULL && *signal) {
+            *signal = false;
+            return;
+        }
+        if (deadline != 0 && clockMs() >= deadline) return;
+
+        runRound(vm, s);
+        if (target != NULL && target->state == FIBER_DONE) return;
+        if (signal != NULL && *signal) continue;
+
+        if (s->ready == NULL && s->timerCount == 0 && s->watching == 0 && deadline == 0) {
+            return;
+        }
+
+        // Blocks until the next timer or deadline, unless some fiber is ready.
+        int timeout = -1;
+        if (s->ready != NULL) {
+            timeout = 0;
+        } else {
+            uint64_t next = deadline;
+            if (s->timerCount > 0 && (next == 0 || s->timers[0]->deadline < next)) {
+                next = s->timers[0]->deadline;
+            }
+            if (next != 0) {
+                uint64_t now = clockMs();
+                timeout = next > now ? (int)(next - now) : 0;
+            }
+        }
+        if (s->watching > 0 || timeout > 0) pollEvents(s, timeout);
+    }
+}
+
+// The native running can suspend the fiber that called it, it is on
+// the stacks of the fiber and not below a native calling back.
+static bool suspendable(vm_t *vm, sched_t *s)
+{
+    return s->current != NULL && vm->base == 0;
+}
+
+fiber_t *fiber_start(vm_t *vm, val_t *args, int argc)
+{
+    sched_t *s = getSched(vm);
+    fiber_t *fiber = fiber_new(vm);
+
+    ctx_t *ctx = &fiber->ctx;
+    ctx->stackCapacity = STACK_INIT;
+    ctx->stack = malloc(ctx->stackCapacity * sizeof(val_t));
+    memcpy(ctx->stack, args, (argc + 1) * sizeof(val_t));
+    ctx->top = ctx->stack + argc + 1;
+    ctx->frameCapacity = FRAMES_INIT;
+    ctx->frames = malloc(ctx->frameCapacity * sizeof(frame_t));
+    ctx->frameCount = 0;
+    fiber->argc = argc;
+
+    addLive(s, fiber);
+    enqueue(s, fiber);
+    return fiber;
+}
+
+void fiber_pause(vm_t *vm)
+{
+    sched_t *s = getSched(vm);
+    fiber_t *fiber = s->current;
+
+    if (suspendable(vm, s)) {
+        if (fiber->yielded) {
+            fiber->yielded = false;
+            return;
+        }
+        fiber->yielded = true;
+        enqueue(s, fiber);
+        vm->suspend = true;
+        return;
+    }
+
+    runRound(vm, s);
+    if (s->watching > 0) pollEvents(s, 0);
+}
+
+void fiber_delay(vm_t *vm, double ms)
+{
+    sched_t *s = getSched(vm);
+    fiber_t *fiber = s->current;
+    uint64_t deadline = clockMs() + (ms > 0 ? (uint64_t)ms : 0);
+
+    if (suspendable(vm, s)) {
+        if (fiber->deadline != 0) {
+            fiber->deadline = 0;
+            return;
+        }
+        fiber->deadline = deadline;
+        fiber->state = FIBER_WAITING;
+        pushTimer(s, fiber);
+        vm->suspend = true;
+        return;
+    }
+
+    drive(vm, s, NULL, deadline, NULL);
+}
+
+val_t fiber_join(vm_t *vm, fiber_t *fiber)
+{
+    sched_t *s = getSched(vm);
+
+    if (fiber->state != FIBER_DONE) {
+        // A fiber awaiting itself would never return.
+        if (suspendable(vm, s) && fiber != s->current) {
+            fiber_t *current = s->current;
+            current->state = FIBER_WAITING;
+            current->next = fiber->waiters;
+            fiber->waiters = current;
+            vm->suspend = true;
+            return VAL_NIL;
+        }
+        drive(vm, s, fiber, 0, NULL);
+    }
+
+    return fiber->state == FIBER_DONE ? fiber->result : VAL_NIL;
+}
+
+void fiber_loop(vm_t *vm)
+{
+    sched_t *s = getSched(vm);
+    if (!suspendable(vm, s)) drive(vm, s, NULL, 0, NULL);
+}
+
+bool fiber_wait(vm_t *vm, int fd, bool write)
+{
+    sched_t *s = getSched(vm);
+    fiber_t *fiber = s->current;
+
+    if (suspendable(vm, s)) {
+        if (watchFd(s, &fiber->watch, fd, write)) {
+            fiber->state = FIBER_WAITING;
+            vm->suspend = true;
+        }
+        return false;
+    }
+
+    watch_t *watch = fiber != NULL ? &fiber->watch : &s->watch;
+    bool *signal = fiber != NULL ? &fiber->signaled : &s->signaled;
+    if (!watchFd(s, watch, fd, write)) return false;
+
+    drive(vm, s, NULL, 0, signal);
+    return true;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#define FIBER_EVENTS        64      // events taken from the poller at once
+
+// How descriptors get watched: epoll, kqueue, or poll() elsewhere. No
+// descriptors on Windows, where fibers only sleep, yield and await.
+#if defined(__linux__)
+#define FIBER_EPOLL
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+#define FIBER_KQUEUE
+#elif !defined(_WIN32)
+#define FIBER_POLL
+#endif
+
+typedef enum {
+    FIBER_READY,        // queued to run
+    FIBER_RUNNING,      // on the vm, or waiting for a native below it
+    FIBER_WAITING,      // on a timer, a descriptor or another fiber
+    FIBER_DONE
+} fstate_t;
+
+// The stacks of a vm, parked while some other ones run on it. Empty
+// while they are the ones in the vm.
+typedef struct {
+    val_t *stack;
+    val_t *top;
+    int stackCapacity;
+    frame_t *frames;
+    int frameCount;
+    int frameCapacity;
+} ctx_t;
+
+// A descriptor watched for one event, for a fiber or for the main
+// stack when fiber is NULL.
+typedef struct {
+    int fd;
+    fiber_t *fiber;
+} watch_t;
+
+// A coroutine: a routine with stacks of its own that the vm runs until
+// it waits, then runs the next ready one. The call it waits in stays on
+// its stack and runs again once it gets resumed, so waiting natives
+// return like any other native on the second go.
+struct _fiber {
+    obj_t obj;
+    ctx_t ctx;
+    fstate_t state;
+    int argc;           // arguments it got spawned with, -1 once started
+    val_t result;       // what the routine returned once done
+    int index;          // in the live fibers of the scheduler
+    fiber_t *next;      // in the ready queue or a list of waiters
+    fiber_t *waiters;   // fibers awaiting this one
+    uint64_t deadline;  // ms it sleeps until, 0 when not sleeping
+    bool yielded;
+    bool signaled;      // a descriptor it waits on below a native got ready
+    watch_t watch;
+};
+
+// Fibers of a vm, run one at a time on its thread.
+typedef struct _sched {
+    ctx_t main;             // stacks of the vm while a fiber runs
+    fiber_t *current;       // NULL on the main stack
+    bool signaled;          // a descriptor the main stack waits on got ready
+
+    int readyCount;
+    fiber_t *ready;
+    fiber_t *readyTail;
+
+    int liveCount;          // every fiber not done, they are roots
+    int liveCapacity;
+    fiber_t **live;
+
+    int timerCount;         // sleeping fibers, a heap by deadline
+    int timerCapacity;
+    fiber_t **timers;
+
+    int watching;           // descriptors being watched
+    watch_t watch;          // the one of the main stack
+    int poller;             // epoll or kqueue descriptor, -1 without one
+#ifdef FIBER_POLL
+    int watchCount;
+    int watchCapacity;
+    watch_t **watches;
+    bool *writes;           // the event of each watch
+#endif
+} sched_t;
+
+void sched_free(sched_t *sched);
+
+// Queues a call of args[0] with the argc values after it.
+fiber_t *fiber_start(vm_t *vm, val_t *args, int argc);
+
+// The waits below suspend the fiber running the native that calls
+// them. Anywhere else, on the main stack or below a native called back
+// from a fiber, they run the other fibers until done waiting.
+void fiber_pause(vm_t *vm);
+void fiber_delay(vm_t *vm, double ms);
+val_t fiber_join(vm_t *vm, fiber_t *fiber);
+// Runs fibers until none can run any more, does nothing in a fiber.
+void fiber_loop(vm_t *vm);
+// Waits for fd to be readable or writable. False when the fiber got
+// suspended or the descriptor cannot be watched, the native returns
+// then. True once it is ready, the native tries again.
+bool fiber_wait(vm_t *vm, int fd, bool write);
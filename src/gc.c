@@ -5,18 +5,37 @@
 #include "gc.h"
 #include "vm.h"
 #include "object.h"
+#include "fiber.h"
 
 void gc_init(gc_t *gc)
 {
-    gc->next = 0;
+    gc->next = GC_HEAP_MIN;
     gc->allocated = 0;
+    gc->peak = 0;
+    gc->young = 0;
+    gc->nursery = GC_NURSERY_SIZE;
     gc->objects = NULL;
+    gc->tenured = NULL;
+
+    gc->grayCount = 0;
+    gc->grayCapacity = 0;
+    gc->grays = NULL;
+
+    gc->rememberedCount = 0;
+    gc->rememberedCapacity = 0;
+    gc->remembered = NULL;
+
+    gc->vms = NULL;
+    gc->paused = 0;
+
+    gc->shapes = NULL;
+    gc->emptyShape = shape_new(&gc->shapes);
+
+    slab_init(&gc->slab);
 }
 
-void gc_free(gc_t *gc)
+static void freeList(gc_t *gc, obj_t *object)
 {
-    obj_t *object = gc->objects;
-
     while (object != NULL) {
         obj_t *next = object->next;
         obj_free(gc, object);
@@ -24,19 +43,319 @@ void gc_free(gc_t *gc)
     }
 }
 
+void gc_free(gc_t *gc)
+{
+    freeList(gc, gc->objects);
+    freeList(gc, gc->tenured);
+    gc->objects = NULL;
+    gc->tenured = NULL;
+
+    shape_t *shape = gc->shapes;
+    while (shape != NULL) {
+        shape_t *next = shape->next;
+        shape_free(shape);
+        shape = next;
+    }
+    gc->shapes = NULL;
+
+    free(gc->grays);
+    free(gc->remembered);
+    gc->grays = NULL;
+    gc->remembered = NULL;
+
+    slab_free(&gc->slab);
+}
+
+void gc_attach(gc_t *gc, vm_t *vm)
+{
+    vm->next = gc->vms;
+    gc->vms = vm;
+}
+
+void gc_detach(gc_t *gc, vm_t *vm)
+{
+    vm_t **link = &gc->vms;
+
+    while (*link != NULL) {
+        if (*link == vm) {
+            *link = vm->next;
+            break;
+        }
+        link = &(*link)->next;
+    }
+
+    vm->next = NULL;
+}
+
 void *gc_realloc(gc_t *gc, void *ptr, size_t old, size_t new)
 {
     gc->allocated += new - old;
 
-    if (new > old && gc->allocated > gc->next) {
-        // todo
-        //gc_collect(gc);
+    if (new > old) {
+        gc->young += new - old;
+        if (gc->allocated > gc->peak) gc->peak = gc->allocated;
+    }
+
+    if (new > old && gc->paused == 0) {
+#ifdef DEBUG_STRESS_GC
+        gc_collect(gc, false);
+#else
+        if (gc->allocated > gc->next) {
+            gc_collect(gc, true);
+        }
+        else if (gc->young > gc->nursery) {
+            gc_collect(gc, false);
+        }
+#endif
     }
 
     if (new == 0) {
-        free(ptr);
+        slab_release(&gc->slab, ptr, old);
         return NULL;
     }
 
-    return realloc(ptr, new);
+    return slab_realloc(&gc->slab, ptr, old, new);
+}
+
+static void pushObject(obj_t ***array, int *count, int *capacity, obj_t *object)
+{
+    if (*count >= *capacity) {
+        *capacity = GROW_CAPACITY(*capacity);
+        *array = realloc(*array, *capacity * sizeof(obj_t *));
+        if (*array == NULL) exit(1);
+    }
+
+    (*array)[(*count)++] = object;
+}
+
+void gc_remember(gc_t *gc, obj_t *object)
+{
+    object->remembered = true;
+    pushObject(&gc->remembered, &gc->rememberedCount,
+        &gc->rememberedCapacity, object);
+}
+
+static void markObject(gc_t *gc, obj_t *object, bool full)
+{
+    if (object == NULL || object->marked) return;
+    // A minor collection only traces the nursery, old objects
+    // are assumed alive.
+    if (object->old && !full) return;
+
+    object->marked = true;
+    pushObject(&gc->grays, &gc->grayCount, &gc->grayCapacity, object);
+}
+
+static void markValue(gc_t *gc, val_t value, bool full)
+{
+    if (IS_OBJ(value)) markObject(gc, AS_OBJ(value), full);
+}
+
+static void markArray(gc_t *gc, arr_t *array, bool full)
+{
+    for (int i = 0; i < array->count; i++) {
+        markValue(gc, array->values[i], full);
+    }
+}
+
+static void markTable(gc_t *gc, tab_t *table, bool full)
+{
+    for (int i = 0; i < table->capacity; i++) {
+        ent_t *entry = &table->entries[i];
+        if (entry->key == NULL) continue;
+        markObject(gc, (obj_t *)entry->key, full);
+        markValue(gc, entry->value, full);
+    }
+}
+
+static void markHash(gc_t *gc, hash_t *hash, bool full)
+{
+    for (int i = 0; i < hash->capacity; i++) {
+        index_t *index = &hash->indexes[i];
+        if (index->key == HASH_UNUSED) continue;
+        markValue(gc, index->value, full);
+    }
+}
+
+static void markContext(gc_t *gc, ctx_t *ctx, bool full)
+{
+    if (ctx->stack == NULL) return;
+    for (val_t *slot = ctx->stack; slot < ctx->top; slot++) {
+        markValue(gc, *slot, full);
+    }
+    for (int i = 0; i < ctx->frameCount; i++) {
+        markObject(gc, (obj_t *)ctx->frames[i].function, full);
+    }
+}
+
+static void blackenObject(gc_t *gc, obj_t *object, bool full)
+{
+    switch (object->type) {
+        case OT_STR:
+            break;
+        case OT_ROPE:
+            markObject(gc, (obj_t *)((rope_t *)object)->flat, full);
+            break;
+        case OT_FUN: {
+            fun_t *function = (fun_t *)object;
+            markObject(gc, (obj_t *)function->name, full);
+            markArray(gc, &function->chunk.constants, full);
+            break;
+        }
+        case OT_MAP: {
+            map_t *map = (map_t *)object;
+            for (int i = 0; i < map->arrayCount; i++) {
+                markValue(gc, map->array[i], full);
+            }
+            markHash(gc, &map->hash, full);
+            markTable(gc, &map->table, full);
+            if (map->shape != NULL) {
+                for (int i = 0; i < map->shape->count; i++) {
+                    markValue(gc, map->fields[i], full);
+                }
+            }
+            break;
+        }
+        case OT_FIBER: {
+            // The stacks of a running fiber are those of the vm.
+            fiber_t *fiber = (fiber_t *)object;
+            markContext(gc, &fiber->ctx, full);
+            markValue(gc, fiber->result, full);
+            break;
+        }
+    }
+}
+
+static void markRoots(gc_t *gc, bool full)
+{
+    for (vm_t *vm = gc->vms; vm != NULL; vm = vm->next) {
+        for (val_t *slot = vm->stack; slot < vm->top; slot++) {
+            markValue(gc, *slot, full);
+        }
+
+        for (int i = 0; i < vm->frameCount; i++) {
+            markObject(gc, (obj_t *)vm->frames[i].function, full);
+        }
+
+        // Kept for the next run of their program.
+        for (int i = 0; i < vm->programCount; i++) {
+            markObject(gc, (obj_t *)vm->programs[i].script, full);
+        }
+
+        // Fibers run when their turn comes, whether referenced or not.
+        sched_t *sched = vm->sched;
+        if (sched != NULL) {
+            markContext(gc, &sched->main, full);
+            for (int i = 0; i < sched->liveCount; i++) {
+                markObject(gc, (obj_t *)sched->live[i], full);
+            }
+        }
+    }
+
+    // Field names are held by shapes, which outlive the maps.
+    for (shape_t *shape = gc->shapes; shape != NULL; shape = shape->next) {
+        markObject(gc, (obj_t *)shape->key, full);
+    }
+
+    // Globals are shared by every vm on this heap.
+    if (gc->vms != NULL) {
+        markTable(gc, gc->vms->globals, full);
+        markArray(gc, gc->vms->slots, full);
+    }
+
+    // Old objects written since the last collection may point
+    // into the nursery.
+    for (int i = 0; i < gc->rememberedCount; i++) {
+        obj_t *object = gc->remembered[i];
+        object->remembered = false;
+        if (!full) blackenObject(gc, object, full);
+    }
+    gc->rememberedCount = 0;
+}
+
+static void traceReferences(gc_t *gc, bool full)
+{
+    while (gc->grayCount > 0) {
+        obj_t *object = gc->grays[--gc->grayCount];
+        blackenObject(gc, object, full);
+    }
+}
+
+static void removeWhiteStrings(tab_t *strings, bool full)
+{
+    // The intern table is weak, drop every string about to be swept.
+    for (int i = 0; i < strings->capacity; i++) {
+        ent_t *entry = &strings->entries[i];
+        if (entry->key == NULL) continue;
+
+        obj_t *object = (obj_t *)entry->key;
+        if (!object->marked && (full || !object->old)) {
+            tab_remove(strings, entry->key);
+        }
+    }
+}
+
+static void sweepNursery(gc_t *gc)
+{
+    obj_t *object = gc->objects;
+
+    while (object != NULL) {
+        obj_t *next = object->next;
+
+        if (object->marked) {
+            // Survivors are promoted right away.
+            object->marked = false;
+            object->old = true;
+            object->next = gc->tenured;
+            gc->tenured = object;
+        }
+        else {
+            obj_free(gc, object);
+        }
+
+        object = next;
+    }
+
+    gc->objects = NULL;
+    gc->young = 0;
+}
+
+static void sweepTenured(gc_t *gc)
+{
+    obj_t **link = &gc->tenured;
+
+    while (*link != NULL) {
+        obj_t *object = *link;
+
+        if (object->marked) {
+            object->marked = false;
+            link = &object->next;
+        }
+        else {
+            *link = object->next;
+            obj_free(gc, object);
+        }
+    }
+}
+
+void gc_collect(gc_t *gc, bool full)
+{
+    markRoots(gc, full);
+    traceReferences(gc, full);
+
+    if (gc->vms != NULL) {
+        removeWhiteStrings(gc->vms->strings, full);
+    }
+
+    if (full) {
+        // Sweep the old generation before the nursery gets promoted
+        // into it, so survivors are not visited twice.
+        sweepTenured(gc);
+    }
+    sweepNursery(gc);
+
+    if (full) {
+        gc->next = gc->allocated * GC_HEAP_GROW;
+        if (gc->next < GC_HEAP_MIN) gc->next = GC_HEAP_MIN;
+    }
 }
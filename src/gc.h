@@ -2,14 +2,52 @@
 
 #include "common.h"
 #include "object.h"
+#include "alloc.h"
+
+#define GC_HEAP_GROW        2
+#define GC_HEAP_MIN         (1024 * 1024)
+#define GC_NURSERY_SIZE     (256 * 1024)
 
 struct _gc {
-    size_t allocated;
-    size_t next;
-    obj_t *objects;
+    size_t allocated;   // bytes held by all objects
+    size_t peak;        // most bytes ever held at once
+    size_t next;        // heap size that triggers the next full collection
+    size_t young;       // bytes allocated in the nursery since the last collection
+    size_t nursery;     // nursery size that triggers the next minor collection
+    obj_t *objects;     // nursery, objects that never survived a collection
+    obj_t *tenured;     // old generation
+
+    int grayCount;
+    int grayCapacity;
+    obj_t **grays;
+
+    int rememberedCount;
+    int rememberedCapacity;
+    obj_t **remembered;
+
+    vm_t *vms;          // every vm sharing this heap, walked for roots
+    int paused;         // collections are deferred while positive
+
+    shape_t *shapes;    // every shape, they live as long as the heap
+    shape_t *emptyShape;
+
+    slab_t slab;        // memory of the objects and their strings
 };
 
 void gc_init(gc_t *gc);
 void gc_free(gc_t *gc);
 
+void gc_attach(gc_t *gc, vm_t *vm);
+void gc_detach(gc_t *gc, vm_t *vm);
+
 void *gc_realloc(gc_t *gc, void *ptr, size_t old, size_t new);
+void gc_collect(gc_t *gc, bool full);
+void gc_remember(gc_t *gc, obj_t *object);
+
+// Must be called after storing a reference into an old object,
+// so the next minor collection sees it.
+#define GC_BARRIER(gc, o) \
+    do { \
+        obj_t *_o = (obj_t *)(o); \
+        if (_o->old && !_o->remembered) gc_remember(gc, _o); \
+    } while (0)
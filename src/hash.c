@@ -2,72 +2,66 @@
 #include <string.h>
 
 #include "hash.h"
+#include "probe.h"
 
 #define HASH_MAX_LOAD   0.75
-#define UNUSED_INDEX    UINT64_MAX
 
 void hash_init(hash_t *hash)
 {
     hash->count = 0;
     hash->capacity = 0;
     hash->indexes = NULL;
+    hash->ctrl = NULL;
 }
 
 void hash_free(hash_t *hash)
 {
     free(hash->indexes);
+    free(hash->ctrl);
     hash_init(hash);
 }
 
-static index_t *hash_find(index_t *indexes, int capacity, uint64_t key)
+static int hash_find(hash_t *hash, uint64_t key, uint32_t h)
 {
-    uint32_t i = key % capacity;
-    index_t *tombstone = NULL;
-
-    for (;;) {
-        index_t *index = &indexes[i];
-
-        if (index->key == UNUSED_INDEX) {
-            if (IS_NIL(index->value)) {
-                // Empty entry.                              
-                return tombstone != NULL ? tombstone : index;
-            }
-            else {
-                // We found a tombstone.                     
-                if (tombstone == NULL) tombstone = index;
-            }
-        }
-        else if (index->key == key) {
-            // We found the key.
-            return index;
-        }
+    uint8_t h2 = PROBE_H2(h);
 
-        i = (i + 1) % capacity;
+    for (probe_t probe = probe_start(h, hash->capacity);; probe_next(&probe)) {
+        const uint8_t *group = hash->ctrl + probe.offset;
+
+        for (uint32_t mask = probe_match(group, h2); mask != 0; mask &= mask - 1) {
+            int slot = probe.offset + probe_first(mask);
+            if (hash->indexes[slot].key == key) return slot;
+        }
+        if (probe_match(group, PROBE_EMPTY) != 0) return -1;
     }
 }
 
 static void hash_resize(hash_t *hash, int capacity)
 {
     index_t *indexes = malloc(capacity * sizeof(index_t));
+    uint8_t *ctrl = malloc(capacity);
 
     for (int i = 0; i < capacity; i++) {
-        indexes[i].key = UNUSED_INDEX;
-        indexes[i].value = VAL_NIL;
+        indexes[i].key = HASH_UNUSED;
     }
- 
+    memset(ctrl, PROBE_EMPTY, capacity);
+
     hash->count = 0;
     for (int i = 0; i < hash->capacity; i++) {
         index_t *index = &hash->indexes[i];
-        if (index->key == UNUSED_INDEX) continue;
+        if (index->key == HASH_UNUSED) continue;
 
-        index_t *dest = hash_find(indexes, capacity, index->key);
-        dest->key = index->key;
-        dest->value = index->value;
+        uint32_t h = probe_hash64(index->key);
+        int slot = probe_insert(ctrl, capacity, h);
+        ctrl[slot] = PROBE_H2(h);
+        indexes[slot] = *index;
         hash->count++;
     }
 
     free(hash->indexes);
+    free(hash->ctrl);
     hash->indexes = indexes;
+    hash->ctrl = ctrl;
     hash->capacity = capacity;
 }
 
@@ -75,26 +69,45 @@ bool hash_get(hash_t *hash, uint64_t key, val_t *value)
 {
     if (hash->count == 0) return false;
 
-    index_t *index = hash_find(hash->indexes, hash->capacity, key);
-    if (index->key == UNUSED_INDEX) return false;
+    int slot = hash_find(hash, key, probe_hash64(key));
+    if (slot < 0) return false;
 
-    (*value) = index->value;
+    (*value) = hash->indexes[slot].value;
     return true;
 }
 
 bool hash_set(hash_t *hash, uint64_t key, val_t value)
 {
+    uint32_t h = probe_hash64(key);
+
+    int slot = hash->count > 0 ? hash_find(hash, key, h) : -1;
+    if (slot >= 0) {
+        hash->indexes[slot].value = value;
+        return false;
+    }
+
     if (hash->count + 1 > hash->capacity * HASH_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(hash->capacity);
-        hash_resize(hash, capacity);
+        hash_resize(hash, PROBE_GROW(hash->capacity));
     }
 
-    index_t *index = hash_find(hash->indexes, hash->capacity, key);
+    slot = probe_insert(hash->ctrl, hash->capacity, h);
+    if (hash->ctrl[slot] == PROBE_EMPTY) hash->count++;
 
-    bool isNewKey = (index->key == UNUSED_INDEX);
-    if (isNewKey && IS_NIL(index->value)) hash->count++;
+    hash->ctrl[slot] = PROBE_H2(h);
+    hash->indexes[slot].key = key;
+    hash->indexes[slot].value = value;
+    return true;
+}
+
+bool hash_remove(hash_t *hash, uint64_t key)
+{
+    if (hash->count == 0) return false;
+
+    int slot = hash_find(hash, key, probe_hash64(key));
+    if (slot < 0) return false;
 
-    index->key = key;
-    index->value = value;
-    return isNewKey;
+    hash->indexes[slot].key = HASH_UNUSED;
+    if (probe_remove(hash->ctrl, slot)) hash->count--;
+
+    return true;
 }
@@ -3,15 +3,19 @@
 #include "common.h"
 #include "value.h"
 
+#define HASH_UNUSED     UINT64_MAX
+
 typedef struct {
     uint64_t key;
     val_t value;
 } index_t;
 
+// Free indexes have the HASH_UNUSED key, see probe.h for the layout.
 typedef struct {
-    int count;
+    int count;          // indexes in use or deleted
     int capacity;
     index_t *indexes;
+    uint8_t *ctrl;
 } hash_t;
 
 void hash_init(hash_t *hash);
@@ -19,3 +23,4 @@ void hash_free(hash_t *hash);
 
 bool hash_get(hash_t *hash, uint64_t key, val_t *value);
 bool hash_set(hash_t *hash, uint64_t key, val_t value);
+bool hash_remove(hash_t *hash, uint64_t key);
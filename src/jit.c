@@ -0,0 +1,929 @@
+// For MAP_ANONYMOUS under -std=c11.
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "jit.h"
+#include "object.h"
+#include "vm.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define JIT_X64
+#endif
+
+#ifdef JIT_X64
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+// A rel32 to fill in once every instruction has its code.
+typedef struct {
+    int at;
+    int target;             // bytecode offset
+    bool exit;              // to the exit at target, else to its code
+} patch_t;
+
+typedef struct {
+    chunk_t *chunk;
+    int offset;             // bytecode offset of the instruction being compiled
+
+    uint8_t *code;
+    int count;
+    int capacity;
+
+    int *labels;            // native offset of each instruction
+    int *exits;             // native offset of the exit at each instruction, -1 until needed
+
+    int patchCount;
+    int patchCapacity;
+    patch_t *patches;
+} jitc_t;
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum { XMM0, XMM1, XMM2 };
+
+// Condition codes, as in jcc and setcc.
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7,
+       CC_S = 0x8, CC_P = 0xA, CC_GE = 0xD, CC_ALWAYS = -1 };
+
+#ifdef _WIN32
+#define ARG0                RCX
+#define ARG1                RDX
+#define ARG2                R8
+#else
+#define ARG0                RDI
+#define ARG1                RSI
+#define ARG2                RDX
+#endif
+
+// Registers holding the state of the frame while its code runs.
+#define SLOTS               RBX
+#define VM                  R12
+#define TOP                 R13
+#define QNAN                R14     // NB_QNAN, to tell numbers apart
+
+#define JIT_MIN_RUN         3       // instructions worth entering the code for
+
+#define VSIZE               ((int32_t)sizeof(val_t))
+#define VSHIFT              (sizeof(val_t) == 16 ? 4 : 3)
+#define SLOT(i)             ((int32_t)(i) * VSIZE)
+#define PEEK(i)             (-((int32_t)(i) + 1) * VSIZE)
+
+#ifndef NAN_BOXING
+#define VTYPE               ((int32_t)offsetof(struct _val, type))
+#define VDATA               ((int32_t)offsetof(struct _val, raw))
+#endif
+
+static void emitByte(jitc_t *jc, uint8_t byte)
+{
+    if (jc->count >= jc->capacity) {
+        jc->capacity = GROW_CAPACITY(jc->capacity) * 4;
+        jc->code = realloc(jc->code, jc->capacity);
+    }
+    jc->code[jc->count++] = byte;
+}
+
+static void emit32(jitc_t *jc, uint32_t value)
+{
+    for (int i = 0; i < 4; i++) emitByte(jc, (uint8_t)(value >> (8 * i)));
+}
+
+static void emit64(jitc_t *jc, uint64_t value)
+{
+    for (int i = 0; i < 8; i++) emitByte(jc, (uint8_t)(value >> (8 * i)));
+}
+
+static void emitRex(jitc_t *jc, bool wide, int reg, int rm)
+{
+    uint8_t rex = 0x40 | (wide ? 8 : 0) | (reg & 8 ? 4 : 0) | (rm & 8 ? 1 : 0);
+    if (rex != 0x40) emitByte(jc, rex);
+}
+
+// An opcode of one byte, or two when it starts with 0x0F, with its
+// mandatory prefix if any.
+static void emitOpcode(jitc_t *jc, uint8_t prefix, bool wide, uint16_t op, int reg, int rm)
+{
+    if (prefix != 0) emitByte(jc, prefix);
+    emitRex(jc, wide, reg, rm);
+    if (op > 0xFF) emitByte(jc, op >> 8);
+    emitByte(jc, op & 0xFF);
+}
+
+// op reg, [base + disp]
+static void emitRM(jitc_t *jc, uint8_t prefix, bool wide, uint16_t op, int reg, int base, int32_t disp)
+{
+    emitOpcode(jc, prefix, wide, op, reg, base);
+
+    int mod = (disp == 0 && (base & 7) != RBP) ? 0 : (disp >= -128 && disp <= 127) ? 1 : 2;
+    emitByte(jc, (uint8_t)(mod << 6 | (reg & 7) << 3 | (base & 7)));
+    if ((base & 7) == RSP) emitByte(jc, 0x24);
+    if (mod == 1) emitByte(jc, (uint8_t)disp);
+    if (mod == 2) emit32(jc, (uint32_t)disp);
+}
+
+// op reg, rm
+static void emitRR(jitc_t *jc, uint8_t prefix, bool wide, uint16_t op, int reg, int rm)
+{
+    emitOpcode(jc, prefix, wide, op, reg, rm);
+    emitByte(jc, (uint8_t)(0xC0 | (reg & 7) << 3 | (rm & 7)));
+}
+
+static void emitMovImm(jitc_t *jc, int reg, uint64_t imm)
+{
+    emitRex(jc, imm > 0xFFFFFFFF, 0, reg);
+    emitByte(jc, 0xB8 + (reg & 7));
+    if (imm > 0xFFFFFFFF) emit64(jc, imm);
+    else emit32(jc, (uint32_t)imm);
+}
+
+static void emitPush(jitc_t *jc, int reg)
+{
+    emitRex(jc, false, 0, reg);
+    emitByte(jc, 0x50 + (reg & 7));
+}
+
+static void emitPop(jitc_t *jc, int reg)
+{
+    emitRex(jc, false, 0, reg);
+    emitByte(jc, 0x58 + (reg & 7));
+}
+
+static void emitCall(jitc_t *jc, void *function)
+{
+    emitMovImm(jc, RAX, (uintptr_t)function);
+    emitRR(jc, 0, false, 0xFF, 2, RAX);
+}
+
+// Jumps to the code of the instruction at target, or to the exit there.
+static void emitJump(jitc_t *jc, int cc, int target, bool exit)
+{
+    if (cc == CC_ALWAYS) {
+        emitByte(jc, 0xE9);
+    }
+    else {
+        emitByte(jc, 0x0F);
+        emitByte(jc, 0x80 | cc);
+    }
+
+    if (jc->patchCount >= jc->patchCapacity) {
+        jc->patchCapacity = GROW_CAPACITY(jc->patchCapacity);
+        jc->patches = realloc(jc->patches, jc->patchCapacity * sizeof(patch_t));
+    }
+    patch_t *patch = &jc->patches[jc->patchCount++];
+    patch->at = jc->count;
+    patch->target = target;
+    patch->exit = exit;
+    emit32(jc, 0);
+}
+
+// Leaves for the interpreter, which runs the current instruction.
+static void emitExit(jitc_t *jc, int cc)
+{
+    emitJump(jc, cc, jc->offset, true);
+}
+
+// Forward jump within a template, see patchShort.
+static int emitShort(jitc_t *jc, int cc)
+{
+    emitByte(jc, 0x70 | cc);
+    emitByte(jc, 0);
+    return jc->count - 1;
+}
+
+static void patchShort(jitc_t *jc, int at)
+{
+    jc->code[at] = (uint8_t)(jc->count - at - 1);
+}
+
+static void moveTop(jitc_t *jc, int values)
+{
+    emitRR(jc, 0, true, 0x83, 0, TOP);
+    emitByte(jc, (uint8_t)(int8_t)(values * VSIZE));
+}
+
+static void copyValue(jitc_t *jc, int dst, int32_t dstDisp, int src, int32_t srcDisp)
+{
+#ifdef NAN_BOXING
+    emitRM(jc, 0, true, 0x8B, RAX, src, srcDisp);
+    emitRM(jc, 0, true, 0x89, RAX, dst, dstDisp);
+#else
+    // Word by word, as the templates store them, so loads get forwarded
+    // from the stores before them.
+    emitRM(jc, 0, true, 0x8B, RCX, src, srcDisp + 8);
+    emitRM(jc, 0, true, 0x8B, RAX, src, srcDisp);
+    emitRM(jc, 0, true, 0x89, RAX, dst, dstDisp);
+    emitRM(jc, 0, true, 0x89, RCX, dst, dstDisp + 8);
+#endif
+}
+
+static void storeValue(jitc_t *jc, val_t value, int base, int32_t disp)
+{
+#ifdef NAN_BOXING
+    emitMovImm(jc, RAX, value);
+    emitRM(jc, 0, true, 0x89, RAX, base, disp);
+#else
+    emitRM(jc, 0, true, 0xC7, 0, base, disp + VTYPE);
+    emit32(jc, AS_TYPE(value));
+    emitMovImm(jc, RAX, AS_RAW(value));
+    emitRM(jc, 0, true, 0x89, RAX, base, disp + VDATA);
+#endif
+}
+
+// Loads the number at [base + disp], exits if it is none.
+static void loadNumber(jitc_t *jc, int xmm, int base, int32_t disp)
+{
+#ifdef NAN_BOXING
+    emitRM(jc, 0, true, 0x8B, RAX, base, disp);
+    emitRR(jc, 0, true, 0x21, QNAN, RAX);
+    emitRR(jc, 0, true, 0x39, QNAN, RAX);
+    emitExit(jc, CC_E);
+    emitRM(jc, 0xF2, false, 0x0F10, xmm, base, disp);
+#else
+    emitRM(jc, 0, false, 0x83, 7, base, disp + VTYPE);
+    emitByte(jc, VT_NUM);
+    emitExit(jc, CC_NE);
+    emitRM(jc, 0xF2, false, 0x0F10, xmm, base, disp + VDATA);
+#endif
+}
+
+static void storeNumber(jitc_t *jc, int xmm, int base, int32_t disp)
+{
+#ifdef NAN_BOXING
+    emitRM(jc, 0xF2, false, 0x0F11, xmm, base, disp);
+#else
+    emitRM(jc, 0, true, 0xC7, 0, base, disp + VTYPE);
+    emit32(jc, VT_NUM);
+    emitRM(jc, 0xF2, false, 0x0F11, xmm, base, disp + VDATA);
+#endif
+}
+
+// Stores the boolean in al.
+static void storeBool(jitc_t *jc, int base, int32_t disp)
+{
+    emitRR(jc, 0, false, 0x0FB6, RAX, RAX);
+#ifdef NAN_BOXING
+    emitMovImm(jc, RCX, NB_QNAN | NB_FALSE);
+    emitRR(jc, 0, true, 0x01, RCX, RAX);
+    emitRM(jc, 0, true, 0x89, RAX, base, disp);
+#else
+    emitRM(jc, 0, true, 0xC7, 0, base, disp + VTYPE);
+    emit32(jc, VT_BOOL);
+    emitRM(jc, 0, true, 0x89, RAX, base, disp + VDATA);
+#endif
+}
+
+// Constants are known while compiling, only registers need a guard.
+static void loadRK(jitc_t *jc, int xmm, uint8_t rk)
+{
+    if (!(rk & RK_CONST)) {
+        loadNumber(jc, xmm, SLOTS, SLOT(rk));
+        return;
+    }
+
+    val_t value = jc->chunk->constants.values[rk & ~RK_CONST];
+    if (!IS_NUM(value)) {
+        emitExit(jc, CC_ALWAYS);
+        return;
+    }
+
+    double number = AS_NUM(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    emitMovImm(jc, RAX, bits);
+    emitRR(jc, 0x66, true, 0x0F6E, xmm, RAX);
+}
+
+static void storeR(jitc_t *jc, int xmm, uint8_t a)
+{
+    if (a == R_PUSH) {
+        storeNumber(jc, xmm, TOP, 0);
+        moveTop(jc, 1);
+    }
+    else {
+        storeNumber(jc, xmm, SLOTS, SLOT(a));
+    }
+}
+
+// Address of an RK operand, for helpers called with pointers.
+static void addressRK(jitc_t *jc, int reg, uint8_t rk)
+{
+    if (rk & RK_CONST) emitMovImm(jc, reg, (uintptr_t)&jc->chunk->constants.values[rk & ~RK_CONST]);
+    else emitRM(jc, 0, true, 0x8D, reg, SLOTS, SLOT(rk));
+}
+
+// Sets ZF when the value at [base + disp] is falsey.
+static void testFalsey(jitc_t *jc, int base, int32_t disp)
+{
+#ifdef NAN_BOXING
+    static const uint64_t falsey[] = { NB_QNAN | NB_NIL, NB_QNAN | NB_FALSE, NB_QNAN | NB_TAG_PTR };
+    int done[3];
+
+    emitRM(jc, 0, true, 0x8B, RAX, base, disp);
+    emitRR(jc, 0, true, 0x85, RAX, RAX);
+    for (int i = 0; i < 3; i++) {
+        done[i] = emitShort(jc, CC_E);
+        emitMovImm(jc, RCX, falsey[i]);
+        emitRR(jc, 0, true, 0x39, RCX, RAX);
+    }
+    for (int i = 0; i < 3; i++) patchShort(jc, done[i]);
+#else
+    emitRM(jc, 0, true, 0x83, 7, base, disp + VDATA);
+    emitByte(jc, 0);
+#endif
+}
+
+// Loads the map at [base + disp] to rax, exits if it is none.
+static void loadMap(jitc_t *jc, int base, int32_t disp)
+{
+#ifdef NAN_BOXING
+    emitRM(jc, 0, true, 0x8B, RAX, base, disp);
+    emitMovImm(jc, RCX, NB_TAG_MASK);
+    emitRR(jc, 0, true, 0x21, RAX, RCX);
+    emitMovImm(jc, RDX, NB_SIGN | NB_QNAN);
+    emitRR(jc, 0, true, 0x39, RDX, RCX);
+    emitExit(jc, CC_NE);
+    emitMovImm(jc, RCX, NB_PAYLOAD);
+    emitRR(jc, 0, true, 0x21, RCX, RAX);
+#else
+    emitRM(jc, 0, false, 0x83, 7, base, disp + VTYPE);
+    emitByte(jc, VT_OBJ);
+    emitExit(jc, CC_NE);
+    emitRM(jc, 0, true, 0x8B, RAX, base, disp + VDATA);
+#endif
+    emitRM(jc, 0, false, 0x83, 7, RAX, (int32_t)offsetof(obj_t, type));
+    emitByte(jc, OT_MAP);
+    emitExit(jc, CC_NE);
+}
+
+// Loads the native at [base + disp] to rax, exits if it is none.
+static void loadNative(jitc_t *jc, int base, int32_t disp)
+{
+#ifdef NAN_BOXING
+    emitRM(jc, 0, true, 0x8B, RAX, base, disp);
+    emitMovImm(jc, RCX, NB_TAG_MASK);
+    emitRR(jc, 0, true, 0x21, RAX, RCX);
+    emitMovImm(jc, RDX, NB_QNAN | NB_TAG_CFN);
+    emitRR(jc, 0, true, 0x39, RDX, RCX);
+    emitExit(jc, CC_NE);
+    emitMovImm(jc, RCX, NB_PAYLOAD);
+    emitRR(jc, 0, true, 0x21, RCX, RAX);
+#else
+    emitRM(jc, 0, false, 0x83, 7, base, disp + VTYPE);
+    emitByte(jc, VT_CFN);
+    emitExit(jc, CC_NE);
+    emitRM(jc, 0, true, 0x8B, RAX, base, disp + VDATA);
+#endif
+}
+
+// Points rax at the array slot of the map in rax the number in xmm0
+// indexes, exits when the key lives elsewhere.
+static void arraySlot(jitc_t *jc)
+{
+    emitRR(jc, 0xF2, false, 0x0F2C, RCX, XMM0);
+    emitRR(jc, 0xF2, false, 0x0F2A, XMM1, RCX);
+    emitRR(jc, 0x66, false, 0x0F2E, XMM0, XMM1);
+    emitExit(jc, CC_NE);
+    emitExit(jc, CC_P);
+    emitRR(jc, 0, false, 0x85, RCX, RCX);
+    emitExit(jc, CC_S);
+    emitRM(jc, 0, false, 0x3B, RCX, RAX, (int32_t)offsetof(map_t, arrayCount));
+    emitExit(jc, CC_GE);
+    emitRM(jc, 0, true, 0x8B, RAX, RAX, (int32_t)offsetof(map_t, array));
+    emitRR(jc, 0, true, 0xC1, 4, RCX);
+    emitByte(jc, VSHIFT);
+    emitRR(jc, 0, true, 0x01, RCX, RAX);
+}
+
+// Points rdx at the global values, they move when more get defined.
+static void loadGlobals(jitc_t *jc)
+{
+    emitRM(jc, 0, true, 0x8B, RDX, VM, (int32_t)offsetof(vm_t, slots));
+    emitRM(jc, 0, true, 0x8B, RDX, RDX, (int32_t)offsetof(arr_t, values));
+}
+
+// Exits when the global at [rdx + disp] was never defined.
+static void checkDefined(jitc_t *jc, int32_t disp)
+{
+#ifdef NAN_BOXING
+    emitMovImm(jc, RAX, VAL_UNDEF);
+    emitRM(jc, 0, true, 0x39, RAX, RDX, disp);
+    emitExit(jc, CC_E);
+#else
+    emitMovImm(jc, RAX, (uintptr_t)&vm_undefined);
+    emitRM(jc, 0, true, 0x39, RAX, RDX, disp + VDATA);
+    int defined = emitShort(jc, CC_NE);
+    emitRM(jc, 0, false, 0x83, 7, RDX, disp + VTYPE);
+    emitByte(jc, VT_PTR);
+    emitExit(jc, CC_E);
+    patchShort(jc, defined);
+#endif
+}
+
+// The interpreter takes the samples, backward jumps leave when one is due.
+static void checkSample(jitc_t *jc)
+{
+    emitRM(jc, 0, false, 0x83, 7, VM, (int32_t)offsetof(vm_t, sample));
+    emitByte(jc, 0);
+    emitExit(jc, CC_NE);
+}
+
+static void emitArith(jitc_t *jc, uint8_t op)
+{
+    static const uint16_t codes[] = { 0x0F58, 0x0F5C, 0x0F59, 0x0F5E };     // addsd, subsd, mulsd, divsd
+    emitRR(jc, 0xF2, false, codes[op], XMM0, XMM1);
+}
+
+static bool jitEqual(const val_t *a, const val_t *b)
+{
+    return val_equal(*a, *b);
+}
+
+// The argument and the result in xmm0.
+static double jitFloor(double x)
+{
+    return floor(x);
+}
+
+// Calls a pure native in place, false for any other callee. Pure ones
+// neither collect nor call back into the vm, the frame stays as it is.
+static bool jitCallPure(vm_t *vm, val_t *top, int argc)
+{
+    val_t *args = top - argc;
+    if (!IS_CFN(args[-1])) return false;
+
+    const native_t *native = AS_CFN(args[-1]);
+    if (!(native->flags & NATIVE_PURE) || !native_accepts(native, argc, args)) return false;
+
+    args[-1] = native->function(vm, argc, args);
+    return true;
+}
+
+// Condition under which FORPREP skips the loop, on flags of comparing
+// the limit with the counter. FORLOOP jumps back on the opposite.
+static int forSkip(uint8_t m)
+{
+    switch (m) {
+        case OP_LT: return CC_BE;
+        case OP_LE: return CC_B;
+        case OP_GT: return CC_AE;
+        default:    return CC_A;
+    }
+}
+
+// The comparison a register jump tests, as FORPREP names it.
+static uint8_t registerTest(uint8_t op)
+{
+    switch (op) {
+        case OP_RLT: return OP_LT;
+        case OP_RLE: return OP_LE;
+        case OP_RGT: return OP_GT;
+        default:     return OP_GE;
+    }
+}
+
+static int forRepeat(uint8_t m)
+{
+    return forSkip(m) ^ 1;
+}
+
+#define SHORT_AT(ip, i)     ((uint16_t)((ip)[i] << 8 | (ip)[(i) + 1]))
+#define WIDE_AT(ip, i)      ((uint32_t)((ip)[i] << 16 | (ip)[(i) + 1] << 8 | (ip)[(i) + 2]))
+
+// Emits the template of the instruction at ip, false if it has none.
+static bool emitInstruction(jitc_t *jc, uint8_t *ip)
+{
+    int offset = jc->offset;
+
+    switch (ip[0]) {
+        case OP_POP:
+            moveTop(jc, -1);
+            return true;
+
+        case OP_NIL:
+            storeValue(jc, VAL_NIL, TOP, 0);
+            moveTop(jc, 1);
+            return true;
+
+        case OP_TRUE:
+        case OP_FALSE:
+            emitMovImm(jc, RAX, ip[0] == OP_TRUE);
+            storeBool(jc, TOP, 0);
+            moveTop(jc, 1);
+            return true;
+
+        case OP_CONST:
+            storeValue(jc, jc->chunk->constants.values[ip[1]], TOP, 0);
+            moveTop(jc, 1);
+            return true;
+
+        case OP_CONST_W:
+            storeValue(jc, jc->chunk->constants.values[SHORT_AT(ip, 1)], TOP, 0);
+            moveTop(jc, 1);
+            return true;
+
+        case OP_LD:
+            copyValue(jc, TOP, 0, SLOTS, SLOT(ip[1]));
+            moveTop(jc, 1);
+            return true;
+
+        case OP_ST:
+            copyValue(jc, SLOTS, SLOT(ip[1]), TOP, PEEK(0));
+            return true;
+
+        case OP_STP:
+            moveTop(jc, -1);
+            copyValue(jc, SLOTS, SLOT(ip[1]), TOP, 0);
+            return true;
+
+        case OP_GLDS:
+            loadGlobals(jc);
+            checkDefined(jc, SLOT(SHORT_AT(ip, 1)));
+            copyValue(jc, TOP, 0, RDX, SLOT(SHORT_AT(ip, 1)));
+            moveTop(jc, 1);
+            return true;
+
+        case OP_GSTS:
+        case OP_GSTSP:
+            loadGlobals(jc);
+            checkDefined(jc, SLOT(SHORT_AT(ip, 1)));
+            copyValue(jc, RDX, SLOT(SHORT_AT(ip, 1)), TOP, PEEK(0));
+            emitRM(jc, 0, false, 0xFF, 0, VM, (int32_t)offsetof(vm_t, stores));
+            if (ip[0] == OP_GSTSP) moveTop(jc, -1);
+            return true;
+
+        case OP_JMP:
+            emitJump(jc, CC_ALWAYS, offset + 3 + SHORT_AT(ip, 1), false);
+            return true;
+
+        case OP_JMPF:
+            testFalsey(jc, TOP, PEEK(0));
+            emitJump(jc, CC_E, offset + 3 + SHORT_AT(ip, 1), false);
+            return true;
+
+        case OP_JMPFP:
+            moveTop(jc, -1);
+            testFalsey(jc, TOP, 0);
+            emitJump(jc, CC_E, offset + 3 + SHORT_AT(ip, 1), false);
+            return true;
+
+        case OP_LOOP:
+            checkSample(jc);
+            emitJump(jc, CC_ALWAYS, offset + 3 - SHORT_AT(ip, 1), false);
+            return true;
+
+        case OP_JMP_W:
+            emitJump(jc, CC_ALWAYS, offset + 4 + WIDE_AT(ip, 1), false);
+            return true;
+
+        case OP_JMPF_W:
+            testFalsey(jc, TOP, PEEK(0));
+            emitJump(jc, CC_E, offset + 4 + WIDE_AT(ip, 1), false);
+            return true;
+
+        case OP_JMPFP_W:
+            moveTop(jc, -1);
+            testFalsey(jc, TOP, 0);
+            emitJump(jc, CC_E, offset + 4 + WIDE_AT(ip, 1), false);
+            return true;
+
+        case OP_LOOP_W:
+            checkSample(jc);
+            emitJump(jc, CC_ALWAYS, offset + 4 - WIDE_AT(ip, 1), false);
+            return true;
+
+        case OP_NOT:
+            testFalsey(jc, TOP, PEEK(0));
+            emitRR(jc, 0, false, 0x0F90 | CC_E, 0, RAX);
+            storeBool(jc, TOP, PEEK(0));
+            return true;
+
+        case OP_EQ:
+        case OP_NE:
+            emitRM(jc, 0, true, 0x8D, ARG0, TOP, PEEK(1));
+            emitRM(jc, 0, true, 0x8D, ARG1, TOP, PEEK(0));
+            emitCall(jc, (void *)jitEqual);
+            emitRR(jc, 0, false, 0x84, RAX, RAX);
+            emitRR(jc, 0, false, 0x0F90 | (ip[0] == OP_EQ ? CC_NE : CC_E), 0, RAX);
+            storeBool(jc, TOP, PEEK(1));
+            moveTop(jc, -1);
+            return true;
+
+        // A function may get hot before some of its instructions ever
+        // ran, generic ones compile like their quickened form would.
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_ADD_NN:
+        case OP_SUB_NN:
+        case OP_MUL_NN:
+        case OP_DIV_NN:
+            loadNumber(jc, XMM0, TOP, PEEK(1));
+            loadNumber(jc, XMM1, TOP, PEEK(0));
+            emitArith(jc, ip[0] >= OP_ADD_NN ? ip[0] - OP_ADD_NN : ip[0] - OP_ADD);
+            storeNumber(jc, XMM0, TOP, PEEK(1));
+            moveTop(jc, -1);
+            return true;
+
+        case OP_LT:
+        case OP_LE:
+        case OP_LT_NN:
+        case OP_LE_NN:
+            loadNumber(jc, XMM0, TOP, PEEK(1));
+            loadNumber(jc, XMM1, TOP, PEEK(0));
+            emitRR(jc, 0x66, false, 0x0F2E, XMM1, XMM0);
+            emitRR(jc, 0, false, 0x0F90 | (ip[0] == OP_LT || ip[0] == OP_LT_NN ? CC_A : CC_AE), 0, RAX);
+            storeBool(jc, TOP, PEEK(1));
+            moveTop(jc, -1);
+            return true;
+
+        case OP_RADD:
+        case OP_RSUB:
+        case OP_RMUL:
+        case OP_RDIV:
+            loadRK(jc, XMM0, ip[2]);
+            loadRK(jc, XMM1, ip[3]);
+            emitArith(jc, ip[0] - OP_RADD);
+            storeR(jc, XMM0, ip[1]);
+            return true;
+
+        case OP_RLT:
+        case OP_RLE:
+        case OP_RGT:
+        case OP_RGE:
+            loadRK(jc, XMM0, ip[1]);
+            loadRK(jc, XMM1, ip[2]);
+            emitRR(jc, 0x66, false, 0x0F2E, XMM1, XMM0);
+            emitJump(jc, forSkip(registerTest(ip[0])), offset + 5 + SHORT_AT(ip, 3), false);
+            return true;
+
+        case OP_REQ:
+        case OP_RNE:
+            addressRK(jc, ARG0, ip[1]);
+            addressRK(jc, ARG1, ip[2]);
+            emitCall(jc, (void *)jitEqual);
+            emitRR(jc, 0, false, 0x84, RAX, RAX);
+            emitJump(jc, ip[0] == OP_REQ ? CC_E : CC_NE, offset + 5 + SHORT_AT(ip, 3), false);
+            return true;
+
+        case OP_FORPREP:
+            loadNumber(jc, XMM0, SLOTS, SLOT(ip[1]));
+            loadRK(jc, XMM1, ip[2]);
+            emitRR(jc, 0x66, false, 0x0F2E, XMM1, XMM0);
+            emitJump(jc, forSkip(ip[3]), offset + 6 + SHORT_AT(ip, 4), false);
+            return true;
+
+        case OP_FORLOOP:
+            // Every guard comes before the counter is stored.
+            checkSample(jc);
+            loadNumber(jc, XMM0, SLOTS, SLOT(ip[1]));
+            loadRK(jc, XMM2, ip[3]);
+            loadRK(jc, XMM1, ip[2]);
+            emitRR(jc, 0xF2, false, 0x0F58, XMM0, XMM2);
+            storeNumber(jc, XMM0, SLOTS, SLOT(ip[1]));
+            emitRR(jc, 0x66, false, 0x0F2E, XMM1, XMM0);
+            emitJump(jc, forRepeat(ip[4]), offset + 7 - SHORT_AT(ip, 5), false);
+            return true;
+
+        case OP_GETI:
+        case OP_GETI_ARR:
+            loadNumber(jc, XMM0, TOP, PEEK(0));
+            loadMap(jc, TOP, PEEK(1));
+            arraySlot(jc);
+            copyValue(jc, TOP, PEEK(1), RAX, 0);
+            moveTop(jc, -1);
+            return true;
+
+        case OP_RGETI:
+            loadRK(jc, XMM0, ip[3]);
+            loadMap(jc, SLOTS, SLOT(ip[2]));
+            arraySlot(jc);
+            if (ip[1] == R_PUSH) {
+                copyValue(jc, TOP, 0, RAX, 0);
+                moveTop(jc, 1);
+            }
+            else {
+                copyValue(jc, SLOTS, SLOT(ip[1]), RAX, 0);
+            }
+            return true;
+
+        case OP_GET:
+        case OP_GET_FIELD:
+            loadMap(jc, TOP, PEEK(0));
+            emitMovImm(jc, RCX, (uintptr_t)&jc->chunk->caches[SHORT_AT(ip, 2)]);
+            emitRM(jc, 0, true, 0x8B, RDX, RCX, (int32_t)offsetof(icache_t, shape));
+            emitRR(jc, 0, true, 0x85, RDX, RDX);
+            emitExit(jc, CC_E);
+            emitRM(jc, 0, true, 0x3B, RDX, RAX, (int32_t)offsetof(map_t, shape));
+            emitExit(jc, CC_NE);
+            emitRM(jc, 0, true, 0x63, RDX, RCX, (int32_t)offsetof(icache_t, offset));
+            emitRM(jc, 0, true, 0x8B, RAX, RAX, (int32_t)offsetof(map_t, fields));
+            emitRR(jc, 0, true, 0xC1, 4, RDX);
+            emitByte(jc, VSHIFT);
+            emitRR(jc, 0, true, 0x01, RDX, RAX);
+            copyValue(jc, TOP, PEEK(0), RAX, 0);
+            return true;
+
+        case OP_CALL:
+            emitRR(jc, 0, true, 0x89, VM, ARG0);
+            emitRR(jc, 0, true, 0x89, TOP, ARG1);
+            emitMovImm(jc, ARG2, ip[1]);
+            emitCall(jc, (void *)jitCallPure);
+            emitRR(jc, 0, false, 0x84, RAX, RAX);
+            emitExit(jc, CC_E);
+            moveTop(jc, -ip[1]);
+            return true;
+
+        case OP_ABS:
+        case OP_FLOOR:
+        case OP_SQRT:
+            loadNative(jc, TOP, PEEK(1));
+            emitRM(jc, 0, false, 0x80, 7, RAX, (int32_t)offsetof(native_t, intrinsic));
+            emitByte(jc, ip[0]);
+            emitExit(jc, CC_NE);
+            loadNumber(jc, XMM0, TOP, PEEK(0));
+            if (ip[0] == OP_ABS) {
+                emitMovImm(jc, RAX, (uint64_t)0x7FFFFFFFFFFFFFFF);
+                emitRR(jc, 0x66, true, 0x0F6E, XMM1, RAX);
+                emitRR(jc, 0x66, false, 0x0F54, XMM0, XMM1);       // andpd
+            }
+            else if (ip[0] == OP_FLOOR) {
+                emitCall(jc, (void *)jitFloor);
+            }
+            else {
+                emitRR(jc, 0xF2, false, 0x0F51, XMM0, XMM0);       // sqrtsd
+            }
+            storeNumber(jc, XMM0, TOP, PEEK(1));
+            moveTop(jc, -1);
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+static void *allocCode(size_t size)
+{
+#ifdef _WIN32
+    return VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+#else
+    void *code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return code == MAP_FAILED ? NULL : code;
+#endif
+}
+
+// Never writable and executable at once.
+static bool protectCode(void *code, size_t size)
+{
+#ifdef _WIN32
+    DWORD old;
+    return VirtualProtect(code, size, PAGE_EXECUTE_READ, &old) != 0;
+#else
+    return mprotect(code, size, PROT_READ | PROT_EXEC) == 0;
+#endif
+}
+
+static void freeCode(void *code, size_t size)
+{
+#ifdef _WIN32
+    VirtualFree(code, 0, MEM_RELEASE);
+#else
+    munmap(code, size);
+#endif
+}
+
+jit_t *jit_compile(fun_t *function)
+{
+    chunk_t *chunk = &function->chunk;
+    jitc_t jc;
+    memset(&jc, 0, sizeof(jitc_t));
+    jc.chunk = chunk;
+    jc.labels = malloc((chunk->count + 1) * sizeof(int));
+    jc.exits = malloc((chunk->count + 1) * sizeof(int));
+    int *entries = malloc((chunk->count + 1) * sizeof(int));
+    for (int i = 0; i < chunk->count; i++) entries[i] = jc.labels[i] = -1;
+
+    // Shared by every entry: saves the registers the frame lives in,
+    // the stack stays 16-byte aligned for calls with room for the
+    // parameters Win64 spills.
+    emitPush(&jc, RBX);
+    emitPush(&jc, R12);
+    emitPush(&jc, R13);
+    emitPush(&jc, R14);
+    emitRR(&jc, 0, true, 0x83, 5, RSP);
+    emitByte(&jc, 40);
+    emitRR(&jc, 0, true, 0x89, ARG0, VM);
+    emitRR(&jc, 0, true, 0x89, ARG1, SLOTS);
+    emitRM(&jc, 0, true, 0x8B, TOP, VM, (int32_t)offsetof(vm_t, top));
+#ifdef NAN_BOXING
+    emitMovImm(&jc, QNAN, NB_QNAN);
+#endif
+    emitRR(&jc, 0, false, 0xFF, 4, ARG2);
+
+    for (int offset = 0; offset < chunk->count; offset += chunk_oplen(chunk->code[offset])) {
+        jc.offset = offset;
+        jc.labels[offset] = jc.count;
+        jc.exits[offset] = -1;
+
+        if (emitInstruction(&jc, &chunk->code[offset])) {
+            entries[offset] = jc.labels[offset];
+        }
+        else {
+            emitExit(&jc, CC_ALWAYS);
+        }
+    }
+
+    // Entering costs about as much as dispatching a few instructions, it
+    // only pays off at loops and before longer runs of compiled ones.
+    bool *targets = calloc(chunk->count + 1, sizeof(bool));
+    for (int i = 0; i < jc.patchCount; i++) {
+        if (!jc.patches[i].exit) targets[jc.patches[i].target] = true;
+    }
+    for (int offset = chunk->count - 1, run = 0; offset >= 0; offset--) {
+        if (jc.labels[offset] < 0) continue;
+        run = entries[offset] >= 0 ? run + 1 : 0;
+        if (run < JIT_MIN_RUN && !targets[offset]) entries[offset] = -1;
+    }
+    free(targets);
+
+    // Hands the bytecode offset in eax back.
+    int epilogue = jc.count;
+    emitRM(&jc, 0, true, 0x89, TOP, VM, (int32_t)offsetof(vm_t, top));
+    emitRR(&jc, 0, true, 0x83, 0, RSP);
+    emitByte(&jc, 40);
+    emitPop(&jc, R14);
+    emitPop(&jc, R13);
+    emitPop(&jc, R12);
+    emitPop(&jc, RBX);
+    emitByte(&jc, 0xC3);
+
+    for (int i = 0; i < jc.patchCount; i++) {
+        patch_t *patch = &jc.patches[i];
+        int to = jc.labels[patch->target];
+
+        if (patch->exit) {
+            if (jc.exits[patch->target] < 0) {
+                jc.exits[patch->target] = jc.count;
+                emitMovImm(&jc, RAX, (uint32_t)patch->target);
+                emitByte(&jc, 0xE9);
+                emit32(&jc, (uint32_t)(epilogue - (jc.count + 4)));
+            }
+            to = jc.exits[patch->target];
+        }
+
+        int32_t rel = to - (patch->at + 4);
+        memcpy(&jc.code[patch->at], &rel, sizeof(rel));
+    }
+
+    jit_t *jit = NULL;
+    uint8_t *code = allocCode(jc.count);
+    if (code != NULL) {
+        memcpy(code, jc.code, jc.count);
+        if (protectCode(code, jc.count)) {
+            jit = malloc(sizeof(jit_t));
+            jit->code = code;
+            jit->size = jc.count;
+            jit->bytecode = chunk->code;
+            jit->native = (int (*)(vm_t *, val_t *, uint8_t *))(uintptr_t)code;
+            jit->entries = entries;
+            entries = NULL;
+        }
+        else {
+            freeCode(code, jc.count);
+        }
+    }
+
+    free(entries);
+    free(jc.code);
+    free(jc.labels);
+    free(jc.exits);
+    free(jc.patches);
+    return jit;
+}
+
+void jit_free(jit_t *jit)
+{
+    if (jit == NULL) return;
+
+    freeCode(jit->code, jit->size);
+    free(jit->entries);
+    free(jit);
+}
+
+#else
+
+jit_t *jit_compile(fun_t *function)
+{
+    return NULL;
+}
+
+void jit_free(jit_t *jit)
+{
+}
+
+#endif
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "common.h"
+#include "value.h"
+
+#define JIT_THRESHOLD       1000    // calls and backward jumps before a function gets compiled
+
+// Machine code for the body of a function, stitched together from a
+// template per instruction. The templates work on the same stack slots
+// as the interpreter and keep nothing in registers from one instruction
+// to the next, so either can take over at any instruction. Instructions
+// without a template, and templates whose type guard fails, return to
+// vm_execute at the instruction concerned.
+typedef struct _jit {
+    uint8_t *code;          // executable, size bytes
+    size_t size;
+    uint8_t *bytecode;      // code of the chunk compiled
+    int *entries;           // native offset of each instruction, -1 where not entered
+    // Runs the frame with these slots from start on, returns the
+    // bytecode offset the interpreter goes on at.
+    int (* native)(vm_t *vm, val_t *slots, uint8_t *start);
+} jit_t;
+
+// NULL where there is no code generator for the cpu.
+jit_t *jit_compile(fun_t *function);
+void jit_free(jit_t *jit);
+
+// Runs the code of the frame whose slots start at slots from ip on.
+// Returns the instruction the interpreter goes on with, ip itself when
+// there is no code to enter there.
+static inline uint8_t *jit_run(vm_t *vm, jit_t *jit, val_t *slots, uint8_t *ip) {
+    int entry = jit->entries[ip - jit->bytecode];
+    if (entry < 0) return ip;
+    return jit->bytecode + jit->native(vm, slots, jit->code + entry);
+}
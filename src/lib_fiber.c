@@ -0,0 +1,212 @@
+// For getaddrinfo under -std=c11.
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#endif
+
+#include "libs.h"
+#include "vm.h"
+#include "object.h"
+#include "fiber.h"
+
+static val_t fiber_spawn(vm_t *vm, int argc, val_t *args)
+{
+    return VAL_OBJ(fiber_start(vm, args, argc - 1));
+}
+
+static val_t fiber_yield(vm_t *vm, int argc, val_t *args)
+{
+    fiber_pause(vm);
+    return VAL_NIL;
+}
+
+static val_t fiber_sleep(vm_t *vm, int argc, val_t *args)
+{
+    fiber_delay(vm, AS_NUM(args[0]));
+    return VAL_NIL;
+}
+
+static val_t fiber_await(vm_t *vm, int argc, val_t *args)
+{
+    return fiber_join(vm, AS_FIBER(args[0]));
+}
+
+static val_t fiber_run(vm_t *vm, int argc, val_t *args)
+{
+    fiber_loop(vm);
+    return VAL_NIL;
+}
+
+#ifndef _WIN32
+// Descriptors are non-blocking, a call that would block waits for the
+// descriptor with fiber_wait and tries again.
+static bool wouldBlock()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+static int nonBlocking(int fd)
+{
+    if (fd >= 0) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+// open(path, mode) with mode "r", "w", "a" or "r+", "r" by default.
+static val_t fiber_open(vm_t *vm, int argc, val_t *args)
+{
+    const char *mode = argc > 1 ? str_flatten(vm, AS_OBJ(args[1]))->chars : "r";
+
+    int flags;
+    if (strcmp(mode, "r") == 0) flags = O_RDONLY;
+    else if (strcmp(mode, "w") == 0) flags = O_WRONLY | O_CREAT | O_TRUNC;
+    else if (strcmp(mode, "a") == 0) flags = O_WRONLY | O_CREAT | O_APPEND;
+    else if (strcmp(mode, "r+") == 0) flags = O_RDWR;
+    else return VAL_NIL;
+
+    str_t *path = str_flatten(vm, AS_OBJ(args[0]));
+    int fd = open(path->chars, flags | O_NONBLOCK, 0666);
+    return fd >= 0 ? VAL_NUM(fd) : VAL_NIL;
+}
+
+// Up to count bytes, nil at the end or on errors.
+static val_t fiber_read(vm_t *vm, int argc, val_t *args)
+{
+    int fd = AS_INT(args[0]), count = AS_INT(args[1]);
+    if (count <= 0) return VAL_NIL;
+
+    char *buffer = malloc(count);
+    val_t result = VAL_NIL;
+    for (;;) {
+        ssize_t length = read(fd, buffer, count);
+        if (length > 0) {
+            result = VAL_OBJ(str_copy(vm, buffer, (int)length));
+        } else if (length < 0 && wouldBlock() && fiber_wait(vm, fd, false)) {
+            continue;
+        }
+        break;
+    }
+    free(buffer);
+    return result;
+}
+
+// Bytes written, which may be fewer than given, nil on errors. Nothing
+// is written when the fiber suspends, the call gets repeated as it was.
+static val_t fiber_write(vm_t *vm, int argc, val_t *args)
+{
+    int fd = AS_INT(args[0]), length;
+    const char *chars = str_chars(AS_OBJ(args[1]), &length);
+
+    for (;;) {
+        ssize_t written = write(fd, chars, length);
+        if (written >= 0) return VAL_NUM(written);
+        if (!wouldBlock() || !fiber_wait(vm, fd, true)) return VAL_NIL;
+    }
+}
+
+static val_t fiber_close(vm_t *vm, int argc, val_t *args)
+{
+    close(AS_INT(args[0]));
+    return VAL_NIL;
+}
+
+// A socket accepting connections on port of any address.
+static val_t fiber_listen(vm_t *vm, int argc, val_t *args)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return VAL_NIL;
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((uint16_t)AS_INT(args[0]));
+
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return VAL_NIL;
+    }
+    return VAL_NUM(nonBlocking(fd));
+}
+
+static val_t fiber_accept(vm_t *vm, int argc, val_t *args)
+{
+    int fd = AS_INT(args[0]);
+
+    for (;;) {
+        int client = accept(fd, NULL, NULL);
+        if (client >= 0) return VAL_NUM(nonBlocking(client));
+        if (!wouldBlock() || !fiber_wait(vm, fd, false)) return VAL_NIL;
+    }
+}
+
+// Returns while the connection is still being made, reads and writes
+// wait for it.
+static val_t fiber_connect(vm_t *vm, int argc, val_t *args)
+{
+    str_t *host = str_flatten(vm, AS_OBJ(args[0]));
+    char port[16];
+    snprintf(port, sizeof(port), "%d", AS_INT(args[1]));
+
+    struct addrinfo hints, *info;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host->chars, port, &hints, &info) != 0) return VAL_NIL;
+
+    int fd = -1;
+    for (struct addrinfo *ai = info; ai != NULL && fd < 0; ai = ai->ai_next) {
+        fd = nonBlocking(socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol));
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) != 0 && errno != EINPROGRESS) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(info);
+    return fd >= 0 ? VAL_NUM(fd) : VAL_NIL;
+}
+#endif
+
+static const native_t natives[] = {
+    { fiber_spawn,          "spawn",        1, "f",     NATIVE_VARARGS, 0 },
+    { fiber_yield,          "yield",        0, "",      0, 0 },
+    { fiber_sleep,          "sleep",        1, "n",     0, 0 },
+    { fiber_await,          "await",        1, "c",     0, 0 },
+    { fiber_run,            "run",          0, "",      0, 0 },
+#ifndef _WIN32
+    { fiber_open,           "open",         1, "ss",    NATIVE_VARARGS, 0 },
+    { fiber_read,           "read",         2, "nn",    0, 0 },
+    { fiber_write,          "write",        2, "ns",    0, 0 },
+    { fiber_close,          "close",        1, "n",     0, 0 },
+    { fiber_listen,         "listen",       1, "n",     0, 0 },
+    { fiber_accept,         "accept",       1, "n",     0, 0 },
+    { fiber_connect,        "connect",      2, "sn",    0, 0 },
+#endif
+};
+
+void load_libfiber(vm_t *vm)
+{
+    int count = sizeof(natives) / sizeof(natives[0]);
+    map_t *fiber = map_new(vm, 0, count);
+    vm_push(vm, VAL_OBJ(fiber));
+
+    for (int i = 0; i < count; i++) {
+        map_set(vm, fiber, natives[i].name, VAL_CFN(&natives[i]));
+    }
+
+    set_global(vm, "fiber", VAL_OBJ(fiber));
+    vm_pop(vm);
+}
@@ -5,10 +5,18 @@
 #include "vm.h"
 #include "object.h"
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MATH_SSE2
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define MATH_NEON
+#endif
+
 static val_t math_abs(vm_t *vm, int argc, val_t *args)
 {
-    double number = AS_NUM(args[0]);
-    double result = (number < 0) ? (-number) : number;
+    double x = AS_NUM(args[0]);
+    double result = fabs(x);
 
     return VAL_NUM(result);
 }
@@ -78,19 +86,287 @@ static val_t math_sqrt(vm_t *vm, int argc, val_t *args)
     return VAL_NUM(result);
 }
 
+// The bulk functions below work on the array part of maps, keys 0 up
+// to the first missing one. They give nil when an element is not a
+// number, and when two arrays differ in length.
+
+// The numbers of an array part, STRIDE doubles apart.
+#ifdef NAN_BOXING
+#define STRIDE              1
+#define NUMBERS(values)     ((double *)(values))
+#else
+#define STRIDE              2
+#define NUMBERS(values)     (&(values)->Num)
+#endif
+
+// Two numbers at a time, loaded from and stored to an array part.
+#if defined(MATH_SSE2)
+typedef __m128d v2_t;
+
+static inline v2_t load2(const double *p) {
+    return STRIDE == 1 ? _mm_loadu_pd(p) : _mm_loadh_pd(_mm_load_sd(p), p + STRIDE);
+}
+
+static inline void store2(double *p, v2_t v) {
+    _mm_storel_pd(p, v);
+    _mm_storeh_pd(p + STRIDE, v);
+}
+
+#define splat2(x)           _mm_set1_pd(x)
+#define add2(a, b)          _mm_add_pd(a, b)
+#define mul2(a, b)          _mm_mul_pd(a, b)
+#define min2(a, b)          _mm_min_pd(a, b)
+#define max2(a, b)          _mm_max_pd(a, b)
+#define sqrt2(a)            _mm_sqrt_pd(a)
+#define low2(v)             _mm_cvtsd_f64(v)
+#define high2(v)            _mm_cvtsd_f64(_mm_unpackhi_pd(v, v))
+#elif defined(MATH_NEON)
+typedef float64x2_t v2_t;
+
+static inline v2_t load2(const double *p) {
+    return STRIDE == 1 ? vld1q_f64(p) : vcombine_f64(vld1_f64(p), vld1_f64(p + STRIDE));
+}
+
+static inline void store2(double *p, v2_t v) {
+    vst1_f64(p, vget_low_f64(v));
+    vst1_f64(p + STRIDE, vget_high_f64(v));
+}
+
+#define splat2(x)           vdupq_n_f64(x)
+#define add2(a, b)          vaddq_f64(a, b)
+#define mul2(a, b)          vmulq_f64(a, b)
+#define min2(a, b)          vminq_f64(a, b)
+#define max2(a, b)          vmaxq_f64(a, b)
+#define sqrt2(a)            vsqrtq_f64(a)
+#define low2(v)             vgetq_lane_f64(v, 0)
+#define high2(v)            vgetq_lane_f64(v, 1)
+#endif
+
+#if defined(MATH_SSE2) || defined(MATH_NEON)
+#define MATH_SIMD
+#endif
+
+// The kernels take element counts, p[i * STRIDE] is element i.
+static double sumKernel(const double *p, int count)
+{
+    double sum = 0;
+    int i = 0;
+#ifdef MATH_SIMD
+    // Two sums, so one add need not wait for the one before.
+    v2_t a = splat2(0), b = splat2(0);
+    for (; i + 4 <= count; i += 4) {
+        a = add2(a, load2(p + i * STRIDE));
+        b = add2(b, load2(p + (i + 2) * STRIDE));
+    }
+    a = add2(a, b);
+    sum = low2(a) + high2(a);
+#endif
+    for (; i < count; i++) sum += p[i * STRIDE];
+    return sum;
+}
+
+static double dotKernel(const double *p, const double *q, int count)
+{
+    double sum = 0;
+    int i = 0;
+#ifdef MATH_SIMD
+    v2_t a = splat2(0), b = splat2(0);
+    for (; i + 4 <= count; i += 4) {
+        a = add2(a, mul2(load2(p + i * STRIDE), load2(q + i * STRIDE)));
+        b = add2(b, mul2(load2(p + (i + 2) * STRIDE), load2(q + (i + 2) * STRIDE)));
+    }
+    a = add2(a, b);
+    sum = low2(a) + high2(a);
+#endif
+    for (; i < count; i++) sum += p[i * STRIDE] * q[i * STRIDE];
+    return sum;
+}
+
+// Needs count > 0.
+static double minMaxKernel(const double *p, int count, bool max)
+{
+    double result = p[0];
+    int i = 1;
+#ifdef MATH_SIMD
+    if (count >= 2) {
+        v2_t a = load2(p);
+        for (i = 2; i + 2 <= count; i += 2) {
+            v2_t x = load2(p + i * STRIDE);
+            a = max ? max2(a, x) : min2(a, x);
+        }
+        result = max ? fmax(low2(a), high2(a)) : fmin(low2(a), high2(a));
+    }
+#endif
+    for (; i < count; i++) {
+        double x = p[i * STRIDE];
+        if (max ? x > result : x < result) result = x;
+    }
+    return result;
+}
+
+// out[i] = sqrt(p[i]), out[i] = p[i] * k, out[i] = p[i] + q[i].
+static void sqrtKernel(double *out, const double *p, int count)
+{
+    int i = 0;
+#ifdef MATH_SIMD
+    for (; i + 2 <= count; i += 2) {
+        store2(out + i * STRIDE, sqrt2(load2(p + i * STRIDE)));
+    }
+#endif
+    for (; i < count; i++) out[i * STRIDE] = sqrt(p[i * STRIDE]);
+}
+
+static void scaleKernel(double *out, const double *p, double k, int count)
+{
+    int i = 0;
+#ifdef MATH_SIMD
+    v2_t factor = splat2(k);
+    for (; i + 2 <= count; i += 2) {
+        store2(out + i * STRIDE, mul2(load2(p + i * STRIDE), factor));
+    }
+#endif
+    for (; i < count; i++) out[i * STRIDE] = p[i * STRIDE] * k;
+}
+
+static void addKernel(double *out, const double *p, const double *q, int count)
+{
+    int i = 0;
+#ifdef MATH_SIMD
+    for (; i + 2 <= count; i += 2) {
+        store2(out + i * STRIDE, add2(load2(p + i * STRIDE), load2(q + i * STRIDE)));
+    }
+#endif
+    for (; i < count; i++) out[i * STRIDE] = p[i * STRIDE] + q[i * STRIDE];
+}
+
+static bool allNumbers(map_t *map)
+{
+    for (int i = 0; i < map->arrayCount; i++) {
+        if (!IS_NUM(map->array[i])) return false;
+    }
+    return true;
+}
+
+// Whether the array parts of both maps are numbers of the same count.
+static bool sameNumbers(map_t *a, map_t *b)
+{
+    return a->arrayCount == b->arrayCount && allNumbers(a) && allNumbers(b);
+}
+
+// A map with an array part of count numbers, for a kernel to fill in.
+static map_t *newNumbers(vm_t *vm, int count)
+{
+    map_t *map = map_new(vm, count, 0);
+#ifndef NAN_BOXING
+    // The kernels store the numbers, not their type.
+    for (int i = 0; i < count; i++) map->array[i].type = VT_NUM;
+#endif
+    map->arrayCount = count;
+    return map;
+}
+
+static val_t math_sum(vm_t *vm, int argc, val_t *args)
+{
+    map_t *map = AS_MAP(args[0]);
+    if (!allNumbers(map)) return VAL_NIL;
+    if (map->arrayCount == 0) return VAL_NUM(0);
+
+    return VAL_NUM(sumKernel(NUMBERS(map->array), map->arrayCount));
+}
+
+static val_t math_dot(vm_t *vm, int argc, val_t *args)
+{
+    map_t *a = AS_MAP(args[0]);
+    map_t *b = AS_MAP(args[1]);
+    if (!sameNumbers(a, b)) return VAL_NIL;
+    if (a->arrayCount == 0) return VAL_NUM(0);
+
+    return VAL_NUM(dotKernel(NUMBERS(a->array), NUMBERS(b->array), a->arrayCount));
+}
+
+static val_t math_min(vm_t *vm, int argc, val_t *args)
+{
+    map_t *map = AS_MAP(args[0]);
+    if (map->arrayCount == 0 || !allNumbers(map)) return VAL_NIL;
+
+    return VAL_NUM(minMaxKernel(NUMBERS(map->array), map->arrayCount, false));
+}
+
+static val_t math_max(vm_t *vm, int argc, val_t *args)
+{
+    map_t *map = AS_MAP(args[0]);
+    if (map->arrayCount == 0 || !allNumbers(map)) return VAL_NIL;
+
+    return VAL_NUM(minMaxKernel(NUMBERS(map->array), map->arrayCount, true));
+}
+
+static val_t math_map_sqrt(vm_t *vm, int argc, val_t *args)
+{
+    map_t *map = AS_MAP(args[0]);
+    if (!allNumbers(map)) return VAL_NIL;
+
+    map_t *result = newNumbers(vm, map->arrayCount);
+    if (map->arrayCount > 0) {
+        sqrtKernel(NUMBERS(result->array), NUMBERS(map->array), map->arrayCount);
+    }
+    return VAL_OBJ(result);
+}
+
+static val_t math_scale(vm_t *vm, int argc, val_t *args)
+{
+    map_t *map = AS_MAP(args[0]);
+    if (!allNumbers(map)) return VAL_NIL;
+
+    map_t *result = newNumbers(vm, map->arrayCount);
+    if (map->arrayCount > 0) {
+        scaleKernel(NUMBERS(result->array), NUMBERS(map->array), AS_NUM(args[1]), map->arrayCount);
+    }
+    return VAL_OBJ(result);
+}
+
+static val_t math_add(vm_t *vm, int argc, val_t *args)
+{
+    map_t *a = AS_MAP(args[0]);
+    map_t *b = AS_MAP(args[1]);
+    if (!sameNumbers(a, b)) return VAL_NIL;
+
+    map_t *result = newNumbers(vm, a->arrayCount);
+    if (a->arrayCount > 0) {
+        addKernel(NUMBERS(result->array), NUMBERS(a->array), NUMBERS(b->array), a->arrayCount);
+    }
+    return VAL_OBJ(result);
+}
+
+// abs, floor and sqrt also run inline, as the opcodes CALL quickens into.
+static const native_t natives[] = {
+    { math_abs,     "abs",      1, "n",     NATIVE_PURE, OP_ABS },
+    { math_ceil,    "ceil",     1, "n",     NATIVE_PURE, 0 },
+    { math_cos,     "cos",      1, "n",     NATIVE_PURE, 0 },
+    { math_floor,   "floor",    1, "n",     NATIVE_PURE, OP_FLOOR },
+    { math_log,     "log",      1, "n",     NATIVE_PURE, 0 },
+    { math_log10,   "log10",    1, "n",     NATIVE_PURE, 0 },
+    { math_pow,     "pow",      2, "nn",    NATIVE_PURE, 0 },
+    { math_sin,     "sin",      1, "n",     NATIVE_PURE, 0 },
+    { math_sqrt,    "sqrt",     1, "n",     NATIVE_PURE, OP_SQRT },
+    { math_sum,     "sum",      1, "m",     NATIVE_PURE, 0 },
+    { math_dot,     "dot",      2, "mm",    NATIVE_PURE, 0 },
+    { math_min,     "min",      1, "m",     NATIVE_PURE, 0 },
+    { math_max,     "max",      1, "m",     NATIVE_PURE, 0 },
+    { math_map_sqrt,"map_sqrt", 1, "m",     0, 0 },
+    { math_scale,   "scale",    2, "mn",    0, 0 },
+    { math_add,     "add",      2, "mm",    0, 0 },
+};
+
 void load_libmath(vm_t *vm)
 {
-    map_t *math = map_new(vm, 0, 0);
+    int count = sizeof(natives) / sizeof(natives[0]);
+    map_t *math = map_new(vm, 0, count);
+    vm_push(vm, VAL_OBJ(math));
 
-    map_set(vm, math, "abs", VAL_CFN(math_abs));
-    map_set(vm, math, "ceil", VAL_CFN(math_ceil));
-    map_set(vm, math, "cos", VAL_CFN(math_cos));
-    map_set(vm, math, "floor", VAL_CFN(math_floor));
-    map_set(vm, math, "log", VAL_CFN(math_log));
-    map_set(vm, math, "log10", VAL_CFN(math_log10));
-    map_set(vm, math, "pow", VAL_CFN(math_pow));
-    map_set(vm, math, "sin", VAL_CFN(math_sin));
-    map_set(vm, math, "sqrt", VAL_CFN(math_sqrt));
+    for (int i = 0; i < count; i++) {
+        map_set(vm, math, natives[i].name, VAL_CFN(&natives[i]));
+    }
 
     set_global(vm, "math", VAL_OBJ(math));
+    vm_pop(vm);
 }
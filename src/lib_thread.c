@@ -1,3 +1,6 @@
+// For usleep under -std=c11.
+#define _DEFAULT_SOURCE
+
 #include <stdlib.h>
 
 #ifdef _WIN32
@@ -10,28 +13,37 @@
 #include "libs.h"
 #include "vm.h"
 #include "value.h"
+#include "pool.h"
 
 typedef struct {
+    ptrkind_t kind;
     vm_t *vm;
     vm_t *main;
     fun_t *routine;
 #ifdef _WIN32
     HANDLE handle;
 #else
-    // todo
+    pthread_t handle;
 #endif
+    int argc;
+    int status;
+    bool started;       // the routine can only run once
     bool running;
 } thread_t;
 
 #ifdef _WIN32
 static DWORD WINAPI thread_routine(void *data)
 #else
+static void *thread_routine(void *data)
 #endif
 {
     thread_t *thread = data;
 
-    vm_call(thread->vm, VAL_OBJ(thread->routine), 0);
-    vm_execute(thread->vm);
+    thread->status = VM_RUNTIME_ERROR;
+    if (vm_call(thread->vm, VAL_OBJ(thread->routine), thread->argc)) {
+        thread->status = vm_execute(thread->vm);
+    }
+    output_flush(&thread->vm->out);
 
     return 0;
 }
@@ -52,16 +64,20 @@ static val_t thread_sleep(vm_t *vm, int argc, val_t *args)
 static val_t thread_create(vm_t *vm, int argc, val_t *args)
 {
     thread_t *thread = malloc(sizeof(thread_t));
+    thread->kind = PTR_THREAD;
     thread->main = vm;
     thread->vm = vm_clone(vm);
+    thread->argc = 0;
+    thread->started = false;
     thread->running = false;
-    thread->routine = AS_FUN(args[0]);
 
-    vm_push(thread->vm, args[0]);
+    // The routine runs on its own heap, take a copy of it there.
+    val_t routine = vm_import(thread->vm, args[0]);
+    thread->routine = AS_FUN(routine);
+    vm_push(thread->vm, routine);
 
 #ifdef _WIN32
     thread->handle = CreateThread(NULL, 0, thread_routine, thread, CREATE_SUSPENDED, NULL);
-#else
 #endif
 
     return VAL_PTR(thread);
@@ -72,6 +88,7 @@ static val_t thread_exit(vm_t *vm, int argc, val_t *args)
 #ifdef _WIN32
     ExitThread(0);
 #else
+    pthread_exit(NULL);
 #endif
 
     return VAL_NIL;
@@ -81,16 +98,19 @@ static val_t thread_start(vm_t *vm, int argc, val_t *args)
 {
     thread_t *thread = AS_PTR(args[0]);
 
-    if (!thread->running) {
-        for (int i = 0; i < argc; i++) {
-            //vm_push(thread->vm, args[i]);
+    if (!thread->started) {
+        for (int i = 1; i < argc; i++) {
+            vm_push(thread->vm, vm_import(thread->vm, args[i]));
         }
 
+        thread->argc = argc - 1;
+        thread->started = true;
         thread->running = true;
 
 #ifdef _WIN32
         ResumeThread(thread->handle);
 #else
+        pthread_create(&thread->handle, NULL, thread_routine, thread);
 #endif
     }
 
@@ -100,26 +120,36 @@ static val_t thread_start(vm_t *vm, int argc, val_t *args)
 static val_t thread_join(vm_t *vm, int argc, val_t *args)
 {
     thread_t *thread = AS_PTR(args[0]);
+    val_t result = VAL_NIL;
 
     if (thread->running) {
 #ifdef _WIN32
         WaitForSingleObject(thread->handle, INFINITE);
 #else
+        pthread_join(thread->handle, NULL);
 #endif
+        thread->running = false;
+
+        if (thread->status == VM_OK) {
+            result = vm_import(vm, vm_pop(thread->vm));
+        }
     }
 
-    return VAL_NIL;
+    return result;
 }
 
 static val_t thread_cancel(vm_t *vm, int argc, val_t *args)
 {
     thread_t *thread = AS_PTR(args[0]);
 
-    if (!thread->running) {
+    if (thread->running) {
 #ifdef _WIN32
         TerminateThread(thread->handle, 0);
 #else
+        pthread_cancel(thread->handle);
+        pthread_join(thread->handle, NULL);
 #endif
+        thread->running = false;
     }
 
     return VAL_NIL;
@@ -133,30 +163,60 @@ static val_t thread_close(vm_t *vm, int argc, val_t *args)
 #ifdef _WIN32
         TerminateThread(thread->handle, 0);
 #else
+        pthread_cancel(thread->handle);
+        pthread_join(thread->handle, NULL);
 #endif
     }
 
 #ifdef _WIN32
     CloseHandle(thread->handle);
-#else
 #endif
 
-    free(thread->vm);
-    free(thread);
+    // The script may still hold the handle, it stays behind closed so
+    // natives turn it down instead of reading freed memory.
+    vm_close(thread->vm);
+    thread->kind = PTR_CLOSED;
     return VAL_NIL;
 }
 
+static val_t thread_spawn(vm_t *vm, int argc, val_t *args)
+{
+    return VAL_PTR(pool_spawn(vm, args[0], argc - 1, args + 1));
+}
+
+static val_t thread_await(vm_t *vm, int argc, val_t *args)
+{
+    return pool_await(vm, AS_PTR(args[0]));
+}
+
+static val_t thread_parallel_map(vm_t *vm, int argc, val_t *args)
+{
+    return pool_map(vm, AS_MAP(args[0]), args[1]);
+}
+
+static const native_t natives[] = {
+    { thread_sleep,         "sleep",        1, "n",     0, 0 },
+    { thread_create,        "create",       1, "f",     0, 0 },
+    { thread_exit,          "exit",         0, "",      0, 0 },
+    { thread_start,         "start",        1, "t",     NATIVE_VARARGS, 0 },
+    { thread_join,          "join",         1, "t",     0, 0 },
+    { thread_cancel,        "cancel",       1, "t",     0, 0 },
+    { thread_close,         "close",        1, "t",     0, 0 },
+    { thread_spawn,         "spawn",        1, ".",     NATIVE_VARARGS, 0 },
+    { thread_await,         "await",        1, "k",     0, 0 },
+    { thread_parallel_map,  "parallel_map", 2, "m.",    0, 0 },
+};
+
 void load_libthread(vm_t *vm)
 {
-    map_t *thread = map_new(vm, 0, 0);
+    int count = sizeof(natives) / sizeof(natives[0]);
+    map_t *thread = map_new(vm, 0, count);
+    vm_push(vm, VAL_OBJ(thread));
 
-    map_set(vm, thread, "sleep", VAL_CFN(thread_sleep));
-    map_set(vm, thread, "create", VAL_CFN(thread_create));
-    map_set(vm, thread, "exit", VAL_CFN(thread_exit));
-    map_set(vm, thread, "start", VAL_CFN(thread_start));
-    map_set(vm, thread, "join", VAL_CFN(thread_join));
-    map_set(vm, thread, "cancel", VAL_CFN(thread_cancel));
-    map_set(vm, thread, "close", VAL_CFN(thread_close));
+    for (int i = 0; i < count; i++) {
+        map_set(vm, thread, natives[i].name, VAL_CFN(&natives[i]));
+    }
 
     set_global(vm, "thread", VAL_OBJ(thread));
+    vm_pop(vm);
 }
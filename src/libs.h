@@ -5,3 +5,4 @@
 
 void load_libmath(vm_t *vm);
 void load_libthread(vm_t *vm);
+void load_libfiber(vm_t *vm);
@@ -1,12 +1,144 @@
+// For clock_gettime and CLOCK_MONOTONIC under -std=c11.
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <pthread.h>
+#endif
 
 #include "vm.h"
 #include "libs.h"
+#include "sampler.h"
+#include "program.h"
+
+static double wallClock()
+{
+#ifdef _WIN32
+    return (double)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+#endif
+}
+
+// Peak resident set of the process in KB.
+static long peakRss()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!K32GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+    return (long)(counters.PeakWorkingSetSize / 1024);
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+static void loadLibs(vm_t *vm)
+{
+    load_libmath(vm);
+    load_libthread(vm);
+    load_libfiber(vm);
+}
+
+// A vm of its own running the shared program, for -r.
+typedef struct {
+    vm_t *settings;     // vm the program got compiled in
+    prog_t *prog;
+    int status;
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    pthread_t handle;
+#endif
+} runner_t;
+
+#ifdef _WIN32
+static DWORD WINAPI runRoutine(void *data)
+#else
+static void *runRoutine(void *data)
+#endif
+{
+    runner_t *runner = data;
+    vm_t *vm = vm_create();
+    runner->status = VM_INIT_ERROR;
+    if (vm == NULL) return 0;
+
+    vm->optimize = runner->settings->optimize;
+    vm->jit = runner->settings->jit;
+    vm->debug = runner->settings->debug;
+    loadLibs(vm);
+    runner->status = vm_run(vm, runner->prog);
+    vm_close(vm);
+    return 0;
+}
+
+// Compiles the script once and runs it on count vms at the same time,
+// the first status that is not VM_OK is returned.
+static int runShared(vm_t *vm, const char *fname, int count)
+{
+    prog_t *prog = prog_compile(vm, fname);
+    if (prog == NULL) return VM_COMPILE_ERROR;
+
+    runner_t *runners = malloc(count * sizeof(runner_t));
+    for (int i = 0; i < count; i++) {
+        runners[i].settings = vm;
+        runners[i].prog = prog;
+#ifdef _WIN32
+        runners[i].handle = CreateThread(NULL, 0, runRoutine, &runners[i], 0, NULL);
+#else
+        pthread_create(&runners[i].handle, NULL, runRoutine, &runners[i]);
+#endif
+    }
+
+    int status = VM_OK;
+    for (int i = 0; i < count; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(runners[i].handle, INFINITE);
+        CloseHandle(runners[i].handle);
+#else
+        pthread_join(runners[i].handle, NULL);
+#endif
+        if (status == VM_OK) status = runners[i].status;
+    }
+
+    free(runners);
+    prog_release(prog);
+    return status;
+}
+
+// One JSON object on stderr for bench/run.sh.
+static void printStats(vm_t *vm, int status, double start)
+{
+    output_flush(&vm->out);
+    fprintf(stderr, "{\"status\": %d, \"wall_ms\": %.3f, \"heap_peak\": %zu, \"rss_kb\": %ld",
+        status, wallClock() - start, vm->gc->peak, peakRss());
+#ifdef DEBUG_PROFILE
+    if (vm->profile != NULL) {
+        fprintf(stderr, ", \"instructions\": %llu", (unsigned long long)vm->profile->total);
+    }
+#endif
+    fprintf(stderr, "}\n");
+}
 
 int main(int argc, char **argv)
 {
     if (argc < 2) {
-        printf("usage: lox [file]\n");
+        printf("usage: lox [-O[level]] [-j[0|1]] [-g[0|1]] [-p] [-r[vms]] [-s[file]] [-t] [file]\n");
         return 0;
     }
 
@@ -14,10 +146,51 @@ int main(int argc, char **argv)
     int ret = VM_INIT_ERROR;
 
     if (vm != NULL) {
-        load_libmath(vm);
-        load_libthread(vm);
-        ret = vm_dofile(vm, argv[argc - 1]);
+        bool stats = false;
+        int runs = 0;
+        double start = wallClock();
+
+        for (int i = 1; i < argc - 1; i++) {
+            if (strncmp(argv[i], "-O", 2) == 0) {
+                vm->optimize = argv[i][2] != '\0' ? atoi(argv[i] + 2) : 1;
+            }
+            else if (strncmp(argv[i], "-j", 2) == 0) {
+                vm->jit = argv[i][2] != '\0' ? atoi(argv[i] + 2) : 1;
+            }
+            else if (strncmp(argv[i], "-g", 2) == 0) {
+                vm->debug = argv[i][2] != '\0' ? atoi(argv[i] + 2) : 1;
+            }
+            else if (strncmp(argv[i], "-s", 2) == 0) {
+                const char *path = argv[i][2] != '\0' ? argv[i] + 2 : "lox.folded";
+                if (sampler_start(path)) sampler_attach(vm);
+            }
+            else if (strncmp(argv[i], "-r", 2) == 0) {
+                runs = argv[i][2] != '\0' ? atoi(argv[i] + 2) : 4;
+            }
+            else if (strcmp(argv[i], "-t") == 0) {
+                stats = true;
+            }
+            else if (strcmp(argv[i], "-p") == 0) {
+#ifdef DEBUG_PROFILE
+                // Compiled code runs past the dispatch loop that counts.
+                vm->profile = profile_new();
+                vm->jit = 0;
+#else
+                fprintf(stderr, "lox: -p needs a build with DEBUG_PROFILE\n");
+#endif
+            }
+        }
+
+        loadLibs(vm);
+        if (runs > 0) {
+            ret = runShared(vm, argv[argc - 1], runs);
+        }
+        else {
+            ret = vm_dofile(vm, argv[argc - 1]);
+        }
+        if (stats) printStats(vm, ret, start);
         vm_close(vm);
+        sampler_stop();
     }
 
     return ret;
@@ -5,6 +5,8 @@
 #include "object.h"
 #include "vm.h"
 #include "gc.h"
+#include "jit.h"
+#include "fiber.h"
 
 #define ALLOC(gc, size) \
     gc_realloc(gc, NULL, 0, size)
@@ -21,47 +23,117 @@ static obj_t *allocateObject(vm_t *vm, size_t size, otype_t type)
 
     obj_t *object = ALLOC(gc, size);
     object->type = type;
+    object->marked = false;
+    object->old = false;
+    object->remembered = false;
 
     object->next = gc->objects;
     gc->objects = object;
     return object;
 }
 
-static str_t *allocateString(vm_t *vm, char *chars, int length, uint32_t hash)
+#define STR_SIZE(length) \
+    (sizeof(str_t) + (length) + 1)
+
+static str_t *allocateString(vm_t *vm, const char *chars, int length, uint32_t hash)
 {
-    str_t *string = ALLOC_OBJ(vm, str_t, OT_STR);
+    str_t *string = (str_t *)allocateObject(vm, STR_SIZE(length), OT_STR);
     string->length = length;
-    string->chars = chars;
     string->hash = hash;
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
 
     tab_set(vm->strings, string, VAL_NIL);
 
     return string;
 }
 
-str_t *str_take(vm_t *vm, char *chars, int length)
+str_t *str_copy(vm_t *vm, const char *chars, int length)
 {
     uint32_t hash = hash_bytes(chars, length);
     str_t *interned = tab_findstr(vm->strings, chars, length, hash);
-    if (interned != NULL) {
-        free(chars);
-        return interned;
-    }
+    if (interned != NULL) return interned;
 
     return allocateString(vm, chars, length, hash);
 }
 
-str_t *str_copy(vm_t *vm, const char *chars, int length)
+str_t *str_flatten(vm_t *vm, obj_t *object)
 {
-    uint32_t hash = hash_bytes(chars, length);
-    str_t *interned = tab_findstr(vm->strings, chars, length, hash);
-    if (interned != NULL) return interned;
+    if (object->type == OT_STR) return (str_t *)object;
+
+    rope_t *rope = (rope_t *)object;
+    if (rope->flat == NULL) {
+        rope->flat = str_copy(vm, rope->buffer->chars, rope->length);
+        GC_BARRIER(vm->gc, rope);
+    }
+    return rope->flat;
+}
+
+bool str_equal(obj_t *a, obj_t *b)
+{
+    if (a == b) return true;
+    if (a->type == OT_STR && b->type == OT_STR) return false;
+
+    int alength, blength;
+    const char *achars = str_chars(a, &alength);
+    const char *bchars = str_chars(b, &blength);
+    return alength == blength && memcmp(achars, bchars, alength) == 0;
+}
+
+static buf_t *newBuffer(vm_t *vm, int capacity)
+{
+    buf_t *buffer = ALLOC(vm->gc, sizeof(buf_t));
+    buffer->refs = 0;
+    buffer->count = 0;
+    buffer->capacity = capacity;
+    buffer->chars = ALLOC(vm->gc, capacity);
+    return buffer;
+}
+
+static rope_t *newRope(vm_t *vm, buf_t *buffer, int length)
+{
+    rope_t *rope = ALLOC_OBJ(vm, rope_t, OT_ROPE);
+    rope->buffer = buffer;
+    rope->length = length;
+    rope->flat = NULL;
+
+    buffer->refs++;
+    return rope;
+}
+
+obj_t *str_concat(vm_t *vm, obj_t *a, obj_t *b)
+{
+    int alength, blength;
+    str_chars(a, &alength);
+    str_chars(b, &blength);
+    int length = alength + blength;
 
-    char *heapChars = malloc((length + 1) * sizeof(char));
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
+    if (length < ROPE_MIN) {
+        char chars[ROPE_MIN];
+        memcpy(chars, str_chars(a, &alength), alength);
+        memcpy(chars + alength, str_chars(b, &blength), blength);
+        return (obj_t *)str_copy(vm, chars, length);
+    }
+
+    buf_t *buffer;
+    if (a->type == OT_ROPE && ((rope_t *)a)->length == ((rope_t *)a)->buffer->count) {
+        buffer = ((rope_t *)a)->buffer;
+        if (length > buffer->capacity) {
+            int capacity = length * 2;
+            buffer->chars = gc_realloc(vm->gc, buffer->chars, buffer->capacity, capacity);
+            buffer->capacity = capacity;
+        }
+    }
+    else {
+        buffer = newBuffer(vm, length * 2);
+        memcpy(buffer->chars, str_chars(a, &alength), alength);
+    }
+
+    // Read after growing, b may share the buffer.
+    memcpy(buffer->chars + alength, str_chars(b, &blength), blength);
+    buffer->count = length;
 
-    return allocateString(vm, heapChars, length, hash);
+    return (obj_t *)newRope(vm, buffer, length);
 }
 
 fun_t *fun_new(vm_t *vm, src_t *source)
@@ -70,6 +142,8 @@ fun_t *fun_new(vm_t *vm, src_t *source)
 
     function->arity = 0;
     function->name = NULL;
+    function->hot = 0;
+    function->jit = NULL;
     chunk_init(&function->chunk, source);
     return function;
 }
@@ -78,19 +152,185 @@ map_t *map_new(vm_t *vm, int arr_cap, int tab_cap)
 {
     map_t *map = ALLOC_OBJ(vm, map_t, OT_MAP);
 
+    map->array = NULL;
+    map->arrayCount = 0;
+    map->arrayCapacity = 0;
     hash_init(&map->hash);
     tab_init(&map->table);
-    // todo
+    map->shape = vm->gc->emptyShape;
+    map->fields = NULL;
+    map->fieldCapacity = 0;
+
+    if (arr_cap > 0) {
+        map->array = malloc(arr_cap * sizeof(val_t));
+        map->arrayCapacity = arr_cap;
+    }
+    if (tab_cap > 0) {
+        map->fields = malloc(tab_cap * sizeof(val_t));
+        map->fieldCapacity = tab_cap;
+    }
     return map;
 }
 
+fiber_t *fiber_new(vm_t *vm)
+{
+    fiber_t *fiber = ALLOC_OBJ(vm, fiber_t, OT_FIBER);
+
+    memset(&fiber->ctx, 0, sizeof(ctx_t));
+    fiber->state = FIBER_READY;
+    fiber->argc = 0;
+    fiber->result = VAL_NIL;
+    fiber->index = -1;
+    fiber->next = NULL;
+    fiber->waiters = NULL;
+    fiber->deadline = 0;
+    fiber->yielded = false;
+    fiber->signaled = false;
+    fiber->watch.fd = -1;
+    fiber->watch.fiber = fiber;
+    return fiber;
+}
+
+bool map_getnum(map_t *map, double key, val_t *value)
+{
+    int slot = map_slot(map, key);
+    if (slot >= 0) {
+        *value = map->array[slot];
+        return true;
+    }
+    return hash_get(&map->hash, AS_RAW(VAL_NUM(key)), value);
+}
+
+static void appendArray(map_t *map, val_t value)
+{
+    if (map->arrayCount >= map->arrayCapacity) {
+        map->arrayCapacity = GROW_CAPACITY(map->arrayCapacity);
+        map->array = realloc(map->array, map->arrayCapacity * sizeof(val_t));
+    }
+    map->array[map->arrayCount++] = value;
+}
+
+void map_setnum(vm_t *vm, map_t *map, double key, val_t value)
+{
+    int slot = map_slot(map, key);
+
+    if (slot >= 0) {
+        map->array[slot] = value;
+        // Trailing nils are indistinguishable from missing keys, drop them
+        // so a map emptied from the back gives its array part up.
+        if (IS_NIL(value) && slot == map->arrayCount - 1) {
+            while (map->arrayCount > 0 && IS_NIL(map->array[map->arrayCount - 1])) {
+                map->arrayCount--;
+            }
+        }
+    }
+    else if (key == map->arrayCount && !IS_NIL(value)) {
+        appendArray(map, value);
+
+        // Pull the keys that now continue the sequence out of the hash.
+        val_t next;
+        while (map->hash.count > 0 &&
+               hash_get(&map->hash, AS_RAW(VAL_NUM(map->arrayCount)), &next)) {
+            hash_remove(&map->hash, AS_RAW(VAL_NUM(map->arrayCount)));
+            appendArray(map, next);
+        }
+    }
+    else if (IS_NIL(value)) {
+        hash_remove(&map->hash, AS_RAW(VAL_NUM(key)));
+    }
+    else {
+        hash_set(&map->hash, AS_RAW(VAL_NUM(key)), value);
+    }
+    GC_BARRIER(vm->gc, map);
+}
+
+// Moves the fields into the table, the map no longer has a shape.
+static void mapToDictionary(map_t *map)
+{
+    for (shape_t *shape = map->shape; shape->parent != NULL; shape = shape->parent) {
+        tab_set(&map->table, shape->key, map->fields[shape->count - 1]);
+    }
+
+    free(map->fields);
+    map->fields = NULL;
+    map->fieldCapacity = 0;
+    map->shape = NULL;
+}
+
+bool map_getstr(map_t *map, str_t *key, val_t *value, icache_t *cache)
+{
+    if (map->shape == NULL) {
+        return tab_get(&map->table, key, value);
+    }
+
+    int offset = shape_find(map->shape, key);
+    if (offset < 0) return false;
+
+    if (cache != NULL) {
+        cache->shape = map->shape;
+        cache->next = NULL;
+        cache->offset = offset;
+    }
+
+    *value = map->fields[offset];
+    return true;
+}
+
+void map_setfield(vm_t *vm, map_t *map, str_t *key, val_t value, icache_t *cache)
+{
+    if (map->shape == NULL) {
+        tab_set(&map->table, key, value);
+        GC_BARRIER(vm->gc, map);
+        return;
+    }
+
+    shape_t *from = map->shape;
+    int offset = shape_find(from, key);
+
+    if (offset < 0) {
+        if (from->count >= SHAPE_MAX_FIELDS) {
+            mapToDictionary(map);
+            map_setfield(vm, map, key, value, NULL);
+            return;
+        }
+
+        if (from->count >= map->fieldCapacity) {
+            map->fieldCapacity = GROW_CAPACITY(map->fieldCapacity);
+            map->fields = realloc(map->fields, map->fieldCapacity * sizeof(val_t));
+        }
+
+        map->shape = shape_add(&vm->gc->shapes, from, key);
+        offset = from->count;
+    }
+
+    if (cache != NULL) {
+        cache->shape = from;
+        cache->next = (map->shape != from) ? map->shape : NULL;
+        cache->offset = offset;
+    }
+
+    map->fields[offset] = value;
+    GC_BARRIER(vm->gc, map);
+}
+
+void map_setstr(vm_t *vm, map_t *map, str_t *key, val_t value)
+{
+    // Computed keys would grow the shape tree without bound, a new one
+    // turns the map into a plain dictionary.
+    if (map->shape != NULL && shape_find(map->shape, key) < 0) {
+        mapToDictionary(map);
+    }
+
+    map_setfield(vm, map, key, value, NULL);
+}
+
 void map_set(vm_t *vm, map_t *map, const char *key, val_t value)
 {
     str_t *field = str_copy(vm, key, (int)strlen(key));
 
     vm_push(vm, value);
     vm_push(vm, VAL_OBJ(field));
-    tab_set(&map->table, field, value);
+    map_setfield(vm, map, field, value, NULL);
 
     vm_pop(vm);
     vm_pop(vm);
@@ -100,35 +340,50 @@ const char *obj_typeof(obj_t *object)
 {
     switch (object->type) {
         case OT_STR:
+        case OT_ROPE:
             return "str";
         case OT_FUN:
             return "fn";
+        case OT_FIBER:
+            return "fiber";
         default:
             return "obj";
     }
 }
 
-void obj_print(obj_t *object)
+void obj_print(output_t *out, obj_t *object)
 {
+    char buffer[32];
+
     switch (object->type) {
         case OT_STR: {
             str_t *string = (str_t *)object;
-            printf("%.*s", string->length, string->chars);
+            output_write(out, string->chars, string->length);
             break;
         }
         case OT_FUN: {
             fun_t *function = (fun_t *)object;
-            if (function->name == NULL)
-                printf("<script>");
-            else
-                printf("fn: %s", function->name->chars);
+            if (function->name == NULL) {
+                output_write(out, "<script>", 8);
+            } else {
+                output_write(out, "fn: ", 4);
+                output_write(out, function->name->chars, function->name->length);
+            }
+            break;
+        }
+        case OT_ROPE: {
+            rope_t *rope = (rope_t *)object;
+            output_write(out, rope->buffer->chars, rope->length);
             break;
         }
         case OT_MAP:
-            printf("map: %p", object);
+            output_write(out, buffer, snprintf(buffer, sizeof(buffer), "map: %p", object));
+            break;
+        case OT_FIBER:
+            output_write(out, buffer, snprintf(buffer, sizeof(buffer), "fiber: %p", object));
             break;
         default:
-            printf("obj: %p", object);
+            output_write(out, buffer, snprintf(buffer, sizeof(buffer), "obj: %p", object));
             break;
     }
 }
@@ -138,22 +393,41 @@ void obj_free(gc_t *gc, obj_t *object)
     switch (object->type) {
         case OT_STR: {
             str_t *string = (str_t *)object;
-            free(string->chars);
-            FREE(gc, str_t, string);
+            gc_realloc(gc, string, STR_SIZE(string->length), 0);
+            break;
+        }
+        case OT_ROPE: {
+            rope_t *rope = (rope_t *)object;
+            buf_t *buffer = rope->buffer;
+            if (--buffer->refs == 0) {
+                gc_realloc(gc, buffer->chars, buffer->capacity, 0);
+                FREE(gc, buf_t, buffer);
+            }
+            FREE(gc, rope_t, rope);
             break;
         }
         case OT_FUN: {
             fun_t *function = (fun_t *)object;
+            jit_free(function->jit);
             chunk_free(&function->chunk);
             FREE(gc, fun_t, function);
             break;
         }
         case OT_MAP: {
             map_t *map = (map_t *)object;
+            free(map->array);
             hash_free(&map->hash);
             tab_free(&map->table);
+            free(map->fields);
             FREE(gc, map_t, map);
             break;
         }
+        case OT_FIBER: {
+            fiber_t *fiber = (fiber_t *)object;
+            free(fiber->ctx.stack);
+            free(fiber->ctx.frames);
+            FREE(gc, fiber_t, fiber);
+            break;
+        }
     }
 }
@@ -4,17 +4,41 @@
 #include "chunk.h"
 #include "table.h"
 #include "hash.h"
+#include "shape.h"
+
+#define ROPE_MIN            64      // shorter concatenations are interned right away
 
 struct _obj {
     otype_t type;
+    bool marked;
+    bool old;
+    bool remembered;
     struct _obj *next;
 };
 
 struct _str {
     obj_t obj;
-    char *chars;
     int length;
     uint32_t hash;
+    char chars[];
+};
+
+// Bytes shared by the ropes that extend one another.
+typedef struct {
+    int refs;           // ropes pointing here
+    int count;          // bytes written, the longest rope ends here
+    int capacity;
+    char *chars;
+} buf_t;
+
+// String made by concatenation, not interned until it is used as a key.
+// Appending to the rope that ends its buffer writes in place, so building
+// a string with repeated + costs linear time.
+struct _rope {
+    obj_t obj;
+    buf_t *buffer;
+    int length;         // the rope is the first length bytes of the buffer
+    str_t *flat;        // interned copy, once one was needed
 };
 
 struct _fun {
@@ -22,18 +46,28 @@ struct _fun {
     int arity;
     chunk_t chunk;
     str_t *name;
+    int hot;            // calls and backward jumps, up to JIT_THRESHOLD
+    struct _jit *jit;   // machine code, once the function got hot
 };
 
 struct _map {
     obj_t obj;
-    hash_t hash;
-    tab_t table;
+    val_t *array;       // number keys 0..arrayCount-1
+    int arrayCount;
+    int arrayCapacity;
+    hash_t hash;        // every other number key
+    tab_t table;        // string keys, once the map left its shape
+    shape_t *shape;     // layout of fields, NULL for dictionary maps
+    val_t *fields;
+    int fieldCapacity;
 };
 
 #define AS_STR(v)       ((str_t *)AS_OBJ(v))
 #define AS_CSTR(v)      (((str_t *)AS_OBJ(v))->chars)
 #define AS_FUN(v)       ((fun_t *)AS_OBJ(v))
 #define AS_MAP(v)       ((map_t *)AS_OBJ(v))
+#define AS_ROPE(v)      ((rope_t *)AS_OBJ(v))
+#define AS_FIBER(v)     ((fiber_t *)AS_OBJ(v))
 
 #define OBJ_TYPE(v)     (AS_OBJ(v)->type)
 
@@ -44,15 +78,52 @@ static inline bool obj_is(val_t value, otype_t type) {
 #define IS_STR(v)       (obj_is(v, OT_STR))
 #define IS_FUN(v)       (obj_is(v, OT_FUN))
 #define IS_MAP(v)       (obj_is(v, OT_MAP))
+#define IS_ROPE(v)      (obj_is(v, OT_ROPE))
+#define IS_FIBER(v)     (obj_is(v, OT_FIBER))
+
+// Strings and ropes alike.
+static inline bool str_is(val_t value) {
+    return IS_OBJ(value) && (OBJ_TYPE(value) == OT_STR || OBJ_TYPE(value) == OT_ROPE);
+}
+
+// Bytes of a string or rope, which need not be terminated.
+static inline const char *str_chars(obj_t *object, int *length) {
+    if (object->type == OT_ROPE) {
+        rope_t *rope = (rope_t *)object;
+        *length = rope->length;
+        return rope->buffer->chars;
+    }
+    *length = ((str_t *)object)->length;
+    return ((str_t *)object)->chars;
+}
 
-str_t *str_take(vm_t *vm, char *chars, int length);
 str_t *str_copy(vm_t *vm, const char *chars, int length);
+str_t *str_flatten(vm_t *vm, obj_t *object);
+bool str_equal(obj_t *a, obj_t *b);
+
+// Both operands must stay reachable, allocating may trigger a collection.
+obj_t *str_concat(vm_t *vm, obj_t *a, obj_t *b);
 
 fun_t *fun_new(vm_t *vm, src_t *source);
 
 map_t *map_new(vm_t *vm, int arr_cap, int tab_cap);
+// Fields of fibers are in fiber.h.
+fiber_t *fiber_new(vm_t *vm);
 void map_set(vm_t *vm, map_t *map, const char *key, val_t value);
 
+bool map_getstr(map_t *map, str_t *key, val_t *value, icache_t *cache);
+void map_setstr(vm_t *vm, map_t *map, str_t *key, val_t value);
+void map_setfield(vm_t *vm, map_t *map, str_t *key, val_t value, icache_t *cache);
+
+bool map_getnum(map_t *map, double key, val_t *value);
+void map_setnum(vm_t *vm, map_t *map, double key, val_t value);
+
+// Position of a number key in the array part, -1 if it lives in the hash.
+static inline int map_slot(map_t *map, double key) {
+    if (key >= 0 && key < map->arrayCount && (int)key == key) return (int)key;
+    return -1;
+}
+
 const char *obj_typeof(obj_t *object);
-void obj_print(obj_t *object);
+void obj_print(output_t *out, obj_t *object);
 void obj_free(gc_t *gc, obj_t *object);
@@ -0,0 +1,515 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "optimize.h"
+
+#define INS_MAXLEN      7
+#define THREAD_MAX      16      // jumps followed per jump, chains may loop
+
+// The chunk decoded into instructions, jumps point at instructions
+// instead of offsets so code can be dropped without patching them.
+typedef struct {
+    uint8_t bytes[INS_MAXLEN];
+    pos_t lines[INS_MAXLEN];
+    int target;         // instruction jumped to, -1 if none
+    bool removed;
+} ins_t;
+
+typedef struct {
+    chunk_t *chunk;
+    ins_t *code;
+    int count;
+    int *targeted;      // number of jumps landing on each instruction
+} opt_t;
+
+typedef bool (* pass_t)(opt_t *opt);
+
+// The jump a wide one is the 24 bit form of, any other op as it is.
+static uint8_t plainJump(uint8_t op)
+{
+    switch (op) {
+        case OP_JMP_W:   return OP_JMP;
+        case OP_JMPF_W:  return OP_JMPF;
+        case OP_JMPFP_W: return OP_JMPFP;
+        case OP_LOOP_W:  return OP_LOOP;
+        default:         return op;
+    }
+}
+
+// Turns a jump into op, as wide as it was.
+static void setJump(ins_t *ins, uint8_t op)
+{
+    if (plainJump(ins->bytes[0]) == ins->bytes[0]) {
+        ins->bytes[0] = op;
+        return;
+    }
+
+    switch (op) {
+        case OP_JMP:   ins->bytes[0] = OP_JMP_W;   break;
+        case OP_JMPF:  ins->bytes[0] = OP_JMPF_W;  break;
+        case OP_JMPFP: ins->bytes[0] = OP_JMPFP_W; break;
+        case OP_LOOP:  ins->bytes[0] = OP_LOOP_W;  break;
+    }
+}
+
+// Bytes of the jump offset, 3 for the wide jumps.
+static int jumpWidth(uint8_t op)
+{
+    return plainJump(op) != op ? 3 : 2;
+}
+
+// Position of the jump offset within an instruction, -1 if it jumps not.
+static int jumpOperand(uint8_t op)
+{
+    switch (op) {
+        case OP_JMP:
+        case OP_JMPF:
+        case OP_JMPFP:
+        case OP_LOOP:
+        case OP_JMP_W:
+        case OP_JMPF_W:
+        case OP_JMPFP_W:
+        case OP_LOOP_W:
+            return 1;
+        case OP_RLT:
+        case OP_RLE:
+        case OP_REQ:
+        case OP_RNE:
+        case OP_RGT:
+        case OP_RGE:
+            return 3;
+        case OP_FORPREP:
+            return 4;
+        case OP_FORLOOP:
+            return 5;
+        default:
+            return -1;
+    }
+}
+
+static bool jumpsBack(uint8_t op)
+{
+    return plainJump(op) == OP_LOOP || op == OP_FORLOOP;
+}
+
+static void decode(opt_t *opt)
+{
+    chunk_t *chunk = opt->chunk;
+    int *index = calloc(chunk->count + 1, sizeof(int));
+
+    opt->code = malloc(chunk->count * sizeof(ins_t));
+    opt->count = 0;
+
+    for (int offset = 0; offset < chunk->count; ) {
+        ins_t *ins = &opt->code[opt->count];
+        int length = chunk_oplen(chunk->code[offset]);
+
+        memcpy(ins->bytes, &chunk->code[offset], length);
+        memcpy(ins->lines, &chunk->lines[offset], length * sizeof(pos_t));
+        ins->target = -1;
+        ins->removed = false;
+
+        int operand = jumpOperand(ins->bytes[0]);
+        if (operand >= 0) {
+            int jump = 0;
+            for (int i = 0; i < jumpWidth(ins->bytes[0]); i++) {
+                jump = (jump << 8) | ins->bytes[operand + i];
+            }
+            ins->target = offset + length + (jumpsBack(ins->bytes[0]) ? -jump : jump);
+        }
+
+        index[offset] = opt->count++;
+        offset += length;
+    }
+
+    for (int i = 0; i < opt->count; i++) {
+        if (opt->code[i].target >= 0) opt->code[i].target = index[opt->code[i].target];
+    }
+
+    free(index);
+}
+
+static void encode(opt_t *opt)
+{
+    chunk_t *chunk = opt->chunk;
+    int *offsets = malloc((opt->count + 1) * sizeof(int));
+
+    int offset = 0;
+    for (int i = 0; i < opt->count; i++) {
+        offsets[i] = offset;
+        offset += chunk_oplen(opt->code[i].bytes[0]);
+    }
+    offsets[opt->count] = offset;
+
+    // The code only ever shrinks, it is rewritten in place.
+    for (int i = 0; i < opt->count; i++) {
+        ins_t *ins = &opt->code[i];
+        int length = chunk_oplen(ins->bytes[0]);
+        uint8_t *code = &chunk->code[offsets[i]];
+
+        memcpy(code, ins->bytes, length);
+        memcpy(&chunk->lines[offsets[i]], ins->lines, length * sizeof(pos_t));
+
+        int operand = jumpOperand(ins->bytes[0]);
+        if (operand >= 0) {
+            int jump = offsets[ins->target] - offsets[i] - length;
+            if (jumpsBack(ins->bytes[0])) jump = -jump;
+            for (int i = jumpWidth(ins->bytes[0]) - 1; i >= 0; i--, jump >>= 8) {
+                code[operand + i] = jump & 0xff;
+            }
+        }
+    }
+
+    chunk->count = offset;
+    free(offsets);
+}
+
+// Drops the removed instructions, jumps to them land on the next one kept.
+static void compact(opt_t *opt)
+{
+    int *index = malloc((opt->count + 1) * sizeof(int));
+
+    int count = 0;
+    for (int i = 0; i < opt->count; i++) {
+        index[i] = count;
+        if (!opt->code[i].removed) opt->code[count++] = opt->code[i];
+    }
+    index[opt->count] = count;
+
+    for (int i = 0; i < count; i++) {
+        if (opt->code[i].target >= 0) opt->code[i].target = index[opt->code[i].target];
+    }
+
+    opt->count = count;
+    free(index);
+}
+
+static bool runPass(opt_t *opt, pass_t pass)
+{
+    memset(opt->targeted, 0, opt->count * sizeof(int));
+    for (int i = 0; i < opt->count; i++) {
+        if (opt->code[i].target >= 0) opt->targeted[opt->code[i].target]++;
+    }
+
+    bool changed = pass(opt);
+    compact(opt);
+    return changed;
+}
+
+static int prevOp(opt_t *opt, int i)
+{
+    do i--; while (i >= 0 && opt->code[i].removed);
+    return i;
+}
+
+static int nextOp(opt_t *opt, int i)
+{
+    do i++; while (i < opt->count && opt->code[i].removed);
+    return i;
+}
+
+static bool constantAt(opt_t *opt, int i, val_t *value)
+{
+    if (i < 0) return false;
+    uint8_t *bytes = opt->code[i].bytes;
+
+    switch (bytes[0]) {
+        case OP_NIL:   *value = VAL_NIL;   return true;
+        case OP_TRUE:  *value = VAL_TRUE;  return true;
+        case OP_FALSE: *value = VAL_FALSE; return true;
+        case OP_CONST:
+            *value = opt->chunk->constants.values[bytes[1]];
+            return true;
+        case OP_CONST_W:
+            *value = opt->chunk->constants.values[(bytes[1] << 8) | bytes[2]];
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool numberAt(opt_t *opt, int i, double *x)
+{
+    val_t value;
+    if (!constantAt(opt, i, &value) || !IS_NUM(value)) return false;
+    *x = AS_NUM(value);
+    return true;
+}
+
+static bool constantRK(opt_t *opt, uint8_t rk, val_t *value)
+{
+    if (!(rk & RK_CONST)) return false;
+    *value = opt->chunk->constants.values[rk & ~RK_CONST];
+    return true;
+}
+
+static bool numberRK(opt_t *opt, uint8_t rk, double *x)
+{
+    val_t value;
+    if (!constantRK(opt, rk, &value) || !IS_NUM(value)) return false;
+    *x = AS_NUM(value);
+    return true;
+}
+
+// Turns instruction i into a push of value, false if the constant
+// table is full.
+static bool setConstant(opt_t *opt, int i, val_t value)
+{
+    ins_t *ins = &opt->code[i];
+
+    if (IS_BOOL(value)) {
+        ins->bytes[0] = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+        return true;
+    }
+
+    arr_t *constants = &opt->chunk->constants;
+    int count = constants->count;
+    int constant = arr_add(constants, value, false);
+    if (constant > UINT8_MAX) {
+        constants->count = count;
+        return false;
+    }
+
+    ins->bytes[0] = OP_CONST;
+    ins->bytes[1] = (uint8_t)constant;
+    ins->lines[1] = ins->lines[0];
+    return true;
+}
+
+// Same results as the vm, comparisons negated the way the compiler
+// emits them.
+static bool evaluate(uint8_t op, double x, double y, val_t *value)
+{
+    switch (op) {
+        case OP_ADD: case OP_RADD: *value = VAL_NUM(x + y); return true;
+        case OP_SUB: case OP_RSUB: *value = VAL_NUM(x - y); return true;
+        case OP_MUL: case OP_RMUL: *value = VAL_NUM(x * y); return true;
+        case OP_DIV: case OP_RDIV: *value = VAL_NUM(x / y); return true;
+        case OP_LT: *value = VAL_BOOL(x < y);     return true;
+        case OP_LE: *value = VAL_BOOL(x <= y);    return true;
+        case OP_GT: *value = VAL_BOOL(!(x <= y)); return true;
+        case OP_GE: *value = VAL_BOOL(!(x < y));  return true;
+        default:
+            return false;
+    }
+}
+
+static bool foldConstants(opt_t *opt)
+{
+    bool changed = false;
+
+    for (int i = 0; i < opt->count; i++) {
+        ins_t *ins = &opt->code[i];
+        uint8_t op = ins->bytes[0];
+        int a = prevOp(opt, i);
+        int b = prevOp(opt, a);
+        val_t value, other;
+        double x, y;
+
+        switch (op) {
+            case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+            case OP_LT: case OP_LE: case OP_GT: case OP_GE:
+                if (opt->targeted[i] || a < 0 || opt->targeted[a]) break;
+                if (!numberAt(opt, b, &x) || !numberAt(opt, a, &y)) break;
+                if (evaluate(op, x, y, &value) && setConstant(opt, b, value)) {
+                    opt->code[a].removed = ins->removed = changed = true;
+                }
+                break;
+            case OP_EQ: case OP_NE:
+                if (opt->targeted[i] || a < 0 || opt->targeted[a]) break;
+                if (!constantAt(opt, b, &value) || !constantAt(opt, a, &other)) break;
+                if (setConstant(opt, b, VAL_BOOL(val_equal(value, other) == (op == OP_EQ)))) {
+                    opt->code[a].removed = ins->removed = changed = true;
+                }
+                break;
+            case OP_RADD: case OP_RSUB: case OP_RMUL: case OP_RDIV:
+                if (ins->bytes[1] != R_PUSH) break;
+                if (!numberRK(opt, ins->bytes[2], &x) || !numberRK(opt, ins->bytes[3], &y)) break;
+                if (evaluate(op, x, y, &value) && setConstant(opt, i, value)) changed = true;
+                break;
+            case OP_NEG:
+                if (opt->targeted[i] || !numberAt(opt, a, &x)) break;
+                if (setConstant(opt, a, VAL_NUM(-x))) ins->removed = changed = true;
+                break;
+            case OP_NOT:
+                if (opt->targeted[i] || !constantAt(opt, a, &value)) break;
+                if (setConstant(opt, a, VAL_BOOL(IS_FALSEY(value)))) ins->removed = changed = true;
+                break;
+            case OP_POP:
+                // A push nobody looks at.
+                if (opt->targeted[i] || a < 0) break;
+                switch (opt->code[a].bytes[0]) {
+                    case OP_NIL: case OP_TRUE: case OP_FALSE: case OP_CONST: case OP_CONST_W: case OP_LD:
+                        opt->code[a].removed = ins->removed = changed = true;
+                }
+                break;
+            case OP_JMPF: case OP_JMPF_W:
+                // The value stays, only whether it jumps is known.
+                if (opt->targeted[i] || !constantAt(opt, a, &value)) break;
+                if (IS_FALSEY(value)) setJump(ins, OP_JMP);
+                else ins->removed = true;
+                changed = true;
+                break;
+            case OP_JMPFP: case OP_JMPFP_W:
+                if (opt->targeted[i] || !constantAt(opt, a, &value)) break;
+                if (IS_FALSEY(value)) setJump(ins, OP_JMP);
+                else ins->removed = true;
+                opt->code[a].removed = changed = true;
+                break;
+            case OP_RLT: case OP_RLE: case OP_RGT: case OP_RGE:
+                if (!numberRK(opt, ins->bytes[1], &x) || !numberRK(opt, ins->bytes[2], &y)) break;
+                evaluate(op == OP_RLT ? OP_LT : op == OP_RLE ? OP_LE : op == OP_RGT ? OP_GT : OP_GE, x, y, &value);
+                if (!AS_BOOL(value)) {
+                    ins->bytes[0] = OP_JMP;
+                    ins->lines[1] = ins->lines[3];
+                    ins->lines[2] = ins->lines[4];
+                }
+                else {
+                    ins->removed = true;
+                }
+                changed = true;
+                break;
+            case OP_REQ: case OP_RNE:
+                if (!constantRK(opt, ins->bytes[1], &value) || !constantRK(opt, ins->bytes[2], &other)) break;
+                if (val_equal(value, other) != (op == OP_REQ)) {
+                    ins->bytes[0] = OP_JMP;
+                    ins->lines[1] = ins->lines[3];
+                    ins->lines[2] = ins->lines[4];
+                }
+                else {
+                    ins->removed = true;
+                }
+                changed = true;
+                break;
+        }
+    }
+
+    return changed;
+}
+
+static bool fuseOps(opt_t *opt)
+{
+    bool changed = false;
+
+    for (int i = 0; i < opt->count; i++) {
+        ins_t *ins = &opt->code[i];
+        int a = prevOp(opt, i);
+
+        switch (ins->bytes[0]) {
+            case OP_NOT:
+                if (opt->targeted[i] || a < 0) break;
+                switch (opt->code[a].bytes[0]) {
+                    case OP_EQ: opt->code[a].bytes[0] = OP_NE; break;
+                    case OP_LE: opt->code[a].bytes[0] = OP_GT; break;
+                    case OP_LT: opt->code[a].bytes[0] = OP_GE; break;
+                    default: continue;
+                }
+                ins->removed = changed = true;
+                break;
+            case OP_JMPF:
+            case OP_JMPF_W: {
+                // if/else pops the condition on both ends, pop it while jumping.
+                int next = nextOp(opt, i);
+                int target = ins->target;
+                if (next >= opt->count || opt->code[next].bytes[0] != OP_POP || opt->targeted[next]) break;
+                if (opt->code[target].bytes[0] != OP_POP || target + 1 >= opt->count) break;
+
+                setJump(ins, OP_JMPFP);
+                ins->target = target + 1;
+                opt->code[next].removed = changed = true;
+                break;
+            }
+        }
+    }
+
+    return changed;
+}
+
+static bool threadJumps(opt_t *opt)
+{
+    bool changed = false;
+
+    for (int i = 0; i < opt->count; i++) {
+        ins_t *ins = &opt->code[i];
+        if (ins->target < 0 || jumpsBack(ins->bytes[0])) continue;
+        uint8_t op = plainJump(ins->bytes[0]);
+
+        // Only forward, the offsets are unsigned. Threading stretches a
+        // jump, past 16 bits only the wide ones reach that far.
+        bool stretches = jumpWidth(ins->bytes[0]) == 3 || opt->chunk->count <= UINT16_MAX;
+        for (int n = 0; stretches && n < THREAD_MAX; n++) {
+            ins_t *next = &opt->code[ins->target];
+            uint8_t to = plainJump(next->bytes[0]);
+            bool same = to == OP_JMP || (to == OP_JMPF && op == OP_JMPF);
+            if (!same || next->target <= i || next->target == ins->target) break;
+
+            ins->target = next->target;
+            changed = true;
+        }
+
+        bool keeps = op == OP_JMP || op == OP_JMPF;
+        if (keeps && ins->target == nextOp(opt, i)) {
+            ins->removed = changed = true;
+        }
+    }
+
+    return changed;
+}
+
+static bool removeUnreachable(opt_t *opt)
+{
+    bool *reached = calloc(opt->count, sizeof(bool));
+    int *pending = malloc(opt->count * sizeof(int));
+    int count = 0;
+
+    pending[count++] = 0;
+    reached[0] = true;
+
+    while (count > 0) {
+        int i = pending[--count];
+        ins_t *ins = &opt->code[i];
+        uint8_t op = plainJump(ins->bytes[0]);
+
+        if (ins->target >= 0 && !reached[ins->target]) {
+            reached[ins->target] = true;
+            pending[count++] = ins->target;
+        }
+        if (op != OP_JMP && op != OP_LOOP && op != OP_RET && i + 1 < opt->count && !reached[i + 1]) {
+            reached[i + 1] = true;
+            pending[count++] = i + 1;
+        }
+    }
+
+    bool changed = false;
+    for (int i = 0; i < opt->count; i++) {
+        if (!reached[i]) opt->code[i].removed = changed = true;
+    }
+
+    free(pending);
+    free(reached);
+    return changed;
+}
+
+void optimize_chunk(chunk_t *chunk, int level)
+{
+    if (level <= 0 || chunk->count == 0) return;
+
+    opt_t opt;
+    opt.chunk = chunk;
+    decode(&opt);
+    opt.targeted = malloc(opt.count * sizeof(int));
+
+    // Every pass may open up more work for the others.
+    bool changed;
+    do {
+        changed = runPass(&opt, foldConstants);
+        changed |= runPass(&opt, fuseOps);
+        changed |= runPass(&opt, threadJumps);
+        changed |= runPass(&opt, removeUnreachable);
+    } while (changed);
+
+    encode(&opt);
+
+    free(opt.targeted);
+    free(opt.code);
+}
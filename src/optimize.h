@@ -0,0 +1,9 @@
+#pragma once
+
+#include "common.h"
+#include "chunk.h"
+
+// Peephole pass over a finished chunk: folds constant expressions,
+// fuses compare-and-not and jump-and-pop pairs, threads jumps to jumps
+// and drops code nothing can reach. Level 0 leaves the code untouched.
+void optimize_chunk(chunk_t *chunk, int level);
@@ -0,0 +1,139 @@
+// For fileno under -std=c11.
+#define _DEFAULT_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define isatty _isatty
+#define fileno _fileno
+#else
+#include <unistd.h>
+#endif
+
+#include "output.h"
+
+void output_init(output_t *out, FILE *file)
+{
+    out->file = file;
+    out->lines = isatty(fileno(file));
+    out->count = 0;
+}
+
+static void writeFile(output_t *out, const char *chars, int length)
+{
+    fwrite(chars, 1, length, out->file);
+    fflush(out->file);
+}
+
+void output_flush(output_t *out)
+{
+    if (out->count == 0) return;
+    writeFile(out, out->bytes, out->count);
+    out->count = 0;
+}
+
+void output_write(output_t *out, const char *chars, int length)
+{
+    if (out->count + length > OUTPUT_SIZE) {
+        output_flush(out);
+        if (length > OUTPUT_SIZE) {
+            writeFile(out, chars, length);
+            return;
+        }
+    }
+    memcpy(out->bytes + out->count, chars, length);
+    out->count += length;
+}
+
+void output_line(output_t *out)
+{
+    output_char(out, '\n');
+    if (out->lines) output_flush(out);
+}
+
+static const double powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Decimal digits of n, written backwards from end.
+static char *writeDigits(char *end, uint64_t n)
+{
+    do {
+        *--end = '0' + n % 10;
+        n /= 10;
+    } while (n != 0);
+    return end;
+}
+
+// The 14 significant digits of %.14g without an exponent, which it uses
+// from 1e-4 up to 1e14. Scaling by an exact power of ten rounds once, off
+// by less than 1/64 below 1e14, so rounding the scaled number to an
+// integer gives the digits printf would, unless it is close to halfway.
+// Returns 0 where printf has to do it.
+static int formatFixed(char *buffer, double magnitude)
+{
+    int exponent;
+    if (magnitude >= 1) {
+        for (exponent = 13; powers[exponent] > magnitude; exponent--);
+    } else {
+        for (exponent = -1; magnitude * powers[-exponent] < 1; exponent--);
+    }
+
+    double scaled = magnitude * powers[13 - exponent];
+    double whole = floor(scaled), fraction = scaled - whole;
+    if (fabs(fraction - 0.5) < 0.05) return 0;
+
+    uint64_t n = (uint64_t)whole + (fraction > 0.5);
+    if (n < 10000000000000ull || n >= 100000000000000ull) return 0;
+
+    char digits[14];
+    writeDigits(digits + 14, n);
+    int last = 13;
+    while (last > exponent && digits[last] == '0') last--;
+
+    int length = 0;
+    if (exponent >= 0) {
+        memcpy(buffer, digits, exponent + 1);
+        length = exponent + 1;
+        if (last > exponent) {
+            buffer[length++] = '.';
+            memcpy(buffer + length, digits + exponent + 1, last - exponent);
+            length += last - exponent;
+        }
+    } else {
+        buffer[length++] = '0';
+        buffer[length++] = '.';
+        for (int i = -1; i > exponent; i--) buffer[length++] = '0';
+        memcpy(buffer + length, digits, last + 1);
+        length += last + 1;
+    }
+    return length;
+}
+
+void output_number(output_t *out, double number)
+{
+    char buffer[32];
+    int length = 0;
+    double magnitude = fabs(number);
+    if (signbit(number)) buffer[length++] = '-';
+
+    if (magnitude < 1e14 && magnitude == (double)(uint64_t)magnitude) {
+        char digits[20];
+        char *start = writeDigits(digits + 20, (uint64_t)magnitude);
+        memcpy(buffer + length, start, digits + 20 - start);
+        length += (int)(digits + 20 - start);
+    } else {
+        int fixed = magnitude >= 1e-4 && magnitude < 1e14 ? formatFixed(buffer + length, magnitude) : 0;
+        if (fixed == 0) {
+            length = snprintf(buffer, sizeof(buffer), "%.14g", number);
+        } else {
+            length += fixed;
+        }
+    }
+
+    output_write(out, buffer, length);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "common.h"
+
+#define OUTPUT_SIZE         8192    // bytes gathered before they get written
+
+// Text a vm prints, written to its file a buffer at a time. Each vm has
+// one of its own, so threads printing do not take turns on the lock of
+// stdout for every value. Flushed when full, when the vm closes, and at
+// the end of every line when the file is a terminal.
+typedef struct {
+    FILE *file;
+    bool lines;         // flush at the end of every line
+    int count;
+    char bytes[OUTPUT_SIZE];
+} output_t;
+
+void output_init(output_t *out, FILE *file);
+void output_flush(output_t *out);
+void output_write(output_t *out, const char *chars, int length);
+// Ends a line.
+void output_line(output_t *out);
+
+// Writes number as printf("%.14g") would, without going through it for
+// the usual magnitudes.
+void output_number(output_t *out, double number);
+
+static inline void output_char(output_t *out, char c) {
+    if (out->count == OUTPUT_SIZE) output_flush(out);
+    out->bytes[out->count++] = c;
+}
@@ -6,6 +6,9 @@
 #include "parser.h"
 #include "lexer.h"
 #include "object.h"
+#include "vm.h"
+#include "gc.h"
+#include "optimize.h"
 
 typedef struct _parser   parser_t;
 typedef struct _compiler compiler_t;
@@ -52,6 +55,8 @@ typedef struct {
     int depth;
 } local_t;
 
+#define OPS_HISTORY     4
+
 typedef enum {
     TYPE_FUNCTION,
     TYPE_SCRIPT
@@ -65,6 +70,10 @@ struct _compiler
     local_t locals[UINT8_COUNT];
     int localCount;
     int scopeDepth;
+    int lastOps[OPS_HISTORY];   // offsets of the latest instructions, newest first
+    int jumpTarget;             // code before this offset must not be rewritten
+    bool wide;                  // jumps take 24 bit offsets
+    bool outgrown;              // a jump did not fit 16 bits, compile it again wide
 };
 
 static chunk_t *currentChunk(parser_t *parser)
@@ -76,6 +85,7 @@ static void errorAt(parser_t *parser, tok_t *token, const char *message)
 {
     if (parser->panicMode) return;
     parser->panicMode = true;
+    output_flush(&parser->vm->out);
 
     int length = token->start - token->currentLine + token->length;
     const char *line = token->currentLine;
@@ -155,10 +165,22 @@ static void emitByte(parser_t *parser, uint8_t byte)
         parser->previous.line, parser->previous.column);
 }
 
-static void emitBytes(parser_t *parser, uint8_t byte1, uint8_t byte2)
+static void emitOp(parser_t *parser, uint8_t op)
 {
-    emitByte(parser, byte1);
-    emitByte(parser, byte2);
+    compiler_t *current = parser->compiler;
+
+    for (int i = OPS_HISTORY - 1; i > 0; i--) {
+        current->lastOps[i] = current->lastOps[i - 1];
+    }
+    current->lastOps[0] = currentChunk(parser)->count;
+
+    emitByte(parser, op);
+}
+
+static void emitBytes(parser_t *parser, uint8_t op, uint8_t arg)
+{
+    emitOp(parser, op);
+    emitByte(parser, arg);
 }
 
 static void emitNBytes(parser_t *parser, void *bytes, size_t size)
@@ -169,66 +191,298 @@ static void emitNBytes(parser_t *parser, void *bytes, size_t size)
     }
 }
 
+// Emits a forward jump to be patched, its wide form in wide functions.
 static int emitJump(parser_t *parser, uint8_t instruction)
 {
-    emitByte(parser, instruction);
-    emitBytes(parser, 0, 0);
-    return currentChunk(parser)->count - 2;
+    if (!parser->compiler->wide) {
+        emitOp(parser, instruction);
+        emitNBytes(parser, NULL, 2);
+        return currentChunk(parser)->count - 2;
+    }
+
+    switch (instruction) {
+        case OP_JMP:   emitOp(parser, OP_JMP_W);   break;
+        case OP_JMPF:  emitOp(parser, OP_JMPF_W);  break;
+        case OP_JMPFP: emitOp(parser, OP_JMPFP_W); break;
+    }
+    emitNBytes(parser, NULL, 3);
+    return currentChunk(parser)->count - 3;
 }
 
 static void emitReturn(parser_t *parser)
 {
-    emitByte(parser, OP_NIL);
-    emitByte(parser, OP_RET);
+    emitOp(parser, OP_NIL);
+    emitOp(parser, OP_RET);
 }
 
-static uint8_t makeConstant(parser_t *parser, val_t value)
+static int makeConstant(parser_t *parser, val_t value)
 {
     int constant = arr_add(&currentChunk(parser)->constants, value, false);
-    if (constant > UINT8_MAX) {
+    GC_BARRIER(parser->vm->gc, parser->compiler->function);
+    if (constant > UINT16_MAX) {
         error(parser, "Too many constants in one chunk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return constant;
 }
 
+// Emits op with a byte operand, CONST takes its wide form past 255.
 static void emitSmart(parser_t *parser, uint8_t op, int arg)
 {
+    if (op == OP_CONST && arg > UINT8_MAX) {
+        emitBytes(parser, OP_CONST_W, (arg >> 8) & 0xff);
+        emitByte(parser, arg & 0xff);
+        return;
+    }
     emitBytes(parser, op, (uint8_t)arg);
 }
 
 static void emitConstant(parser_t *parser, val_t value)
 {
-    uint8_t constant = makeConstant(parser, value);
+    int constant = makeConstant(parser, value);
     emitSmart(parser, OP_CONST, constant);
 }
 
+// Checks that a jump fits its operand. One that outgrows a 16 bit
+// operand gets the function compiled again with wide jumps, past 24
+// bits it is an error.
+static bool jumpFits(parser_t *parser, int jump, const char *message)
+{
+    if (!parser->compiler->wide) {
+        if (jump <= UINT16_MAX) return true;
+        parser->compiler->outgrown = true;
+        return false;
+    }
+
+    if (jump > 0xffffff) {
+        error(parser, message);
+        return false;
+    }
+    return true;
+}
+
 static void patchJump(parser_t *parser, int offset)
 {
-    // -2 to adjust for the bytecode for the jump offset itself.
-    int jump = currentChunk(parser)->count - offset - 2;
+    int width = parser->compiler->wide ? 3 : 2;
+    // Adjust for the bytecode for the jump offset itself.
+    int jump = currentChunk(parser)->count - offset - width;
+
+    if (jumpFits(parser, jump, "Too much code to jump over.")) {
+        for (int i = width - 1; i >= 0; i--, jump >>= 8) {
+            currentChunk(parser)->code[offset + i] = jump & 0xff;
+        }
+    }
+
+    // Something jumps here now, never fuse across it.
+    parser->compiler->jumpTarget = currentChunk(parser)->count;
+}
+
+// Emits the operand of a jump back to start, the last one of its instruction.
+static void emitLoopOffset(parser_t *parser, int start)
+{
+    int width = parser->compiler->wide ? 3 : 2;
+    int offset = currentChunk(parser)->count - start + width;
+
+    if (!jumpFits(parser, offset, "Loop body too large.")) offset = 0;
+
+    for (int i = width - 1; i >= 0; i--) {
+        emitByte(parser, (offset >> (8 * i)) & 0xff);
+    }
+}
+
+static void emitLoop(parser_t *parser, int start)
+{
+    emitOp(parser, parser->compiler->wide ? OP_LOOP_W : OP_LOOP);
+    emitLoopOffset(parser, start);
+}
+
+static int lastOp(parser_t *parser, int i)
+{
+    int offset = parser->compiler->lastOps[i];
+    return offset >= parser->compiler->jumpTarget ? offset : -1;
+}
+
+static uint8_t opAt(parser_t *parser, int offset)
+{
+    return offset < 0 ? OPCODE_COUNT : currentChunk(parser)->code[offset];
+}
+
+// Turns a plain load at offset into a register/constant operand.
+static bool loadOperand(parser_t *parser, int offset, uint8_t *rk)
+{
+    if (offset < 0) return false;
+    uint8_t *code = &currentChunk(parser)->code[offset];
+
+    switch (code[0]) {
+        case OP_LD:
+            if (code[1] >= RK_CONST) return false;
+            *rk = code[1];
+            return true;
+        case OP_CONST:
+            if (code[1] >= RK_CONST) return false;
+            *rk = RK_CONST | code[1];
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Drops the instructions from offset on, they are about to be replaced.
+static void rewindTo(parser_t *parser, int offset)
+{
+    compiler_t *current = parser->compiler;
+
+    int n = 0;
+    while (n < OPS_HISTORY && current->lastOps[n] >= offset) n++;
+
+    for (int i = 0; i < OPS_HISTORY; i++) {
+        current->lastOps[i] = (i + n < OPS_HISTORY) ? current->lastOps[i + n] : -1;
+    }
+
+    currentChunk(parser)->count = offset;
+}
+
+static bool emitRegisterArith(parser_t *parser, uint8_t op)
+{
+    uint8_t b, c;
+    int left = lastOp(parser, 1);
+    int right = lastOp(parser, 0);
+
+    if (!loadOperand(parser, left, &b) || !loadOperand(parser, right, &c)) {
+        return false;
+    }
+
+    rewindTo(parser, left);
+    emitBytes(parser, op, R_PUSH);
+    emitByte(parser, b);
+    emitByte(parser, c);
+    return true;
+}
+
+static bool emitRegisterIndex(parser_t *parser)
+{
+    uint8_t c;
+    int map = lastOp(parser, 1);
+    int key = lastOp(parser, 0);
+
+    if (opAt(parser, map) != OP_LD || !loadOperand(parser, key, &c)) {
+        return false;
+    }
+
+    uint8_t b = currentChunk(parser)->code[map + 1];
+    rewindTo(parser, map);
+    emitBytes(parser, OP_RGETI, R_PUSH);
+    emitByte(parser, b);
+    emitByte(parser, c);
+    return true;
+}
 
-    if (jump > UINT16_MAX) {
-        error(parser, "Too much code to jump over.");
+// Emits the jump taken when a condition is false, the condition is
+// gone from the stack on both paths. Comparisons of registers/constants
+// become a single fused compare-and-jump, anything else is popped by
+// the jump.
+static int emitConditionJump(parser_t *parser)
+{
+    uint8_t b, c;
+    uint8_t op = opAt(parser, lastOp(parser, 0));
+    int start = -1;
+    uint8_t fusedOp = OP_JMPFP;
+
+    if (op == OP_LT || op == OP_LE || op == OP_EQ) {
+        start = lastOp(parser, 2);
+        if (loadOperand(parser, start, &b) && loadOperand(parser, lastOp(parser, 1), &c)) {
+            fusedOp = (op == OP_LT) ? OP_RLT : (op == OP_LE) ? OP_RLE : OP_REQ;
+        }
     }
+    else if (op == OP_NOT) {
+        // a > b is emitted as a <= b, not. Swapping the operands of the
+        // jump instead would answer differently for NaN.
+        op = opAt(parser, lastOp(parser, 1));
+        start = lastOp(parser, 3);
+        if ((op == OP_LT || op == OP_LE || op == OP_EQ) &&
+            loadOperand(parser, start, &b) && loadOperand(parser, lastOp(parser, 2), &c)) {
+            fusedOp = (op == OP_LT) ? OP_RGE : (op == OP_LE) ? OP_RGT : OP_RNE;
+        }
+    }
+
+    // The fused jumps only take 16 bit offsets.
+    if (fusedOp == OP_JMPFP || parser->compiler->wide) return emitJump(parser, OP_JMPFP);
 
-    currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
-    currentChunk(parser)->code[offset + 1] = jump & 0xff;
+    rewindTo(parser, start);
+    emitBytes(parser, fusedOp, b);
+    emitByte(parser, c);
+    emitByte(parser, 0);
+    emitByte(parser, 0);
+    return currentChunk(parser)->count - 2;
 }
 
-static void initCompiler(parser_t *parser, compiler_t *compiler, funtype_t type)
+// Folds 'local = x op y; pop' into one three-address instruction.
+static bool emitRegisterStore(parser_t *parser)
+{
+    int store = lastOp(parser, 0);
+    int op = lastOp(parser, 1);
+    if (opAt(parser, store) != OP_ST || op < 0) return false;
+
+    uint8_t *code = currentChunk(parser)->code;
+    uint8_t dest = code[store + 1];
+    if (dest == R_PUSH || code[op + 1] != R_PUSH) return false;
+
+    switch (code[op]) {
+        case OP_RADD:
+        case OP_RSUB:
+        case OP_RMUL:
+        case OP_RDIV:
+        case OP_RGETI:
+            code[op + 1] = dest;
+            rewindTo(parser, store);
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Drops the value of an expression statement. A store that ends it
+// turns into its popping form instead of being followed by a POP.
+static void emitDiscard(parser_t *parser)
+{
+    if (emitRegisterStore(parser)) return;
+
+    int store = lastOp(parser, 0);
+    switch (opAt(parser, store)) {
+        case OP_ST:
+            currentChunk(parser)->code[store] = OP_STP;
+            break;
+        case OP_GSTS:
+            currentChunk(parser)->code[store] = OP_GSTSP;
+            break;
+        default:
+            emitOp(parser, OP_POP);
+            break;
+    }
+}
+
+static void initCompiler(parser_t *parser, compiler_t *compiler, funtype_t type, bool wide)
 {
     compiler->enclosing = parser->compiler;
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->jumpTarget = 0;
+    compiler->wide = wide;
+    compiler->outgrown = false;
+    for (int i = 0; i < OPS_HISTORY; i++) compiler->lastOps[i] = -1;
     compiler->function = fun_new(parser->vm, parser->source);
+    compiler->function->chunk.arena = &parser->vm->arena;
+
+    // Keep the function reachable while it is being compiled.
+    vm_push(parser->vm, VAL_OBJ(compiler->function));
 
     if (type != TYPE_SCRIPT) {
         compiler->function->name = str_copy(parser->vm, parser->previous.start,
             parser->previous.length);
+        GC_BARRIER(parser->vm->gc, compiler->function);
     }
 
     local_t *local = &compiler->locals[compiler->localCount++];
@@ -239,10 +493,17 @@ static void initCompiler(parser_t *parser, compiler_t *compiler, funtype_t type)
     parser->compiler = compiler;
 }
 
+// NULL when the function outgrew its jumps, it has to be compiled again.
 static fun_t *endCompiler(parser_t *parser)
 {
     emitReturn(parser);
     fun_t *function = parser->compiler->function;
+    if (parser->compiler->outgrown && !parser->hadError) function = NULL;
+
+    if (function != NULL && !parser->hadError) {
+        optimize_chunk(currentChunk(parser), parser->vm->optimize);
+    }
+    chunk_seal(currentChunk(parser));
 
 #ifdef DEBUG_PRINT_CODE                      
     if (!parser->hadError) {
@@ -250,6 +511,7 @@ static fun_t *endCompiler(parser_t *parser)
     }
 #endif
 
+    vm_pop(parser->vm);
     parser->compiler = parser->compiler->enclosing;
     return function;
 }
@@ -268,7 +530,7 @@ static void endScope(parser_t *parser)
     while (current->localCount > 0 &&
         current->locals[current->localCount - 1].depth >
         current->scopeDepth) {
-        emitByte(parser, OP_POP);
+        emitOp(parser, OP_POP);
         current->localCount--;
     }
 }
@@ -279,12 +541,32 @@ static void declaration(parser_t *parser);
 static rule_t *getRule(toktype_t type);
 static void parsePrecedence(parser_t *parser, prec_t precedence);
 
-static uint8_t identifierConstant(parser_t *parser, tok_t *name)
+static int identifierConstant(parser_t *parser, tok_t *name)
 {
     str_t *id = str_copy(parser->vm, name->start, name->length);
     return makeConstant(parser, VAL_OBJ(id));
 }
 
+static int globalSlot(parser_t *parser, tok_t *name)
+{
+    str_t *id = str_copy(parser->vm, name->start, name->length);
+    int slot = global_slot(parser->vm, id);
+
+    if (slot > UINT16_MAX) {
+        error(parser, "Too many global variables.");
+        return 0;
+    }
+
+    return slot;
+}
+
+static void emitGlobal(parser_t *parser, uint8_t op, int slot)
+{
+    emitOp(parser, op);
+    emitByte(parser, (slot >> 8) & 0xff);
+    emitByte(parser, slot & 0xff);
+}
+
 static bool identifiersEqual(tok_t *a, tok_t *b)
 {
     if (a->length != b->length) return false;
@@ -342,14 +624,14 @@ static void declareVariable(parser_t *parser)
     addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(parser_t *parser, const char *errorMessage)
+static int parseVariable(parser_t *parser, const char *errorMessage)
 {
     consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
     declareVariable(parser);
     if (parser->compiler->scopeDepth > 0) return 0;
 
-    return identifierConstant(parser, &parser->previous);
+    return globalSlot(parser, &parser->previous);
 }
 
 static void markInitialized(parser_t *parser)
@@ -361,14 +643,14 @@ static void markInitialized(parser_t *parser)
         current->scopeDepth;
 }
 
-static void defineVariable(parser_t *parser, uint8_t global)
+static void defineVariable(parser_t *parser, int global)
 {
     if (parser->compiler->scopeDepth > 0) {
         markInitialized(parser);
         return;
     }
 
-    emitSmart(parser, OP_DEF, global);
+    emitGlobal(parser, OP_DEFS, global);
 }
 
 static uint8_t argumentList(parser_t *parser)
@@ -392,7 +674,7 @@ static void and_(parser_t *parser, bool canAssign)
 {
     int endJump = emitJump(parser, OP_JMPF);
 
-    emitByte(parser, OP_POP);
+    emitOp(parser, OP_POP);
     parsePrecedence(parser, PREC_AND);
 
     patchJump(parser, endJump);
@@ -409,18 +691,26 @@ static void binary(parser_t *parser, bool canAssign)
 
     // Emit the operator instruction.                        
     switch (operatorType) {
-        case TOKEN_EQUAL_EQUAL:   emitByte(parser, OP_EQ); break;
-        case TOKEN_LESS:          emitByte(parser, OP_LT); break;
-        case TOKEN_LESS_EQUAL:    emitByte(parser, OP_LE); break;
-
-        case TOKEN_BANG_EQUAL:    emitBytes(parser, OP_EQ, OP_NOT); break;
-        case TOKEN_GREATER:       emitBytes(parser, OP_LE, OP_NOT); break;
-        case TOKEN_GREATER_EQUAL: emitBytes(parser, OP_LT, OP_NOT); break;
-
-        case TOKEN_PLUS:          emitByte(parser, OP_ADD); break;
-        case TOKEN_MINUS:         emitByte(parser, OP_SUB); break;
-        case TOKEN_STAR:          emitByte(parser, OP_MUL); break;
-        case TOKEN_SLASH:         emitByte(parser, OP_DIV); break;
+        case TOKEN_EQUAL_EQUAL:   emitOp(parser, OP_EQ); break;
+        case TOKEN_LESS:          emitOp(parser, OP_LT); break;
+        case TOKEN_LESS_EQUAL:    emitOp(parser, OP_LE); break;
+
+        case TOKEN_BANG_EQUAL:    emitOp(parser, OP_EQ); emitOp(parser, OP_NOT); break;
+        case TOKEN_GREATER:       emitOp(parser, OP_LE); emitOp(parser, OP_NOT); break;
+        case TOKEN_GREATER_EQUAL: emitOp(parser, OP_LT); emitOp(parser, OP_NOT); break;
+
+        case TOKEN_PLUS:
+            if (!emitRegisterArith(parser, OP_RADD)) emitOp(parser, OP_ADD);
+            break;
+        case TOKEN_MINUS:
+            if (!emitRegisterArith(parser, OP_RSUB)) emitOp(parser, OP_SUB);
+            break;
+        case TOKEN_STAR:
+            if (!emitRegisterArith(parser, OP_RMUL)) emitOp(parser, OP_MUL);
+            break;
+        case TOKEN_SLASH:
+            if (!emitRegisterArith(parser, OP_RDIV)) emitOp(parser, OP_DIV);
+            break;
         default:
             return; // Unreachable.                              
     }
@@ -435,7 +725,20 @@ static void call(parser_t *parser, bool canAssign)
 static void dot(parser_t *parser, bool canAssign)
 {
     consume(parser, TOKEN_IDENTIFIER, "Expect member name.");
-    uint8_t name = identifierConstant(parser, &parser->previous);
+    int name = identifierConstant(parser, &parser->previous);
+
+    // GET and SET take a byte, past that the name is indexed with.
+    if (name > UINT8_MAX) {
+        emitSmart(parser, OP_CONST, name);
+        if (canAssign && match(parser, TOKEN_EQUAL)) {
+            expression(parser);
+            emitOp(parser, OP_SETI);
+        }
+        else {
+            emitOp(parser, OP_GETI);
+        }
+        return;
+    }
 
     if (canAssign && match(parser, TOKEN_EQUAL)) {
         expression(parser);
@@ -444,6 +747,13 @@ static void dot(parser_t *parser, bool canAssign)
     else {
         emitBytes(parser, OP_GET, (uint8_t)name);
     }
+
+    int cache = chunk_cache(currentChunk(parser));
+    if (cache > UINT16_MAX) {
+        error(parser, "Too many field accesses in one chunk.");
+    }
+    emitByte(parser, (cache >> 8) & 0xff);
+    emitByte(parser, cache & 0xff);
 }
 
 static void index_(parser_t *parser, bool canAssign)
@@ -453,21 +763,21 @@ static void index_(parser_t *parser, bool canAssign)
 
     if (canAssign && match(parser, TOKEN_EQUAL)) {
         expression(parser);
-        emitByte(parser, OP_SETI);
+        emitOp(parser, OP_SETI);
 
         parser->hadAssign = true;
     }
-    else {
-        emitByte(parser, OP_GETI);
+    else if (!emitRegisterIndex(parser)) {
+        emitOp(parser, OP_GETI);
     }
 }
 
 static void literal(parser_t *parser, bool canAssign)
 {
     switch (parser->previous.type) {
-        case TOKEN_FALSE:   emitByte(parser, OP_FALSE); break;
-        case TOKEN_NIL:     emitByte(parser, OP_NIL); break;
-        case TOKEN_TRUE:    emitByte(parser, OP_TRUE); break;
+        case TOKEN_FALSE:   emitOp(parser, OP_FALSE); break;
+        case TOKEN_NIL:     emitOp(parser, OP_NIL); break;
+        case TOKEN_TRUE:    emitOp(parser, OP_TRUE); break;
         case TOKEN_FUN:     emitBytes(parser, OP_LD, 0); break;
         default:
             return; // Unreachable.                   
@@ -511,27 +821,23 @@ static void map(parser_t *parser, bool canAssign)
 
 static void namedVariable(parser_t *parser, tok_t name, bool canAssign)
 {
-    uint8_t getOp, setOp;
     int arg = resolveLocal(parser, parser->compiler, &name);
+    bool isLocal = (arg != -1);
 
-    if (arg != -1) {
-        getOp = OP_LD;
-        setOp = OP_ST;
-    }
-    else {
-        arg = identifierConstant(parser, &name);
-        getOp = OP_GLD;
-        setOp = OP_GST;
+    if (!isLocal) {
+        arg = globalSlot(parser, &name);
     }
 
     if (canAssign && match(parser, TOKEN_EQUAL)) {
         expression(parser);
-        emitSmart(parser, setOp, arg);
+        if (isLocal) emitSmart(parser, OP_ST, arg);
+        else emitGlobal(parser, OP_GSTS, arg);
 
         parser->hadAssign = true;
     }
     else {
-        emitSmart(parser, getOp, arg);
+        if (isLocal) emitSmart(parser, OP_LD, arg);
+        else emitGlobal(parser, OP_GLDS, arg);
     }
 }
 
@@ -546,7 +852,7 @@ static void or_(parser_t *parser, bool canAssign)
     int endJump = emitJump(parser, OP_JMP);
 
     patchJump(parser, elseJump);
-    emitByte(parser, OP_POP);
+    emitOp(parser, OP_POP);
 
     parsePrecedence(parser, PREC_OR);
     patchJump(parser, endJump);
@@ -561,8 +867,8 @@ static void unary(parser_t *parser, bool canAssign)
 
     // Emit the operator instruction.              
     switch (operatorType) {
-        case TOKEN_BANG:    emitByte(parser, OP_NOT); break;
-        case TOKEN_MINUS:   emitByte(parser, OP_NEG); break;
+        case TOKEN_BANG:    emitOp(parser, OP_NOT); break;
+        case TOKEN_MINUS:   emitOp(parser, OP_NEG); break;
         default:
             return; // Unreachable.                    
     }
@@ -664,10 +970,10 @@ static void block(parser_t *parser)
     consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(parser_t *parser, funtype_t type)
+static fun_t *functionBody(parser_t *parser, funtype_t type, bool wide)
 {
     compiler_t compiler;
-    initCompiler(parser, &compiler, type);
+    initCompiler(parser, &compiler, type, wide);
     beginScope(parser);
 
     // Compile the parameter list.                                
@@ -678,7 +984,7 @@ static void function(parser_t *parser, funtype_t type)
             if (arity > 32) {
                 errorAtCurrent(parser, "Cannot have more than 32 parameters.");
             }
-            uint8_t paramConstant = parseVariable(parser, "Expect parameter name.");
+            int paramConstant = parseVariable(parser, "Expect parameter name.");
             defineVariable(parser, paramConstant);
         } while (match(parser, TOKEN_COMMA));
     }
@@ -689,15 +995,36 @@ static void function(parser_t *parser, funtype_t type)
     block(parser);
 
     // Create the function object.                                
-    fun_t *function = endCompiler(parser);
-    uint8_t constant = makeConstant(parser, VAL_OBJ(function));
+    return endCompiler(parser);
+}
+
+// Compiles a body with 16 bit jumps, and once more from the same token
+// with wide ones when they do not reach.
+static fun_t *compileBody(parser_t *parser, funtype_t type, fun_t *(* body)(parser_t *, funtype_t, bool))
+{
+    parser_t start = *parser;
+    lexer_t lexer = *parser->lexer;
+
+    fun_t *function = body(parser, type, false);
+    if (function == NULL) {
+        *parser = start;
+        *parser->lexer = lexer;
+        function = body(parser, type, true);
+    }
+    return function;
+}
+
+static void function(parser_t *parser, funtype_t type)
+{
+    fun_t *function = compileBody(parser, type, functionBody);
+    int constant = makeConstant(parser, VAL_OBJ(function));
 
     emitSmart(parser, OP_CONST, constant);
 }
 
 static void funDeclaration(parser_t *parser)
 {
-    uint8_t global = parseVariable(parser, "Expect function name.");
+    int global = parseVariable(parser, "Expect function name.");
     markInitialized(parser);
     function(parser, TYPE_FUNCTION);
     defineVariable(parser, global);
@@ -705,13 +1032,13 @@ static void funDeclaration(parser_t *parser)
 
 static void varDeclaration(parser_t *parser)
 {
-    uint8_t global = parseVariable(parser, "Expect variable name.");
+    int global = parseVariable(parser, "Expect variable name.");
 
     if (match(parser, TOKEN_EQUAL)) {
         expression(parser);
     }
     else {
-        emitByte(parser, OP_NIL);
+        emitOp(parser, OP_NIL);
     }
 
     defineVariable(parser, global);
@@ -724,7 +1051,7 @@ static void expressionStatement(parser_t *parser)
     parser->subExprs = 0;
 
     expression(parser);
-    emitByte(parser, OP_POP);
+    emitDiscard(parser);
 
     if ((parser->subExprs <= 1) && !parser->hadCall && !parser->hadAssign) {
         error(parser, "Unexpected expression syntax.");
@@ -740,19 +1067,180 @@ static void ifStatement(parser_t *parser)
     expression(parser);
     consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-    int thenJump = emitJump(parser, OP_JMPF);
-    emitByte(parser, OP_POP);
+    int thenJump = emitConditionJump(parser);
     statement(parser);
 
     int elseJump = emitJump(parser, OP_JMP);
 
     patchJump(parser, thenJump);
-    emitByte(parser, OP_POP);
 
     if (match(parser, TOKEN_ELSE)) statement(parser);
     patchJump(parser, elseJump);
 }
 
+static void whileStatement(parser_t *parser)
+{
+    int loopStart = currentChunk(parser)->count;
+    parser->compiler->jumpTarget = loopStart;
+
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    int exitJump = emitConditionJump(parser);
+    statement(parser);
+    emitLoop(parser, loopStart);
+
+    patchJump(parser, exitJump);
+}
+
+// Matches the condition 'i < limit' of a numeric for loop starting at
+// offset start: the counter a local, the limit a local or constant and
+// any of < <= > >=. Returns the slot of the counter, -1 if no match.
+static int loopCondition(parser_t *parser, int start, uint8_t *limit, uint8_t *mode)
+{
+    uint8_t counter;
+    int left = lastOp(parser, 2);
+    int right = lastOp(parser, 1);
+    *mode = opAt(parser, lastOp(parser, 0));
+
+    if (*mode == OP_NOT) {
+        // a > b is emitted as a <= b, not.
+        left = lastOp(parser, 3);
+        right = lastOp(parser, 2);
+        switch (opAt(parser, lastOp(parser, 1))) {
+            case OP_LT: *mode = OP_GE; break;
+            case OP_LE: *mode = OP_GT; break;
+            default:    return -1;
+        }
+    }
+    else if (*mode != OP_LT && *mode != OP_LE) {
+        return -1;
+    }
+
+    if (left != start || opAt(parser, left) != OP_LD) return -1;
+    if (!loadOperand(parser, left, &counter) || !loadOperand(parser, right, limit)) return -1;
+    return counter;
+}
+
+// Matches the increment 'i = i + step' of a numeric for loop starting
+// at offset start, or 'i = i - step' with a constant step.
+static bool loopStep(parser_t *parser, int start, uint8_t counter, uint8_t *step)
+{
+    chunk_t *chunk = currentChunk(parser);
+    uint8_t *code = &chunk->code[start];
+
+    if (chunk->count - start != 4 || code[1] != counter || code[2] != counter) return false;
+
+    if (code[0] == OP_RADD) {
+        *step = code[3];
+        return true;
+    }
+    if (code[0] != OP_RSUB || !(code[3] & RK_CONST) || chunk->constants.count >= RK_CONST) {
+        return false;
+    }
+
+    val_t value = chunk->constants.values[code[3] & ~RK_CONST];
+    if (!IS_NUM(value)) return false;
+
+    *step = RK_CONST | makeConstant(parser, VAL_NUM(-AS_NUM(value)));
+    return true;
+}
+
+// A loop counting a local with a constant step against a local or
+// constant limit runs on FORPREP/FORLOOP. Everything else checks the
+// condition on top and jumps back after the increment.
+static void forStatement(parser_t *parser)
+{
+    chunk_t *chunk = currentChunk(parser);
+    compiler_t *current = parser->compiler;
+
+    beginScope(parser);
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match(parser, TOKEN_VAR)) {
+        varDeclaration(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop initializer.");
+    }
+    else if (!match(parser, TOKEN_SEMICOLON)) {
+        expression(parser);
+        emitDiscard(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop initializer.");
+    }
+
+    int loopStart = chunk->count;
+    current->jumpTarget = loopStart;
+
+    int counter = -1;
+    uint8_t limit = 0, mode = 0, step = 0;
+    bool hasCondition = !check(parser, TOKEN_SEMICOLON);
+    if (hasCondition) {
+        expression(parser);
+        counter = loopCondition(parser, loopStart, &limit, &mode);
+    }
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+
+    // The increment runs after the body, its code is put aside meanwhile.
+    int lastOps[OPS_HISTORY];
+    memcpy(lastOps, current->lastOps, sizeof(lastOps));
+    int incStart = chunk->count;
+
+    if (!check(parser, TOKEN_RIGHT_PAREN)) {
+        expression(parser);
+        emitDiscard(parser);
+    }
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+    // FORPREP/FORLOOP only take 16 bit offsets.
+    bool numeric = !current->wide && counter >= 0 && loopStep(parser, incStart, counter, &step);
+
+    chunk_t increment;
+    chunk_init(&increment, NULL);
+    for (int i = incStart; i < chunk->count; i++) {
+        chunk_emit(&increment, chunk->code[i], CHUNK_GETLN(chunk, i), CHUNK_GETCOL(chunk, i));
+    }
+    chunk->count = incStart;
+    memcpy(current->lastOps, lastOps, sizeof(lastOps));
+
+    if (numeric) {
+        rewindTo(parser, loopStart);
+        emitBytes(parser, OP_FORPREP, counter);
+        emitByte(parser, limit);
+        emitByte(parser, mode);
+        int exitJump = chunk->count;
+        emitNBytes(parser, NULL, 2);
+
+        int bodyStart = chunk->count;
+        current->jumpTarget = bodyStart;
+        statement(parser);
+
+        emitBytes(parser, OP_FORLOOP, counter);
+        emitByte(parser, limit);
+        emitByte(parser, step);
+        emitByte(parser, mode);
+        emitLoopOffset(parser, bodyStart);
+        patchJump(parser, exitJump);
+    }
+    else {
+        int exitJump = -1;
+        if (hasCondition) exitJump = emitConditionJump(parser);
+
+        statement(parser);
+
+        // Copied back in, nothing may fuse with it.
+        current->jumpTarget = chunk->count;
+        for (int i = 0; i < increment.count; i++) {
+            chunk_emit(chunk, increment.code[i],
+                CHUNK_GETLN(&increment, i), CHUNK_GETCOL(&increment, i));
+        }
+        emitLoop(parser, loopStart);
+
+        if (exitJump >= 0) patchJump(parser, exitJump);
+    }
+
+    chunk_free(&increment);
+    endScope(parser);
+}
+
 static void printStatement(parser_t *parser)
 {
     int count = 0;
@@ -781,7 +1269,13 @@ static void returnStatement(parser_t *parser)
     }
     else {
         expression(parser);
-        emitByte(parser, OP_RET);
+
+        // Nothing is left to do in this frame after a call here.
+        int call = lastOp(parser, 0);
+        if (opAt(parser, call) == OP_CALL) {
+            currentChunk(parser)->code[call] = OP_TAILCALL;
+        }
+        emitOp(parser, OP_RET);
     }
 }
 
@@ -835,6 +1329,12 @@ static void statement(parser_t *parser)
     else if (match(parser, TOKEN_RETURN)) {
         returnStatement(parser);
     }
+    else if (match(parser, TOKEN_WHILE)) {
+        whileStatement(parser);
+    }
+    else if (match(parser, TOKEN_FOR)) {
+        forStatement(parser);
+    }
     else if (match(parser, TOKEN_LEFT_BRACE)) {
         beginScope(parser);
         block(parser);
@@ -848,11 +1348,23 @@ static void statement(parser_t *parser)
     }
 }
 
+static fun_t *scriptBody(parser_t *parser, funtype_t type, bool wide)
+{
+    compiler_t compiler;
+    initCompiler(parser, &compiler, type, wide);
+
+    advance(parser);
+    while (!match(parser, TOKEN_EOF)) {
+        declaration(parser);
+    }
+
+    return endCompiler(parser);
+}
+
 fun_t *compile(vm_t *vm, src_t *source)
 {
     lexer_t lexer;
     parser_t parser;
-    compiler_t compiler;
 
     parser.vm = vm;
     parser.source = source;
@@ -862,13 +1374,6 @@ fun_t *compile(vm_t *vm, src_t *source)
     parser.panicMode = false;
 
     lexer_init(&lexer, source);
-    initCompiler(&parser, &compiler, TYPE_SCRIPT);
-    
-    advance(&parser);
-    while (!match(&parser, TOKEN_EOF)) {
-        declaration(&parser);
-    }
-
-    fun_t *function = endCompiler(&parser);
+    fun_t *function = compileBody(&parser, TYPE_SCRIPT, scriptBody);
     return parser.hadError ? NULL : function;
 }
@@ -0,0 +1,406 @@
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <pthread.h>
+#endif
+
+#include "pool.h"
+#include "sync.h"
+#include "object.h"
+#include "vm.h"
+#include "gc.h"
+
+// Globals of the spawning vm, workers reload theirs when a task was
+// spawned against another copy.
+struct _globals {
+    dump_t dump;
+    int id;
+    int refs;
+};
+
+typedef struct {
+    mutex_t lock;
+    int head;           // oldest task, taken by thieves
+    int tail;           // newest task, taken by the owner
+    int capacity;
+    task_t **tasks;
+    vm_t *vm;
+    int globals;        // id of the globals loaded into vm
+} worker_t;
+
+static struct {
+    mutex_t lock;       // guards everything below and task->done
+    cond_t wake;        // a task was pushed
+    cond_t finished;    // a task is done
+    int pending;        // tasks pushed but not taken yet
+    int next;           // round robin for tasks spawned outside the pool
+    int workerCount;
+    worker_t *workers;
+
+    globals_t *globals; // latest copy of the globals
+    vm_t *owner;        // vm they were taken from
+    unsigned stores;    // and its stores by then
+    int ids;
+
+    // Awaited tasks are kept for new ones instead of freed, handles the
+    // script still holds keep pointing at a task.
+    task_t *spare;
+} pool;
+
+static mutex_t poolInit = MUTEX_INITIALIZER;
+
+static void pushTask(worker_t *worker, task_t *task)
+{
+    LOCK(&worker->lock);
+    if (worker->tail >= worker->capacity) {
+        int count = worker->tail - worker->head;
+        if (worker->head > 0) {
+            for (int i = 0; i < count; i++) {
+                worker->tasks[i] = worker->tasks[worker->head + i];
+            }
+        }
+        else {
+            worker->capacity = GROW_CAPACITY(worker->capacity);
+            worker->tasks = realloc(worker->tasks, worker->capacity * sizeof(task_t *));
+        }
+        worker->head = 0;
+        worker->tail = count;
+    }
+    worker->tasks[worker->tail++] = task;
+    UNLOCK(&worker->lock);
+
+    LOCK(&pool.lock);
+    pool.pending++;
+    SIGNAL(&pool.wake);
+    UNLOCK(&pool.lock);
+}
+
+static task_t *popTask(worker_t *worker, bool steal)
+{
+    task_t *task = NULL;
+
+    LOCK(&worker->lock);
+    if (worker->head < worker->tail) {
+        task = steal ? worker->tasks[worker->head++] : worker->tasks[--worker->tail];
+    }
+    if (worker->head == worker->tail) {
+        worker->head = worker->tail = 0;
+    }
+    UNLOCK(&worker->lock);
+
+    return task;
+}
+
+// Newest task of its own first, then the oldest one of another worker.
+static task_t *takeTask(worker_t *self)
+{
+    int index = (int)(self - pool.workers);
+    task_t *task = popTask(self, false);
+
+    for (int i = 1; task == NULL && i < pool.workerCount; i++) {
+        task = popTask(&pool.workers[(index + i) % pool.workerCount], true);
+    }
+
+    if (task != NULL) {
+        LOCK(&pool.lock);
+        pool.pending--;
+        UNLOCK(&pool.lock);
+    }
+
+    return task;
+}
+
+static worker_t *findWorker(vm_t *vm)
+{
+    for (int i = 0; i < pool.workerCount; i++) {
+        if (pool.workers[i].vm == vm) return &pool.workers[i];
+    }
+    return NULL;
+}
+
+static void releaseGlobals(globals_t *globals)
+{
+    if (--globals->refs == 0) {
+        dump_free(&globals->dump);
+        free(globals);
+    }
+}
+
+static globals_t *takeGlobals(vm_t *vm)
+{
+    LOCK(&pool.lock);
+    if (pool.globals == NULL || pool.owner != vm || pool.stores != vm->stores) {
+        if (pool.globals != NULL) releaseGlobals(pool.globals);
+
+        globals_t *globals = malloc(sizeof(globals_t));
+        dump_init(&globals->dump);
+        vm_dumpglobals(vm, &globals->dump);
+        globals->id = ++pool.ids;
+        globals->refs = 1;
+
+        pool.globals = globals;
+        pool.owner = vm;
+        pool.stores = vm->stores;
+    }
+
+    globals_t *globals = pool.globals;
+    globals->refs++;
+    UNLOCK(&pool.lock);
+
+    return globals;
+}
+
+// Calls the routine sitting below its arguments, nil if it failed.
+static val_t callRoutine(vm_t *vm, int argc)
+{
+    int callee = (int)(vm->top - vm->stack) - argc - 1;
+    int frameCount = vm->frameCount;
+    bool native = IS_CFN(vm->stack[callee]);
+
+    if (vm_call(vm, vm->stack[callee], argc)) {
+        if (native || vm_execute(vm) == VM_OK) {
+            return vm_pop(vm);
+        }
+    }
+
+    // The error reset the stack, hand back the frames of the caller.
+    vm->top = vm->stack + callee;
+    vm->frameCount = frameCount;
+    return VAL_NIL;
+}
+
+static void runTask(worker_t *worker, task_t *task)
+{
+    vm_t *vm = worker->vm;
+    int top = (int)(vm->top - vm->stack);
+
+    if (worker->globals != task->globals->id) {
+        dump_t dump;
+        dump_init(&dump);
+        dump_load(&dump, task->globals->dump.bytes, task->globals->dump.count);
+        vm_loadglobals(vm, &dump);
+        dump_free(&dump);
+        worker->globals = task->globals->id;
+    }
+
+    val_t routine = dump_read(vm, &task->input);
+    vm_push(vm, routine);
+    map_t *args = AS_MAP(dump_read(vm, &task->input));
+    vm_push(vm, VAL_OBJ(args));
+    dump_free(&task->input);
+
+    if (task->each) {
+        map_t *results = map_new(vm, args->arrayCount, 0);
+        vm_push(vm, VAL_OBJ(results));
+
+        for (int i = 0; i < args->arrayCount; i++) {
+            vm_push(vm, routine);
+            vm_push(vm, args->array[i]);
+            results->array[i] = callRoutine(vm, 1);
+            results->arrayCount = i + 1;
+            GC_BARRIER(vm->gc, results);
+        }
+        dump_write(&task->output, VAL_OBJ(results));
+    }
+    else {
+        vm_push(vm, routine);
+        for (int i = 0; i < args->arrayCount; i++) {
+            vm_push(vm, args->array[i]);
+        }
+        dump_write(&task->output, callRoutine(vm, args->arrayCount));
+    }
+
+    vm->top = vm->stack + top;
+    output_flush(&vm->out);
+
+    LOCK(&pool.lock);
+    task->done = true;
+    BROADCAST(&pool.finished);
+    UNLOCK(&pool.lock);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI workerRoutine(void *data)
+#else
+static void *workerRoutine(void *data)
+#endif
+{
+    worker_t *self = data;
+
+    for (;;) {
+        task_t *task = takeTask(self);
+        if (task != NULL) {
+            runTask(self, task);
+            continue;
+        }
+
+        LOCK(&pool.lock);
+        while (pool.pending == 0) WAIT(&pool.wake, &pool.lock);
+        UNLOCK(&pool.lock);
+    }
+
+    return 0;
+}
+
+static void startPool()
+{
+    LOCK(&poolInit);
+    if (pool.workers == NULL) {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        int count = (int)info.dwNumberOfProcessors;
+#else
+        int count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        if (count < 1) count = 1;
+
+        MUTEX_INIT(&pool.lock);
+        COND_INIT(&pool.wake);
+        COND_INIT(&pool.finished);
+        pool.workers = calloc(count, sizeof(worker_t));
+
+        for (int i = 0; i < count; i++) {
+            worker_t *worker = &pool.workers[i];
+            MUTEX_INIT(&worker->lock);
+            worker->vm = vm_create();
+        }
+        pool.workerCount = count;
+
+        for (int i = 0; i < count; i++) {
+#ifdef _WIN32
+            CloseHandle(CreateThread(NULL, 0, workerRoutine, &pool.workers[i], 0, NULL));
+#else
+            pthread_t handle;
+            pthread_create(&handle, NULL, workerRoutine, &pool.workers[i]);
+            pthread_detach(handle);
+#endif
+        }
+    }
+    UNLOCK(&poolInit);
+}
+
+static task_t *newTask(vm_t *vm, val_t routine, int argc, val_t *args, bool each)
+{
+    LOCK(&pool.lock);
+    task_t *task = pool.spare;
+    if (task != NULL) pool.spare = task->next;
+    UNLOCK(&pool.lock);
+
+    if (task == NULL) task = malloc(sizeof(task_t));
+    task->kind = PTR_TASK;
+    dump_init(&task->input);
+    dump_init(&task->output);
+    task->globals = takeGlobals(vm);
+    task->each = each;
+    task->done = false;
+
+    dump_write(&task->input, routine);
+    dump_list(&task->input, args, argc);
+    return task;
+}
+
+// Workers keep what they spawn, the others spread it round robin.
+static void submitTask(vm_t *vm, task_t *task)
+{
+    worker_t *worker = findWorker(vm);
+
+    if (worker == NULL) {
+        LOCK(&pool.lock);
+        worker = &pool.workers[pool.next++ % pool.workerCount];
+        UNLOCK(&pool.lock);
+    }
+
+    pushTask(worker, task);
+}
+
+task_t *pool_spawn(vm_t *vm, val_t routine, int argc, val_t *args)
+{
+    startPool();
+
+    task_t *task = newTask(vm, routine, argc, args, false);
+    submitTask(vm, task);
+    return task;
+}
+
+val_t pool_await(vm_t *vm, task_t *task)
+{
+    worker_t *self = findWorker(vm);
+
+    for (;;) {
+        LOCK(&pool.lock);
+        bool done = task->done;
+        UNLOCK(&pool.lock);
+        if (done) break;
+
+        // A worker keeps running tasks while it waits, the task it waits
+        // for may well be queued behind it.
+        task_t *other = self != NULL ? takeTask(self) : NULL;
+        if (other != NULL) {
+            runTask(self, other);
+            continue;
+        }
+
+        LOCK(&pool.lock);
+        while (!task->done && (self == NULL || pool.pending == 0)) {
+            WAIT(&pool.finished, &pool.lock);
+        }
+        UNLOCK(&pool.lock);
+    }
+
+    val_t result = dump_read(vm, &task->output);
+
+    dump_free(&task->input);
+    dump_free(&task->output);
+
+    LOCK(&pool.lock);
+    releaseGlobals(task->globals);
+    task->kind = PTR_CLOSED;
+    task->next = pool.spare;
+    pool.spare = task;
+    UNLOCK(&pool.lock);
+    return result;
+}
+
+val_t pool_map(vm_t *vm, map_t *map, val_t routine)
+{
+    int count = map->arrayCount;
+    map_t *result = map_new(vm, count, 0);
+    if (count == 0) return VAL_OBJ(result);
+
+    startPool();
+    vm_push(vm, VAL_OBJ(result));
+
+    int chunks = pool.workerCount * POOL_SPLIT;
+    if (chunks > count) chunks = count;
+    int size = (count + chunks - 1) / chunks;
+    chunks = (count + size - 1) / size;
+
+    task_t **tasks = malloc(chunks * sizeof(task_t *));
+    for (int i = 0; i < chunks; i++) {
+        int start = i * size;
+        int length = (count - start < size) ? count - start : size;
+        tasks[i] = newTask(vm, routine, length, map->array + start, true);
+        submitTask(vm, tasks[i]);
+    }
+
+    for (int i = 0; i < chunks; i++) {
+        map_t *results = AS_MAP(pool_await(vm, tasks[i]));
+        for (int j = 0; j < results->arrayCount; j++) {
+            result->array[i * size + j] = results->array[j];
+        }
+        result->arrayCount = i * size + results->arrayCount;
+        GC_BARRIER(vm->gc, result);
+    }
+    free(tasks);
+
+    while (result->arrayCount > 0 && IS_NIL(result->array[result->arrayCount - 1])) {
+        result->arrayCount--;
+    }
+
+    vm_pop(vm);
+    return VAL_OBJ(result);
+}
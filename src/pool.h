@@ -0,0 +1,27 @@
+#pragma once
+
+#include "common.h"
+#include "value.h"
+#include "dump.h"
+
+#define POOL_SPLIT      4       // parallel_map chunks per worker
+
+typedef struct _globals globals_t;
+
+// A routine queued on the pool, arguments and results travel as dumps
+// since the worker runs on a heap of its own.
+typedef struct _task {
+    ptrkind_t kind;
+    dump_t input;       // routine, then the list of arguments
+    dump_t output;      // result, or the list of results when each is set
+    globals_t *globals; // globals the routine expects
+    bool each;          // call the routine once for every argument
+    bool done;
+    struct _task *next; // next spare one, once awaited
+} task_t;
+
+// Worker vms are created on first use, one per processor. Tasks see the
+// globals as they were when they got spawned.
+task_t *pool_spawn(vm_t *vm, val_t routine, int argc, val_t *args);
+val_t pool_await(vm_t *vm, task_t *task);
+val_t pool_map(vm_t *vm, map_t *map, val_t routine);
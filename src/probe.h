@@ -0,0 +1,120 @@
+#pragma once
+
+#include "common.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define PROBE_SSE2
+#elif (defined(__aarch64__) && defined(__ARM_NEON)) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define PROBE_NEON
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Open addressing shared by tab_t and hash_t. Next to the slots sits one
+// control byte per slot: its top bit is set for free slots, otherwise it
+// holds 7 bits of the hash of the key. Slots are probed a group at a time
+// by comparing all control bytes of the group at once, only slots whose
+// byte matches are compared by key. Capacities are powers of two, at
+// least a group.
+#define PROBE_GROUP         16
+#define PROBE_EMPTY         0x80
+#define PROBE_DELETED       0xFE
+
+#define PROBE_H2(hash)      ((uint8_t)((hash) >> 25))
+#define PROBE_GROW(x)       ((x) < PROBE_GROUP ? PROBE_GROUP : (x) * 2)
+
+// The groups of a probe, visited in triangular steps which reach every
+// group of a power of two table.
+typedef struct {
+    uint32_t mask;
+    uint32_t offset;    // first slot of the current group
+    uint32_t step;
+} probe_t;
+
+static inline probe_t probe_start(uint32_t hash, int capacity) {
+    probe_t probe;
+    probe.mask = (uint32_t)capacity - 1;
+    probe.offset = (hash * PROBE_GROUP) & probe.mask;
+    probe.step = 0;
+    return probe;
+}
+
+static inline void probe_next(probe_t *probe) {
+    probe->step += PROBE_GROUP;
+    probe->offset = (probe->offset + probe->step) & probe->mask;
+}
+
+// Bit i is set when control byte i of the group equals byte.
+static inline uint32_t probe_match(const uint8_t *group, uint8_t byte) {
+#if defined(PROBE_SSE2)
+    __m128i bytes = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)byte)));
+#elif defined(PROBE_NEON)
+    static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t equal = vandq_u8(vceqq_u8(vld1q_u8(group), vdupq_n_u8(byte)), vld1q_u8(bits));
+    return vaddv_u8(vget_low_u8(equal)) | (uint32_t)vaddv_u8(vget_high_u8(equal)) << 8;
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < PROBE_GROUP; i++) {
+        if (group[i] == byte) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// Bit i is set when slot i of the group is empty or deleted.
+static inline uint32_t probe_free(const uint8_t *group) {
+#if defined(PROBE_SSE2)
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#elif defined(PROBE_NEON)
+    static const uint8_t bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t high = vandq_u8(vtstq_u8(vld1q_u8(group), vdupq_n_u8(0x80)), vld1q_u8(bits));
+    return vaddv_u8(vget_low_u8(high)) | (uint32_t)vaddv_u8(vget_high_u8(high)) << 8;
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < PROBE_GROUP; i++) {
+        if (group[i] & 0x80) mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+static inline int probe_first(uint32_t mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// Slot where a key with this hash goes, the first free one on its probe.
+static inline int probe_insert(const uint8_t *ctrl, int capacity, uint32_t hash) {
+    for (probe_t probe = probe_start(hash, capacity);; probe_next(&probe)) {
+        uint32_t mask = probe_free(ctrl + probe.offset);
+        if (mask != 0) return (int)probe.offset + probe_first(mask);
+    }
+}
+
+// A removed slot may become empty again when its group has an empty slot
+// left: no probe ever went past that group. Returns whether it did.
+static inline bool probe_remove(uint8_t *ctrl, int slot) {
+    uint8_t *group = ctrl + (slot & ~(PROBE_GROUP - 1));
+    bool empty = probe_match(group, PROBE_EMPTY) != 0;
+    ctrl[slot] = empty ? PROBE_EMPTY : PROBE_DELETED;
+    return empty;
+}
+
+// Mixes the bits of a 64-bit key, doubles and pointers keep their
+// low bits clear.
+static inline uint32_t probe_hash64(uint64_t key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdull;
+    key ^= key >> 33;
+    return (uint32_t)key;
+}
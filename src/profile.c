@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "profile.h"
+#include "object.h"
+
+static uint64_t now()
+{
+#if defined(_MSC_VER) || defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+static char *copyString(const char *chars)
+{
+    size_t length = strlen(chars);
+    char *copy = malloc(length + 1);
+    memcpy(copy, chars, length + 1);
+    return copy;
+}
+
+profile_t *profile_new()
+{
+    profile_t *profile = calloc(1, sizeof(profile_t));
+    if (profile == NULL) return NULL;
+
+    hash_init(&profile->functionIndex);
+    hash_init(&profile->siteIndex);
+    profile->last = -1;
+    return profile;
+}
+
+void profile_free(profile_t *profile)
+{
+    if (profile == NULL) return;
+
+    for (int i = 0; i < profile->functionCount; i++) {
+        free(profile->functions[i].name);
+        free(profile->functions[i].fname);
+    }
+    free(profile->functions);
+    free(profile->sites);
+    hash_free(&profile->functionIndex);
+    hash_free(&profile->siteIndex);
+    free(profile);
+}
+
+static int findFunction(profile_t *profile, fun_t *function)
+{
+    val_t index;
+    if (hash_get(&profile->functionIndex, (uintptr_t)function, &index)) {
+        return (int)AS_NUM(index);
+    }
+
+    if (profile->functionCount >= profile->functionCapacity) {
+        profile->functionCapacity = GROW_CAPACITY(profile->functionCapacity);
+        profile->functions = realloc(profile->functions,
+            profile->functionCapacity * sizeof(pfun_t));
+    }
+
+    pfun_t *pfun = &profile->functions[profile->functionCount];
+    pfun->name = copyString(function->name != NULL ? function->name->chars : "script");
+    pfun->fname = copyString(function->chunk.source->fname);
+    pfun->count = 0;
+    pfun->ticks = 0;
+
+    hash_set(&profile->functionIndex, (uintptr_t)function, VAL_NUM(profile->functionCount));
+    return profile->functionCount++;
+}
+
+static int findSite(profile_t *profile, fun_t *function, uint8_t *ip)
+{
+    val_t index;
+    if (hash_get(&profile->siteIndex, (uintptr_t)ip, &index)) {
+        return (int)AS_NUM(index);
+    }
+
+    if (profile->siteCount >= profile->siteCapacity) {
+        profile->siteCapacity = GROW_CAPACITY(profile->siteCapacity);
+        profile->sites = realloc(profile->sites, profile->siteCapacity * sizeof(psite_t));
+    }
+
+    int offset = (int)(ip - function->chunk.code);
+    psite_t *site = &profile->sites[profile->siteCount];
+    site->function = findFunction(profile, function);
+    site->line = CHUNK_GETLN(&function->chunk, offset);
+    site->column = CHUNK_GETCOL(&function->chunk, offset);
+    site->op = *ip;
+    site->count = 0;
+    site->ticks = 0;
+
+    hash_set(&profile->siteIndex, (uintptr_t)ip, VAL_NUM(profile->siteCount));
+    return profile->siteCount++;
+}
+
+void profile_step(profile_t *profile, fun_t *function, uint8_t *ip)
+{
+    uint64_t stamp = now();
+    uint8_t op = *ip;
+
+    // The time since the last dispatch went to the instruction run then.
+    if (profile->last >= 0) {
+        psite_t *last = &profile->sites[profile->last];
+        uint64_t ticks = stamp - profile->stamp;
+        last->ticks += ticks;
+        profile->ticks[last->op] += ticks;
+        profile->functions[last->function].ticks += ticks;
+        profile->pairs[last->op][op]++;
+    }
+
+    // Quickening rewrites opcodes in place, the site keeps the latest.
+    int index = findSite(profile, function, ip);
+    psite_t *site = &profile->sites[index];
+    site->op = op;
+    site->count++;
+    profile->counts[op]++;
+    profile->total++;
+    profile->functions[site->function].count++;
+
+    profile->last = index;
+    // Leaves out the time taken here.
+    profile->stamp = now();
+}
+
+typedef struct {
+    uint64_t key;
+    int index;
+} row_t;
+
+static int compareRows(const void *a, const void *b)
+{
+    uint64_t x = ((const row_t *)a)->key;
+    uint64_t y = ((const row_t *)b)->key;
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+// The rows sorted by key, biggest first.
+static row_t *sortRows(uint64_t *keys, int count)
+{
+    row_t *rows = malloc((count > 0 ? count : 1) * sizeof(row_t));
+    for (int i = 0; i < count; i++) {
+        rows[i].key = keys[i];
+        rows[i].index = i;
+    }
+    qsort(rows, count, sizeof(row_t), compareRows);
+    return rows;
+}
+
+static double percent(uint64_t part, uint64_t total)
+{
+    return total > 0 ? 100.0 * part / total : 0.0;
+}
+
+void profile_report(profile_t *profile, FILE *out)
+{
+    uint64_t instructions = profile->total, ticks = 0;
+    for (int i = 0; i < OPCODE_COUNT; i++) {
+        ticks += profile->ticks[i];
+    }
+
+    fprintf(out, "== profile: %llu instructions, %llu ticks\n",
+        (unsigned long long)instructions, (unsigned long long)ticks);
+
+    fprintf(out, "\n%-16s %14s %7s %14s %7s %9s\n",
+        "opcode", "count", "%", "ticks", "%", "ticks/op");
+    row_t *rows = sortRows(profile->ticks, OPCODE_COUNT);
+    for (int i = 0; i < OPCODE_COUNT && profile->counts[rows[i].index] > 0; i++) {
+        int op = rows[i].index;
+        fprintf(out, "%-16s %14llu %6.2f%% %14llu %6.2f%% %9.1f\n", opcode_tostr(op),
+            (unsigned long long)profile->counts[op], percent(profile->counts[op], instructions),
+            (unsigned long long)profile->ticks[op], percent(profile->ticks[op], ticks),
+            (double)profile->ticks[op] / profile->counts[op]);
+    }
+    free(rows);
+
+    fprintf(out, "\n%-33s %14s %7s\n", "pair", "count", "%");
+    rows = sortRows(&profile->pairs[0][0], OPCODE_COUNT * OPCODE_COUNT);
+    for (int i = 0; i < PROFILE_TOP && rows[i].key > 0; i++) {
+        int first = rows[i].index / OPCODE_COUNT, second = rows[i].index % OPCODE_COUNT;
+        fprintf(out, "%-16s %-16s %14llu %6.2f%%\n", opcode_tostr(first), opcode_tostr(second),
+            (unsigned long long)rows[i].key, percent(rows[i].key, instructions));
+    }
+    free(rows);
+
+    uint64_t *keys = malloc((profile->functionCount + 1) * sizeof(uint64_t));
+    for (int i = 0; i < profile->functionCount; i++) {
+        keys[i] = profile->functions[i].ticks;
+    }
+    fprintf(out, "\n%-33s %14s %7s %14s %7s\n", "function", "count", "%", "ticks", "%");
+    rows = sortRows(keys, profile->functionCount);
+    for (int i = 0; i < PROFILE_TOP && i < profile->functionCount; i++) {
+        pfun_t *pfun = &profile->functions[rows[i].index];
+        fprintf(out, "%-33s %14llu %6.2f%% %14llu %6.2f%%\n", pfun->name,
+            (unsigned long long)pfun->count, percent(pfun->count, instructions),
+            (unsigned long long)pfun->ticks, percent(pfun->ticks, ticks));
+    }
+    free(rows);
+    free(keys);
+
+    keys = malloc((profile->siteCount + 1) * sizeof(uint64_t));
+    for (int i = 0; i < profile->siteCount; i++) {
+        keys[i] = profile->sites[i].ticks;
+    }
+    fprintf(out, "\n%-33s %-16s %14s %14s %7s\n", "instruction", "opcode", "count", "ticks", "%");
+    rows = sortRows(keys, profile->siteCount);
+    for (int i = 0; i < PROFILE_TOP && i < profile->siteCount; i++) {
+        psite_t *site = &profile->sites[rows[i].index];
+        pfun_t *pfun = &profile->functions[site->function];
+        char where[256];
+        snprintf(where, sizeof(where), "%s:%d:%d %s", pfun->fname, site->line, site->column, pfun->name);
+        fprintf(out, "%-33s %-16s %14llu %14llu %6.2f%%\n", where, opcode_tostr(site->op),
+            (unsigned long long)site->count, (unsigned long long)site->ticks,
+            percent(site->ticks, ticks));
+    }
+    free(rows);
+    free(keys);
+
+    fflush(out);
+}
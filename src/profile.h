@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "common.h"
+#include "chunk.h"
+#include "hash.h"
+#include "value.h"
+
+#define PROFILE_TOP         20      // rows in each table of the report
+
+// A function as it was when first seen, the report must not rely on
+// objects the collector may have freed since.
+typedef struct {
+    char *name;
+    char *fname;
+    uint64_t count;
+    uint64_t ticks;
+} pfun_t;
+
+// One instruction of one function.
+typedef struct {
+    int function;       // index into the pfun_t array
+    int line;
+    int column;
+    uint8_t op;
+    uint64_t count;
+    uint64_t ticks;
+} psite_t;
+
+// Counts of every instruction the vm dispatched, with the time spent
+// until the next dispatch, by opcode, by pair of consecutive opcodes, by
+// function and by instruction. Ticks are cycles where the cpu has a time
+// stamp counter, nanoseconds elsewhere.
+typedef struct {
+    uint64_t total;         // instructions dispatched
+    uint64_t counts[OPCODE_COUNT];
+    uint64_t ticks[OPCODE_COUNT];
+    uint64_t pairs[OPCODE_COUNT][OPCODE_COUNT];
+
+    hash_t functionIndex;   // fun_t address -> pfun_t index
+    int functionCount;
+    int functionCapacity;
+    pfun_t *functions;
+
+    hash_t siteIndex;       // instruction address -> psite_t index
+    int siteCount;
+    int siteCapacity;
+    psite_t *sites;
+
+    int last;               // site dispatched last, -1 before the first
+    uint64_t stamp;         // when it was
+} profile_t;
+
+profile_t *profile_new();
+void profile_free(profile_t *profile);
+
+// Called before the instruction at ip runs.
+void profile_step(profile_t *profile, fun_t *function, uint8_t *ip);
+void profile_report(profile_t *profile, FILE *out);
@@ -0,0 +1,98 @@
+#include <stdlib.h>
+
+#include "program.h"
+#include "parser.h"
+#include "object.h"
+#include "dump.h"
+#include "sync.h"
+#include "vm.h"
+
+struct _prog {
+    dump_t dump;        // names of the global slots, then the script
+    src_t *source;
+    mutex_t lock;
+    int refs;
+};
+
+prog_t *prog_compile(vm_t *vm, const char *fname)
+{
+    src_t *source = src_new(fname);
+    if (source == NULL) return NULL;
+
+    fun_t *function = compile(vm, source);
+    if (function == NULL) {
+        src_free(source);
+        return NULL;
+    }
+
+    prog_t *prog = malloc(sizeof(prog_t));
+    prog->source = source;
+    prog->refs = 1;
+    MUTEX_INIT(&prog->lock);
+
+    dump_init(&prog->dump);
+    prog->dump.source = source;
+    prog->dump.strip = !vm->debug;
+    vm_dumpslots(vm, &prog->dump);
+    dump_write(&prog->dump, VAL_OBJ(function));
+
+    // Only read from now on.
+    hash_free(&prog->dump.written);
+    hash_init(&prog->dump.written);
+    return prog;
+}
+
+prog_t *prog_retain(prog_t *prog)
+{
+    LOCK(&prog->lock);
+    prog->refs++;
+    UNLOCK(&prog->lock);
+    return prog;
+}
+
+void prog_release(prog_t *prog)
+{
+    LOCK(&prog->lock);
+    int refs = --prog->refs;
+    UNLOCK(&prog->lock);
+    if (refs > 0) return;
+
+    dump_free(&prog->dump);
+    src_free(prog->source);
+    free(prog);
+}
+
+// Functions of prog point into it, it stays until vm gets closed.
+static loaded_t *hold(vm_t *vm, prog_t *prog)
+{
+    for (int i = 0; i < vm->programCount; i++) {
+        if (vm->programs[i].prog == prog) return &vm->programs[i];
+    }
+
+    vm->programs = realloc(vm->programs, (vm->programCount + 1) * sizeof(loaded_t));
+    loaded_t *loaded = &vm->programs[vm->programCount++];
+    loaded->prog = prog_retain(prog);
+    loaded->script = NULL;
+    return loaded;
+}
+
+// The script is read once per vm and run again from there, instead of
+// growing the arena of vm on every run.
+fun_t *prog_load(vm_t *vm, prog_t *prog)
+{
+    loaded_t *loaded = hold(vm, prog);
+    if (loaded->script != NULL) return loaded->script;
+
+    dump_t dump;
+    dump_init(&dump);
+    dump.source = prog->source;
+    dump.arena = &vm->arena;
+    dump_load(&dump, prog->dump.bytes, prog->dump.count);
+
+    if (vm_loadslots(vm, &dump)) {
+        loaded->script = AS_FUN(dump_read(vm, &dump));
+    }
+
+    dump_free(&dump);
+    return loaded->script;
+}
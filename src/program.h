@@ -0,0 +1,25 @@
+#pragma once
+
+#include "common.h"
+#include "value.h"
+
+typedef struct _prog prog_t;
+
+// A script compiled once for any number of vms to run, on any thread.
+// It never changes once compiled, each vm loading it reads functions
+// of its own out of it instead of compiling the source again. Their
+// strings get interned in its heap, where strings compare by identity,
+// and their code gets copied since the vm quickens it in place. The
+// positions are read where they are.
+//
+// Code addresses globals by slot, a vm can only load a program when the
+// globals it has sit on the slots they had in the compiling vm. Vms that
+// load the same libraries in the same order do.
+prog_t *prog_compile(vm_t *vm, const char *fname);
+prog_t *prog_retain(prog_t *prog);
+void prog_release(prog_t *prog);
+
+// The script of prog in the heap of vm, which holds on to prog until it
+// gets closed. Read on the first call, later ones return the same script.
+// NULL where the globals of vm do not line up.
+fun_t *prog_load(vm_t *vm, prog_t *prog);
@@ -0,0 +1,237 @@
+// For usleep under -std=c11.
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "sampler.h"
+#include "sync.h"
+#include "object.h"
+#include "vm.h"
+
+typedef struct {
+    char *stack;        // NULL for a free slot
+    uint32_t hash;
+    uint64_t count;
+} sample_t;
+
+static struct {
+    mutex_t lock;       // guards everything below
+    bool running;
+    char *path;
+
+    int vmCount;
+    int vmCapacity;
+    vm_t **vms;
+
+    int count;
+    int capacity;       // a power of two
+    sample_t *samples;
+
+#ifdef _WIN32
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+} sampler = { MUTEX_INITIALIZER };
+
+#ifdef _WIN32
+static DWORD WINAPI samplerRoutine(void *data)
+#else
+static void *samplerRoutine(void *data)
+#endif
+{
+    LOCK(&sampler.lock);
+    while (sampler.running) {
+        for (int i = 0; i < sampler.vmCount; i++) {
+            sampler.vms[i]->sample = 1;
+        }
+        UNLOCK(&sampler.lock);
+#ifdef _WIN32
+        Sleep(SAMPLER_INTERVAL);
+#else
+        usleep(SAMPLER_INTERVAL * 1000);
+#endif
+        LOCK(&sampler.lock);
+    }
+    UNLOCK(&sampler.lock);
+
+    return 0;
+}
+
+bool sampler_start(const char *path)
+{
+    LOCK(&sampler.lock);
+    if (sampler.running) {
+        UNLOCK(&sampler.lock);
+        return false;
+    }
+
+    size_t length = strlen(path);
+    sampler.path = malloc(length + 1);
+    memcpy(sampler.path, path, length + 1);
+    sampler.running = true;
+    UNLOCK(&sampler.lock);
+
+#ifdef _WIN32
+    sampler.thread = CreateThread(NULL, 0, samplerRoutine, NULL, 0, NULL);
+    return sampler.thread != NULL;
+#else
+    return pthread_create(&sampler.thread, NULL, samplerRoutine, NULL) == 0;
+#endif
+}
+
+void sampler_stop()
+{
+    LOCK(&sampler.lock);
+    if (!sampler.running) {
+        UNLOCK(&sampler.lock);
+        return;
+    }
+    sampler.running = false;
+    UNLOCK(&sampler.lock);
+
+#ifdef _WIN32
+    WaitForSingleObject(sampler.thread, INFINITE);
+    CloseHandle(sampler.thread);
+#else
+    pthread_join(sampler.thread, NULL);
+#endif
+
+    // Vms still attached, such as pool workers, have nothing left to add.
+    LOCK(&sampler.lock);
+    FILE *file = fopen(sampler.path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write samples to \"%s\".\n", sampler.path);
+    }
+
+    for (int i = 0; i < sampler.capacity; i++) {
+        sample_t *sample = &sampler.samples[i];
+        if (sample->stack == NULL) continue;
+        if (file != NULL) fprintf(file, "%s %llu\n", sample->stack, (unsigned long long)sample->count);
+        free(sample->stack);
+    }
+    if (file != NULL) fclose(file);
+
+    free(sampler.samples);
+    free(sampler.vms);
+    free(sampler.path);
+    sampler.samples = NULL;
+    sampler.vms = NULL;
+    sampler.path = NULL;
+    sampler.count = sampler.capacity = 0;
+    sampler.vmCount = sampler.vmCapacity = 0;
+    UNLOCK(&sampler.lock);
+}
+
+void sampler_attach(vm_t *vm)
+{
+    LOCK(&sampler.lock);
+    if (sampler.running) {
+        if (sampler.vmCount >= sampler.vmCapacity) {
+            sampler.vmCapacity = GROW_CAPACITY(sampler.vmCapacity);
+            sampler.vms = realloc(sampler.vms, sampler.vmCapacity * sizeof(vm_t *));
+        }
+        sampler.vms[sampler.vmCount++] = vm;
+    }
+    UNLOCK(&sampler.lock);
+}
+
+void sampler_detach(vm_t *vm)
+{
+    LOCK(&sampler.lock);
+    for (int i = 0; i < sampler.vmCount; i++) {
+        if (sampler.vms[i] == vm) {
+            sampler.vms[i] = sampler.vms[--sampler.vmCount];
+            break;
+        }
+    }
+    UNLOCK(&sampler.lock);
+}
+
+static sample_t *findSample(sample_t *samples, int capacity, const char *stack, uint32_t hash)
+{
+    uint32_t index = hash & (capacity - 1);
+    for (;;) {
+        sample_t *sample = &samples[index];
+        if (sample->stack == NULL ||
+            (sample->hash == hash && strcmp(sample->stack, stack) == 0)) {
+            return sample;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void growSamples()
+{
+    int capacity = GROW_CAPACITY(sampler.capacity);
+    sample_t *samples = calloc(capacity, sizeof(sample_t));
+
+    for (int i = 0; i < sampler.capacity; i++) {
+        sample_t *sample = &sampler.samples[i];
+        if (sample->stack == NULL) continue;
+        *findSample(samples, capacity, sample->stack, sample->hash) = *sample;
+    }
+
+    free(sampler.samples);
+    sampler.samples = samples;
+    sampler.capacity = capacity;
+}
+
+// Appends to a buffer grown as needed.
+static void append(char **buffer, size_t *length, size_t *capacity, const char *chars)
+{
+    size_t size = strlen(chars);
+    if (*length + size + 1 > *capacity) {
+        while (*length + size + 1 > *capacity) *capacity = GROW_CAPACITY(*capacity);
+        *buffer = realloc(*buffer, *capacity);
+    }
+    memcpy(*buffer + *length, chars, size + 1);
+    *length += size;
+}
+
+void sampler_take(vm_t *vm)
+{
+    vm->sample = 0;
+
+    char *stack = NULL;
+    size_t length = 0, capacity = 0;
+    append(&stack, &length, &capacity, "");
+
+    // Outermost first, as flamegraphs expect.
+    for (int i = 0; i < vm->frameCount; i++) {
+        frame_t *frame = &vm->frames[i];
+        fun_t *function = frame->function;
+        size_t instruction = frame->ip - function->chunk.code - 1;
+
+        char part[256];
+        snprintf(part, sizeof(part), "%s%s:%d:%s", i > 0 ? ";" : "",
+            function->chunk.source->fname, CHUNK_GETLN(&function->chunk, instruction),
+            function->name != NULL ? function->name->chars : "script");
+        append(&stack, &length, &capacity, part);
+    }
+
+    uint32_t hash = hash_bytes(stack, length);
+
+    LOCK(&sampler.lock);
+    if (sampler.running) {
+        if (sampler.count + 1 > sampler.capacity / 2) growSamples();
+
+        sample_t *sample = findSample(sampler.samples, sampler.capacity, stack, hash);
+        if (sample->stack == NULL) {
+            sample->stack = stack;
+            sample->hash = hash;
+            sampler.count++;
+            stack = NULL;
+        }
+        sample->count++;
+    }
+    UNLOCK(&sampler.lock);
+
+    free(stack);
+}
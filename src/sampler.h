@@ -0,0 +1,20 @@
+#pragma once
+
+#include "common.h"
+
+#define SAMPLER_INTERVAL    10      // ms between two samples of a vm
+
+// Every vm that exists while the sampler runs, clones and pool workers
+// included, is asked for its call stack every SAMPLER_INTERVAL. The vm
+// answers at its next call or backward jump, so a sample costs nothing
+// but a flag test until it is due. Stacks are counted in one table for
+// the process and written in the collapsed format flamegraph tools read,
+// one "fname:line:function;..." stack per line followed by its count.
+bool sampler_start(const char *path);
+void sampler_stop();
+
+void sampler_attach(vm_t *vm);
+void sampler_detach(vm_t *vm);
+
+// Records the stack of vm, whose frames must be stored.
+void sampler_take(vm_t *vm);
@@ -0,0 +1,55 @@
+#include <stdlib.h>
+
+#include "shape.h"
+
+shape_t *shape_new(shape_t **list)
+{
+    shape_t *shape = malloc(sizeof(shape_t));
+
+    shape->parent = NULL;
+    shape->key = NULL;
+    shape->count = 0;
+    shape->transitionCount = 0;
+    shape->transitionCapacity = 0;
+    shape->transitions = NULL;
+
+    shape->next = *list;
+    *list = shape;
+    return shape;
+}
+
+void shape_free(shape_t *shape)
+{
+    free(shape->transitions);
+    free(shape);
+}
+
+int shape_find(shape_t *shape, str_t *key)
+{
+    for (; shape->parent != NULL; shape = shape->parent) {
+        if (shape->key == key) return shape->count - 1;
+    }
+
+    return -1;
+}
+
+shape_t *shape_add(shape_t **list, shape_t *shape, str_t *key)
+{
+    for (int i = 0; i < shape->transitionCount; i++) {
+        if (shape->transitions[i]->key == key) return shape->transitions[i];
+    }
+
+    shape_t *child = shape_new(list);
+    child->parent = shape;
+    child->key = key;
+    child->count = shape->count + 1;
+
+    if (shape->transitionCount >= shape->transitionCapacity) {
+        shape->transitionCapacity = GROW_CAPACITY(shape->transitionCapacity);
+        shape->transitions = realloc(shape->transitions,
+            shape->transitionCapacity * sizeof(shape_t *));
+    }
+
+    shape->transitions[shape->transitionCount++] = child;
+    return child;
+}
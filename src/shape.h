@@ -0,0 +1,29 @@
+#pragma once
+
+#include "common.h"
+#include "value.h"
+
+#define SHAPE_MAX_FIELDS    32
+
+typedef struct _shape shape_t;
+
+/* A shape (hidden class) describes the string-keyed fields of a map.
+ * Maps that got the same names in the same order share a shape and
+ * store their values at the same offsets, so a field access can be
+ * cached per instruction as shape -> offset. */
+struct _shape {
+    shape_t *parent;        // shape without the last field
+    shape_t *next;          // every shape of the heap
+    str_t *key;             // field added on top of parent
+    int count;              // number of fields, key lives at count - 1
+
+    int transitionCount;
+    int transitionCapacity;
+    shape_t **transitions;
+};
+
+shape_t *shape_new(shape_t **list);
+void shape_free(shape_t *shape);
+
+int shape_find(shape_t *shape, str_t *key);
+shape_t *shape_add(shape_t **list, shape_t *shape, str_t *key);
@@ -0,0 +1,30 @@
+#pragma once
+
+// Locks and condition variables over SRW locks or pthreads.
+#ifdef _WIN32
+#include <windows.h>
+
+typedef SRWLOCK mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+#define MUTEX_INITIALIZER   SRWLOCK_INIT
+#define MUTEX_INIT(m)       InitializeSRWLock(m)
+#define LOCK(m)             AcquireSRWLockExclusive(m)
+#define UNLOCK(m)           ReleaseSRWLockExclusive(m)
+#define COND_INIT(c)        InitializeConditionVariable(c)
+#define WAIT(c, m)          SleepConditionVariableSRW(c, m, INFINITE, 0)
+#define SIGNAL(c)           WakeConditionVariable(c)
+#define BROADCAST(c)        WakeAllConditionVariable(c)
+#else
+#include <pthread.h>
+
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+#define MUTEX_INITIALIZER   PTHREAD_MUTEX_INITIALIZER
+#define MUTEX_INIT(m)       pthread_mutex_init(m, NULL)
+#define LOCK(m)             pthread_mutex_lock(m)
+#define UNLOCK(m)           pthread_mutex_unlock(m)
+#define COND_INIT(c)        pthread_cond_init(c, NULL)
+#define WAIT(c, m)          pthread_cond_wait(c, m)
+#define SIGNAL(c)           pthread_cond_signal(c)
+#define BROADCAST(c)        pthread_cond_broadcast(c)
+#endif
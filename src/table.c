@@ -1,7 +1,9 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "table.h"
 #include "object.h"
+#include "probe.h"
 
 #define TABLE_MAX_LOAD  0.75
 
@@ -10,38 +12,28 @@ void tab_init(tab_t *table)
     table->count = 0;
     table->capacity = 0;
     table->entries = NULL;
+    table->ctrl = NULL;
 }
 
 void tab_free(tab_t *table)
 {
     free(table->entries);
+    free(table->ctrl);
     tab_init(table);
 }
 
-static ent_t *findEntry(ent_t *entries, int capacity, str_t *key)
+static int findEntry(tab_t *table, str_t *key)
 {
-    uint32_t index = key->hash % capacity;
-    ent_t *tombstone = NULL;
+    uint8_t h2 = PROBE_H2(key->hash);
 
-    for (;;) {
-        ent_t *entry = &entries[index];
+    for (probe_t probe = probe_start(key->hash, table->capacity);; probe_next(&probe)) {
+        const uint8_t *group = table->ctrl + probe.offset;
 
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                // Empty entry.                              
-                return tombstone != NULL ? tombstone : entry;
-            }
-            else {
-                // We found a tombstone.                     
-                if (tombstone == NULL) tombstone = entry;
-            }
-        }
-        else if (entry->key == key) {
-            // We found the key.                           
-            return entry;
+        for (uint32_t mask = probe_match(group, h2); mask != 0; mask &= mask - 1) {
+            int slot = probe.offset + probe_first(mask);
+            if (table->entries[slot].key == key) return slot;
         }
-
-        index = (index + 1) % capacity;
+        if (probe_match(group, PROBE_EMPTY) != 0) return -1;
     }
 }
 
@@ -49,66 +41,71 @@ bool tab_get(tab_t *table, str_t *key, val_t *value)
 {
     if (table->count == 0) return false;
 
-    ent_t *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findEntry(table, key);
+    if (slot < 0) return false;
 
-    *value = entry->value;
+    *value = table->entries[slot].value;
     return true;
 }
 
 static void adjustCapacity(tab_t *table, int capacity)
 {
     ent_t *entries = malloc(capacity * sizeof(ent_t));
+    uint8_t *ctrl = malloc(capacity);
 
     for (int i = 0; i < capacity; i++) {
         entries[i].key = NULL;
-        entries[i].value = VAL_NIL;
     }
+    memset(ctrl, PROBE_EMPTY, capacity);
 
     table->count = 0;
     for (int i = 0; i < table->capacity; i++) {
         ent_t *entry = &table->entries[i];
         if (entry->key == NULL) continue;
 
-        ent_t *dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
+        int slot = probe_insert(ctrl, capacity, entry->key->hash);
+        ctrl[slot] = PROBE_H2(entry->key->hash);
+        entries[slot] = *entry;
         table->count++;
     }
 
     free(table->entries);
+    free(table->ctrl);
     table->entries = entries;
+    table->ctrl = ctrl;
     table->capacity = capacity;
 }
 
 bool tab_set(tab_t *table, str_t *key, val_t value)
 {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+    int slot = table->count > 0 ? findEntry(table, key) : -1;
+    if (slot >= 0) {
+        table->entries[slot].value = value;
+        return false;
     }
 
-    ent_t *entry = findEntry(table->entries, table->capacity, key);
+    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+        adjustCapacity(table, PROBE_GROW(table->capacity));
+    }
 
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value)) table->count++;
+    slot = probe_insert(table->ctrl, table->capacity, key->hash);
+    if (table->ctrl[slot] == PROBE_EMPTY) table->count++;
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    table->ctrl[slot] = PROBE_H2(key->hash);
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+    return true;
 }
 
 bool tab_remove(tab_t *table, str_t *key)
 {
     if (table->count == 0) return false;
 
-    // Find the entry.                                             
-    ent_t *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int slot = findEntry(table, key);
+    if (slot < 0) return false;
 
-    // Place a tombstone in the entry.                             
-    entry->key = NULL;
-    entry->value = VAL_TRUE;
+    table->entries[slot].key = NULL;
+    if (probe_remove(table->ctrl, slot)) table->count--;
 
     return true;
 }
@@ -127,21 +124,18 @@ str_t *tab_findstr(tab_t *table, const char *chars, int length, uint32_t hash)
 {
     if (table->count == 0) return NULL;
 
-    uint32_t index = hash % table->capacity;
+    uint8_t h2 = PROBE_H2(hash);
 
-    for (;;) {
-        ent_t *entry = &table->entries[index];
-        str_t *key = entry->key;
+    for (probe_t probe = probe_start(hash, table->capacity);; probe_next(&probe)) {
+        const uint8_t *group = table->ctrl + probe.offset;
 
-        if (key == NULL) {
-            // Stop if we find an empty non-tombstone entry.                 
-            if (IS_NIL(entry->value)) return NULL;
-        }
-        else if (key->length == length && key->hash == hash) {
-            // We found it.                                                  
-            return key;
+        for (uint32_t mask = probe_match(group, h2); mask != 0; mask &= mask - 1) {
+            str_t *key = table->entries[probe.offset + probe_first(mask)].key;
+            if (key->hash == hash && key->length == length &&
+                memcmp(key->chars, chars, length) == 0) {
+                return key;
+            }
         }
-
-        index = (index + 1) % table->capacity;
+        if (probe_match(group, PROBE_EMPTY) != 0) return NULL;
     }
 }
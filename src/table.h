@@ -8,10 +8,12 @@ typedef struct {
     val_t value;
 } ent_t;
 
+// Free entries have a NULL key, see probe.h for the layout.
 typedef struct {
-    int count;
+    int count;          // entries in use or deleted
     int capacity;
     ent_t *entries;
+    uint8_t *ctrl;
 } tab_t;
 
 void tab_init(tab_t *table);
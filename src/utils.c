@@ -1,21 +1,107 @@
+// For strdup under -std=c11.
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 
-// fnv1a_32
-uint32_t hash_bytes(const void *bytes, size_t size)
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+static const uint64_t secret[4] = {
+    0xa0761d6478bd642full, 0xe7037ed1a0b428dbull, 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+};
+
+// Replaces a and b with the low and high half of their product.
+static inline void mul128(uint64_t *a, uint64_t *b)
 {
-    uint32_t hash = 2166136261u;
-    const uint8_t *bs = (uint8_t *)bytes;
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    *a = _umul128(*a, *b, b);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
 
-    for (size_t i = 0; i < size; i++) {
-        hash ^= bs[i];
-        hash *= 16777619;
+static inline uint64_t mix(uint64_t a, uint64_t b)
+{
+    mul128(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// wyhash: eight bytes a step, 48 a round for long inputs.
+uint32_t hash_bytes(const void *bytes, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)bytes;
+    uint64_t seed = secret[0] ^ mix(secret[0], secret[1]);
+    uint64_t a, b;
+
+    if (size <= 16) {
+        if (size >= 4) {
+            size_t mid = (size >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + mid);
+            b = (read32(p + size - 4) << 32) | read32(p + size - 4 - mid);
+        }
+        else if (size > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[size >> 1] << 8) | p[size - 1];
+            b = 0;
+        }
+        else {
+            a = b = 0;
+        }
+    }
+    else {
+        size_t i = size;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+                see1 = mix(read64(p + 16) ^ secret[2], read64(p + 24) ^ see1);
+                see2 = mix(read64(p + 32) ^ secret[3], read64(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
     }
 
-    return hash;
+    a ^= secret[1];
+    b ^= seed;
+    mul128(&a, &b);
+    return (uint32_t)mix(a ^ secret[0] ^ size, b ^ secret[1]);
 }
 
 char *read_file(const char *path, size_t *size)
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "value.h"
 #include "object.h"
@@ -23,26 +24,33 @@ const char *val_typeof(val_t value)
     }
 }
 
-void val_print(val_t value)
+void val_print(output_t *out, val_t value)
 {
     switch (AS_TYPE(value)) {
         case VT_NIL:
-            printf("nil");
+            output_write(out, "nil", 3);
             break;
         case VT_BOOL:
-            printf(AS_BOOL(value) ? "true" : "false");
+            if (AS_BOOL(value)) {
+                output_write(out, "true", 4);
+            } else {
+                output_write(out, "false", 5);
+            }
             break;
         case VT_NUM:
-            printf("%.14g", AS_NUM(value));
+            output_number(out, AS_NUM(value));
             break;
         case VT_CFN:
-            printf("fn: %p", AS_CFN(value));
+            output_write(out, "fn: ", 4);
+            output_write(out, AS_CFN(value)->name, (int)strlen(AS_CFN(value)->name));
             break;
-        case VT_PTR:
-            printf("ptr: %p", AS_PTR(value));
+        case VT_PTR: {
+            char buffer[32];
+            output_write(out, buffer, snprintf(buffer, sizeof(buffer), "ptr: %p", AS_PTR(value)));
             break;
+        }
         case VT_OBJ:
-            obj_print(AS_OBJ(value));
+            obj_print(out, AS_OBJ(value));
             break;
     }
 }
@@ -60,7 +68,8 @@ bool val_equal(val_t a, val_t b)
         case VT_NUM_NUM:
             return AS_NUM(a) == AS_NUM(b);
         case VT_OBJ_OBJ:
-            return AS_OBJ(a) == AS_OBJ(b);
+            return AS_OBJ(a) == AS_OBJ(b) ||
+                   (str_is(a) && str_is(b) && str_equal(AS_OBJ(a), AS_OBJ(b)));
         case VT_CFN_CFN:
             return AS_CFN(a) == AS_CFN(b);
         case VT_PTR_PTR:
@@ -74,6 +83,32 @@ bool val_equal(val_t a, val_t b)
     }
 }
 
+bool native_param(char param, val_t value)
+{
+    switch (param) {
+        case 'n': return IS_NUM(value);
+        case 's': return str_is(value);
+        case 'f': return IS_FUN(value);
+        case 'm': return IS_MAP(value);
+        case 'c': return IS_FIBER(value);
+        case 't': return IS_PTR(value) && ptr_kind(value) == PTR_THREAD;
+        case 'k': return IS_PTR(value) && ptr_kind(value) == PTR_TASK;
+        case 'p': return IS_PTR(value);
+        default:  return true;
+    }
+}
+
+bool native_accepts(const native_t *native, int argc, const val_t *args)
+{
+    if (argc < native->arity) return false;
+    if (argc > native->arity && !(native->flags & NATIVE_VARARGS)) return false;
+
+    for (int i = 0; i < argc && native->params[i] != '\0'; i++) {
+        if (!native_param(native->params[i], args[i])) return false;
+    }
+    return true;
+}
+
 void arr_init(arr_t *array)
 {
     array->count = 0;
@@ -1,11 +1,15 @@
 #pragma once
 
 #include "common.h"
+#include "output.h"
 
 typedef struct _obj obj_t;
 typedef struct _str str_t;
 typedef struct _fun fun_t;
 typedef struct _map map_t;
+typedef struct _rope rope_t;
+typedef struct _native native_t;
+typedef struct _fiber fiber_t;
 
 typedef enum {
     VT_NIL,
@@ -21,7 +25,9 @@ typedef enum {
 typedef enum {
     OT_STR,
     OT_FUN,
-    OT_MAP
+    OT_MAP,
+    OT_ROPE,
+    OT_FIBER
 } otype_t;
 
 enum {
@@ -49,24 +55,119 @@ enum {
     VT_PTR_PTR      = CMB_BYTES(VT_PTR, VT_PTR)
 };
 
+typedef struct {
+    int count;
+    int capacity;
+    val_t *values;
+} arr_t;
+
+#define NATIVE_VARARGS      0x01    // takes any number of arguments after its params
+#define NATIVE_PURE         0x02    // no side effects and no allocation, same arguments same result
+
+// A function written in C, with what it takes. The vm checks the
+// arguments against params before the call, so the function can read
+// them without looking. Natives are static data shared by every vm,
+// the collector never sees them.
+struct _native {
+    cfn_t function;
+    const char *name;
+    int arity;
+    const char *params;     // a letter per parameter, see native_param, those past
+                            // arity check the optional arguments given
+    int flags;
+    uint8_t intrinsic;      // opcode CALL quickens into to run it inline, 0 for none
+};
+
+#ifdef NAN_BOXING
+
+// Numbers are stored as plain doubles, everything else lives in the
+// payload of a quiet NaN. Sign bit set means an object pointer, bits
+// 48-49 tell natives and raw pointers from the nil/bool singletons.
+#define NB_SIGN         ((uint64_t)0x8000000000000000)
+#define NB_QNAN         ((uint64_t)0x7ffc000000000000)
+#define NB_TAG_CFN      ((uint64_t)0x0001000000000000)
+#define NB_TAG_PTR      ((uint64_t)0x0002000000000000)
+#define NB_TAG_MASK     (NB_SIGN | NB_QNAN | NB_TAG_CFN | NB_TAG_PTR)
+#define NB_PAYLOAD      ((uint64_t)0x0000FFFFFFFFFFFF)
+
+#define NB_NIL          1
+#define NB_FALSE        2
+#define NB_TRUE         3
+
+static const val_t VAL_NIL = NB_QNAN | NB_NIL;
+static const val_t VAL_TRUE = NB_QNAN | NB_TRUE;
+static const val_t VAL_FALSE = NB_QNAN | NB_FALSE;
+static const val_t VAL_NULLPTR = NB_QNAN | NB_TAG_PTR;
+
+static inline val_t nb_fromnum(double num) {
+    union { double num; uint64_t bits; } u = { .num = num };
+    return u.bits;
+}
+
+static inline double nb_tonum(val_t value) {
+    union { uint64_t bits; double num; } u = { .bits = value };
+    return u.num;
+}
+
+static inline vtype_t nb_typeof(val_t value) {
+    switch (value >> 48) {
+        case (NB_QNAN >> 48):
+            return value == VAL_NIL ? VT_NIL : VT_BOOL;
+        case ((NB_QNAN | NB_TAG_CFN) >> 48):
+            return VT_CFN;
+        case ((NB_QNAN | NB_TAG_PTR) >> 48):
+            return VT_PTR;
+        case ((NB_SIGN | NB_QNAN) >> 48):
+            return VT_OBJ;
+        default:
+            return VT_NUM;
+    }
+}
+
+#define VAL_BOOL(b)     ((b) ? VAL_TRUE : VAL_FALSE)
+#define VAL_NUM(n)      nb_fromnum(n)
+#define VAL_OBJ(o)      (NB_SIGN | NB_QNAN | (uint64_t)(uintptr_t)(o))
+#define VAL_CFN(c)      (NB_QNAN | NB_TAG_CFN | (uint64_t)(uintptr_t)(c))
+#define VAL_PTR(p)      (NB_QNAN | NB_TAG_PTR | (uint64_t)(uintptr_t)(p))
+
+#define AS_BOOL(v)      ((v) == VAL_TRUE)
+#define AS_NUM(v)       nb_tonum(v)
+#define AS_OBJ(v)       ((obj_t *)(uintptr_t)((v) & NB_PAYLOAD))
+#define AS_CFN(v)       ((const native_t *)(uintptr_t)((v) & NB_PAYLOAD))
+#define AS_PTR(v)       ((void *)(uintptr_t)((v) & NB_PAYLOAD))
+
+#define IS_NIL(v)       ((v) == VAL_NIL)
+#define IS_BOOL(v)      (((v) | 1) == VAL_TRUE)
+#define IS_NUM(v)       (((v) & NB_QNAN) != NB_QNAN)
+#define IS_OBJ(v)       (((v) & NB_TAG_MASK) == (NB_SIGN | NB_QNAN))
+#define IS_CFN(v)       (((v) & NB_TAG_MASK) == (NB_QNAN | NB_TAG_CFN))
+#define IS_PTR(v)       (((v) & NB_TAG_MASK) == (NB_QNAN | NB_TAG_PTR))
+
+#define AS_INT(v)       ((int)AS_NUM(v))
+#define AS_TYPE(v)      nb_typeof(v)
+#define AS_RAW(v)       (v)
+#define IS_FALSEY(v)    nb_falsey(v)
+
+// Same truth table as the tagged union: nil, false, 0 and null pointers.
+static inline bool nb_falsey(val_t value) {
+    return value == VAL_NIL || value == VAL_FALSE
+        || value == 0 || value == VAL_NULLPTR;
+}
+
+#else
+
 struct _val {
     vtype_t type;
     union {
         bool Bool : 1;
         double Num;
-        cfn_t CFn;
+        const native_t *CFn;
         obj_t *Obj;
         void *Ptr;
         uint64_t raw;
     };
 };
 
-typedef struct {
-    int count;
-    int capacity;
-    val_t *values;
-} arr_t;
-
 static const val_t VAL_NIL = { .type = VT_NIL };
 static const val_t VAL_TRUE = { .type = VT_BOOL, .Bool = true };
 static const val_t VAL_FALSE = { .type = VT_BOOL, .Bool = false };
@@ -96,9 +197,31 @@ static const val_t VAL_NULLPTR = { .type = VT_PTR, .Ptr = NULL };
 #define AS_RAW(v)       ((v).raw)
 #define IS_FALSEY(v)    (!(bool)AS_RAW(v))
 
-void val_print(val_t value);
+#endif
+
+void val_print(output_t *out, val_t value);
 bool val_equal(val_t a, val_t b);
 
+// Whatever a pointer value points at starts with its kind and stays
+// readable while the value may be around, so natives taking pointers
+// can tell a thread from a task before casting.
+typedef enum {
+    PTR_CLOSED = 0,             // a handle that got closed, taken by no native
+    PTR_UNDEF = 0x756e6466,     // vm_undefined
+    PTR_THREAD = 0x74687264,
+    PTR_TASK = 0x7461736b
+} ptrkind_t;
+
+static inline ptrkind_t ptr_kind(val_t value) {
+    return *(const ptrkind_t *)AS_PTR(value);
+}
+
+// Whether the value fits the letter of a parameter: n number, s string,
+// f function, m map, c fiber, t open thread, k pending task, p pointer,
+// . anything.
+bool native_param(char param, val_t value);
+bool native_accepts(const native_t *native, int argc, const val_t *args);
+
 void arr_init(arr_t *array);
 void arr_free(arr_t *array);
 int arr_add(arr_t *array, val_t value, bool allowdup);
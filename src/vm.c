@@ -1,13 +1,21 @@
 #include <stdarg.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 #include "vm.h"
 #include "value.h"
 #include "parser.h"
 #include "object.h"
+#include "dump.h"
+#include "cache.h"
+#include "sampler.h"
+#include "jit.h"
+#include "fiber.h"
+#include "program.h"
+
+const ptrkind_t vm_undefined = PTR_UNDEF;
 
 static void resetStack(vm_t *vm)
 {
@@ -17,6 +25,9 @@ static void resetStack(vm_t *vm)
 
 static void runtimeError(vm_t *vm, const char *format, ...)
 {
+    // What got printed before comes first, also when stdout is a pipe.
+    output_flush(&vm->out);
+
     va_list args;
     va_start(args, format);
     fprintf(stderr, "Error: ");
@@ -31,9 +42,14 @@ static void runtimeError(vm_t *vm, const char *format, ...)
         // executed.                                                 
         size_t instruction = frame->ip - function->chunk.code - 1;
         const char *fname = frame->function->chunk.source->fname;
-        int line = CHUNK_GETLN(&frame->function->chunk, instruction);
-        int column = CHUNK_GETCOL(&frame->function->chunk, instruction);
-        fprintf(stderr, "[%s:%d:%d] in ", fname, line, column);
+        pos_t position = chunk_position(&frame->function->chunk, (int)instruction);
+        if (position.line != 0) {
+            fprintf(stderr, "[%s:%d:%d] in ", fname, position.line, position.column);
+        }
+        else {
+            // Left out of the cache it was loaded from.
+            fprintf(stderr, "[%s] in ", fname);
+        }
         if (function->name == NULL) {
             fprintf(stderr, "script\n");
         }
@@ -52,13 +68,27 @@ vm_t *vm_create()
     if (vm == NULL) return NULL;
 
     memset(vm, '\0', sizeof(vm_t));
+    vm->stack = malloc(STACK_INIT * sizeof(val_t));
+    vm->stackCapacity = STACK_INIT;
+    vm->maxStack = STACK_MAX;
+    vm->frames = malloc(FRAMES_INIT * sizeof(frame_t));
+    vm->frameCapacity = FRAMES_INIT;
+    vm->maxFrames = FRAMES_MAX;
+    vm->jit = 1;
+    vm->debug = 1;
+    arena_init(&vm->arena);
+    output_init(&vm->out, stdout);
     vm->gc = malloc(sizeof(gc_t));
     vm->globals = malloc(sizeof(tab_t));
+    vm->slots = malloc(sizeof(arr_t));
     vm->strings = malloc(sizeof(tab_t));
 
     gc_init(vm->gc);
     tab_init(vm->globals);
+    arr_init(vm->slots);
     tab_init(vm->strings);
+    gc_attach(vm->gc, vm);
+    sampler_attach(vm);
 
     resetStack(vm);
     return vm;
@@ -68,65 +98,264 @@ void vm_close(vm_t *vm)
 {
     if (vm == NULL) return;
 
+    sampler_detach(vm);
+    output_flush(&vm->out);
+
+#ifdef DEBUG_PROFILE
+    if (vm->profile != NULL) {
+        profile_report(vm->profile, stderr);
+        profile_free(vm->profile);
+    }
+#endif
+
+    sched_free(vm->sched);
+    gc_detach(vm->gc, vm);
+
     tab_free(vm->globals);
+    arr_free(vm->slots);
     tab_free(vm->strings);
     gc_free(vm->gc);
 
     free(vm->globals);
+    free(vm->slots);
     free(vm->strings);
     free(vm->gc);
+    free(vm->stack);
+    free(vm->frames);
+    arena_free(&vm->arena);
+
+    for (int i = 0; i < vm->programCount; i++) {
+        prog_release(vm->programs[i].prog);
+    }
+    free(vm->programs);
 
     free(vm);
 }
 
+void vm_dumpglobals(vm_t *vm, dump_t *dump)
+{
+    dump_write(dump, VAL_NUM(vm->slots->count));
+    for (int i = 0; i < vm->slots->count; i++) {
+        dump_write(dump, vm->slots->values[i]);
+    }
+
+    dump_write(dump, VAL_NUM(vm->globals->count));
+    for (int i = 0; i < vm->globals->capacity; i++) {
+        ent_t *entry = &vm->globals->entries[i];
+        if (entry->key == NULL) continue;
+        dump_write(dump, VAL_OBJ(entry->key));
+        dump_write(dump, entry->value);
+    }
+}
+
+void vm_loadglobals(vm_t *vm, dump_t *dump)
+{
+    // Same slot numbers, so copied code keeps addressing its globals.
+    int count = AS_INT(dump_read(vm, dump));
+    vm->slots->count = 0;
+    for (int i = 0; i < count; i++) {
+        arr_add(vm->slots, dump_read(vm, dump), true);
+    }
+
+    count = AS_INT(dump_read(vm, dump));
+    for (int i = 0; i < count; i++) {
+        val_t name = dump_read(vm, dump);
+        tab_set(vm->globals, AS_STR(name), dump_read(vm, dump));
+    }
+    vm->stores++;
+}
+
+void vm_dumpslots(vm_t *vm, dump_t *dump)
+{
+    str_t **names = calloc(vm->slots->count, sizeof(str_t *));
+    for (int i = 0; i < vm->globals->capacity; i++) {
+        ent_t *entry = &vm->globals->entries[i];
+        if (entry->key != NULL) names[AS_INT(entry->value)] = entry->key;
+    }
+
+    dump_write(dump, VAL_NUM(vm->slots->count));
+    for (int i = 0; i < vm->slots->count; i++) {
+        dump_write(dump, VAL_OBJ(names[i]));
+    }
+    free(names);
+}
+
+bool vm_loadslots(vm_t *vm, dump_t *dump)
+{
+    int count = AS_INT(dump_read(vm, dump));
+    for (int i = 0; i < count; i++) {
+        str_t *name = AS_STR(dump_read(vm, dump));
+        if (global_slot(vm, name) != i) return false;
+    }
+    return true;
+}
+
 vm_t *vm_clone(vm_t *from)
 {
-    vm_t *vm = malloc(sizeof(vm_t));
+    vm_t *vm = vm_create();
     if (vm == NULL) return NULL;
 
-    memset(vm, '\0', sizeof(vm_t));
-
-    vm->gc = from->gc;
-    vm->globals = from->globals;
-    vm->strings = from->strings;
+    vm->maxStack = from->maxStack;
+    vm->maxFrames = from->maxFrames;
+    vm->jit = from->jit;
+    vm->debug = from->debug;
+
+    dump_t dump;
+    dump_init(&dump);
+    vm_dumpglobals(from, &dump);
+    vm_loadglobals(vm, &dump);
+    dump_free(&dump);
+
+    // Functions copied over still name the sources of the programs, their
+    // scripts get read again if they run here.
+    vm->programs = malloc(from->programCount * sizeof(loaded_t));
+    vm->programCount = from->programCount;
+    for (int i = 0; i < vm->programCount; i++) {
+        vm->programs[i].prog = prog_retain(from->programs[i].prog);
+        vm->programs[i].script = NULL;
+    }
 
-    resetStack(vm);
     return vm;
 }
 
+val_t vm_import(vm_t *vm, val_t value)
+{
+    dump_t dump;
+    dump_init(&dump);
+    dump_write(&dump, value);
+    value = dump_read(vm, &dump);
+    dump_free(&dump);
+    return value;
+}
+
 #define PUSH(v)     *((vm)->top++) = (v)
 #define POP()       *(--(vm)->top)
 #define POPN(n)     *((vm)->top -= (n))
 #define PEEK(i)     ((vm)->top[-1 - (i)])
 
-static void defineNative(vm_t *vm, const char *name, cfn_t function)
+static str_t *globalName(vm_t *vm, int slot)
 {
-    val_t native = VAL_CFN(function);
-    val_t gname = VAL_OBJ(str_copy(vm, name, (int)strlen(name)));
+    for (int i = 0; i < vm->globals->capacity; i++) {
+        ent_t *entry = &vm->globals->entries[i];
+        if (entry->key != NULL && AS_INT(entry->value) == slot) {
+            return entry->key;
+        }
+    }
 
-    PUSH(gname);
-    tab_set(vm->globals, AS_STR(gname), native);
+    return NULL;
+}
+
+static void concatenate(vm_t *vm)
+{
+    // Operands stay on the stack, allocating may trigger a collection.
+    obj_t *result = str_concat(vm, AS_OBJ(PEEK(1)), AS_OBJ(PEEK(0)));
+    POP();
     POP();
+    PUSH(VAL_OBJ(result));
 }
 
-static val_t clockNative(vm_t *vm, int argc, val_t *args)
+// Ropes are interned before they index a map.
+static inline val_t strKey(vm_t *vm, val_t key)
 {
-    return VAL_NUM((double)clock() / CLOCKS_PER_SEC);
+    if (IS_ROPE(key)) return VAL_OBJ(str_flatten(vm, AS_OBJ(key)));
+    return key;
 }
 
-static void concatenate(vm_t *vm)
+// Reads both operands as numbers, booleans count as 0/1.
+static inline bool numOperands(val_t a, val_t b, double *x, double *y)
+{
+    if (IS_NUM(a) && IS_NUM(b)) {
+        *x = AS_NUM(a);
+        *y = AS_NUM(b);
+        return true;
+    }
+
+    switch (CMB_BYTES(AS_TYPE(a), AS_TYPE(b))) {
+        case VT_BOOL_BOOL:
+            *x = AS_BOOL(a);
+            *y = AS_BOOL(b);
+            return true;
+        case VT_BOOL_NUM:
+            *x = AS_BOOL(a);
+            *y = AS_NUM(b);
+            return true;
+        case VT_NUM_BOOL:
+            *x = AS_NUM(a);
+            *y = AS_BOOL(b);
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Condition of a numeric for loop, GT/GE negated like the compiler
+// emits them.
+static inline bool forTest(uint8_t m, double x, double y)
 {
-    str_t *b = AS_STR(POP());
-    str_t *a = AS_STR(POP());
+    switch (m) {
+        case OP_LT: return x < y;
+        case OP_LE: return x <= y;
+        case OP_GT: return !(x <= y);
+        default:    return !(x < y);
+    }
+}
 
-    int length = a->length + b->length;
-    char *chars = malloc((length + 1) * sizeof(char));
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+static inline val_t readRK(val_t *stack, val_t *consts, uint8_t rk)
+{
+    return (rk & RK_CONST) ? consts[rk & ~RK_CONST] : stack[rk];
+}
 
-    str_t *result = str_take(vm, chars, length);
-    PUSH(VAL_OBJ(result));
+// Makes room for count more values. The stack moves to a new block, the
+// frames and top are carried over; pointers into it held elsewhere are
+// stale afterwards.
+static bool growStack(vm_t *vm, int count, int limit)
+{
+    int used = (int)(vm->top - vm->stack);
+    if (used + count <= vm->stackCapacity) return true;
+
+    int capacity = vm->stackCapacity;
+    while (capacity < used + count) capacity *= 2;
+    if (capacity > limit) capacity = limit;
+    if (capacity < used + count) return false;
+
+    val_t *stack = malloc(capacity * sizeof(val_t));
+    if (stack == NULL) return false;
+    memcpy(stack, vm->stack, used * sizeof(val_t));
+
+    for (int i = 0; i < vm->frameCount; i++) {
+        vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+    }
+    vm->top = stack + used;
+
+    free(vm->stack);
+    vm->stack = stack;
+    vm->stackCapacity = capacity;
+    return true;
+}
+
+static bool growFrames(vm_t *vm)
+{
+    if (vm->frameCount < vm->frameCapacity) return true;
+    if (vm->frameCapacity >= vm->maxFrames) return false;
+
+    int capacity = vm->frameCapacity * 2;
+    if (capacity > vm->maxFrames) capacity = vm->maxFrames;
+
+    frame_t *frames = realloc(vm->frames, capacity * sizeof(frame_t));
+    if (frames == NULL) return false;
+
+    vm->frames = frames;
+    vm->frameCapacity = capacity;
+    return true;
+}
+
+// Counts calls and backward jumps, a function gets compiled once when
+// it turns hot.
+static inline void countHot(vm_t *vm, fun_t *function)
+{
+    if (function->hot < JIT_THRESHOLD && ++function->hot == JIT_THRESHOLD && vm->jit) {
+        function->jit = jit_compile(function);
+    }
 }
 
 static bool prepareCall(vm_t *vm, fun_t *function, int argCount)
@@ -137,11 +366,13 @@ static bool prepareCall(vm_t *vm, fun_t *function, int argCount)
         return false;
     }
 
-    if (vm->frameCount == FRAMES_MAX) {
+    if (!growFrames(vm) || !growStack(vm, STACK_FRAME, vm->maxStack)) {
         runtimeError(vm, "Stack overflow.");
         return false;
     }
 
+    countHot(vm, function);
+
     frame_t *frame = &vm->frames[vm->frameCount++];
     frame->function = function;
     frame->ip = function->chunk.code;
@@ -150,6 +381,69 @@ static bool prepareCall(vm_t *vm, fun_t *function, int argCount)
     return true;
 }
 
+// Replaces the function of the topmost frame by the callee, its
+// arguments slide down to where the caller's were.
+static bool prepareTailCall(vm_t *vm, fun_t *function, int argCount)
+{
+    if (argCount != function->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.",
+            function->arity, argCount);
+        return false;
+    }
+
+    frame_t *frame = &vm->frames[vm->frameCount - 1];
+    memmove(frame->slots, vm->top - argCount - 1, (argCount + 1) * sizeof(val_t));
+    vm->top = frame->slots + argCount + 1;
+
+    if (!growStack(vm, STACK_FRAME, vm->maxStack)) {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+
+    countHot(vm, function);
+
+    frame->function = function;
+    frame->ip = function->chunk.code;
+    return true;
+}
+
+static const char *paramName(char param)
+{
+    switch (param) {
+        case 'n': return "a number";
+        case 's': return "a string";
+        case 'f': return "a function";
+        case 'm': return "a map";
+        case 'c': return "a fiber";
+        case 't': return "an open thread";
+        case 'k': return "a pending task";
+        case 'p': return "a pointer";
+        default:  return "a value";
+    }
+}
+
+// Once per call, so natives never see arguments they do not take.
+static bool checkNative(vm_t *vm, const native_t *native, int argCount, val_t *args)
+{
+    if (native_accepts(native, argCount, args)) return true;
+
+    bool varargs = native->flags & NATIVE_VARARGS;
+    if (argCount < native->arity || (argCount > native->arity && !varargs)) {
+        runtimeError(vm, "Expected %s%d arguments but got %d.",
+            varargs ? "at least " : "", native->arity, argCount);
+        return false;
+    }
+
+    for (int i = 0; i < argCount && native->params[i] != '\0'; i++) {
+        if (!native_param(native->params[i], args[i])) {
+            runtimeError(vm, "Argument %d of %s must be %s.",
+                i + 1, native->name, paramName(native->params[i]));
+            break;
+        }
+    }
+    return false;
+}
+
 bool vm_call(vm_t *vm, val_t callee, int argCount)
 {
     if (IS_OBJ(callee)) {
@@ -163,10 +457,17 @@ bool vm_call(vm_t *vm, val_t callee, int argCount)
         }
     }
     else if (IS_CFN(callee)) {
-        cfn_t native = AS_CFN(callee);
-        val_t result = native(vm, argCount, vm->top - argCount);
-        vm->top -= argCount + 1;
-        PUSH(result);
+        const native_t *native = AS_CFN(callee);
+        val_t *args = vm->top - argCount;
+        if (!checkNative(vm, native, argCount, args)) return false;
+
+        // The arguments are read where they lie, the result takes the
+        // slot of the callee. The stack may have moved if it pushed.
+        val_t result = native->function(vm, argCount, args);
+        // Suspended, the callee and arguments stay for the call to run again.
+        if (vm->suspend) return true;
+        vm->top -= argCount;
+        vm->top[-1] = result;
         return true;
     }
 
@@ -174,12 +475,15 @@ bool vm_call(vm_t *vm, val_t callee, int argCount)
     return false;
 }
 
-int vm_execute(vm_t *vm)
+// Runs until the frame at base returns, so natives can call back into
+// the vm.
+static int execute(vm_t *vm, int base)
 {
     register uint8_t *ip;
     register val_t *stack;
     register val_t *consts;
     register frame_t *frame;
+    icache_t *caches;
 
 #define STORE_FRAME() \
     frame->ip = ip
@@ -188,17 +492,80 @@ int vm_execute(vm_t *vm)
     frame = &vm->frames[vm->frameCount - 1]; \
 	ip = frame->ip; \
     stack = frame->slots; \
-    consts = frame->function->chunk.constants.values
+    consts = frame->function->chunk.constants.values; \
+    caches = frame->function->chunk.caches
 
 #define STACK           (stack)
 #define CONSTS          (consts)
+#define CACHES          (caches)
 
 #define PREV_BYTE()     (ip[-1])
 #define READ_BYTE()     *(ip++)
 #define READ_SHORT()    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_WIDE()     (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
 
 #define READ_CONST()    CONSTS[READ_BYTE()]
 #define READ_STR()      AS_STR(READ_CONST())
+#define READ_RK()       readRK(STACK, CONSTS, READ_BYTE())
+#define READ_CACHE()    (&CACHES[READ_SHORT()])
+
+#define STORE_R(a, v) \
+    do { \
+        if ((a) == R_PUSH) PUSH(v); \
+        else STACK[a] = (v); \
+    } while (0)
+
+#define REGISTER_ARITH(op) \
+    do { \
+        uint8_t a = READ_BYTE(); \
+        val_t b = READ_RK(); \
+        val_t c = READ_RK(); \
+        double x, y; \
+        if (!numOperands(b, c, &x, &y)) { \
+            ERROR("Operands must be two numbers/booleans."); \
+        } \
+        STORE_R(a, VAL_NUM(x op y)); \
+    } while (0)
+
+// m is the comparison, as for FORPREP.
+#define REGISTER_JUMP(m) \
+    do { \
+        val_t b = READ_RK(); \
+        val_t c = READ_RK(); \
+        uint16_t offset = READ_SHORT(); \
+        double x, y; \
+        if (!numOperands(b, c, &x, &y)) { \
+            ERROR("Operands must be two numbers/booleans."); \
+        } \
+        if (!forTest(m, x, y)) ip += offset; \
+    } while (0)
+
+// Calls and backward jumps hand the sampler the stack it asked for.
+#define SAFEPOINT() \
+    do { \
+        if (vm->sample) { \
+            STORE_FRAME(); \
+            sampler_take(vm); \
+        } \
+    } while (0)
+
+// Frames of compiled functions run their code from where they stand
+// whenever the interpreter switches to them or jumps back.
+#define JIT_ENTER() \
+    do { \
+        if (frame->function->jit != NULL) { \
+            ip = jit_run(vm, frame->function->jit, stack, ip); \
+        } \
+    } while (0)
+
+// A native suspended the fiber, the call runs again when it resumes.
+#define SUSPEND_POINT() \
+    do { \
+        if (vm->suspend) { \
+            frame->ip = ip - 2; \
+            return VM_SUSPENDED; \
+        } \
+    } while (0)
 
 #define ERROR(fmt, ...) \
     do { \
@@ -207,6 +574,43 @@ int vm_execute(vm_t *vm)
         return VM_RUNTIME_ERROR; \
     } while (0)
 
+// Rewrites the instruction being run, before its operands are read.
+#define QUICKEN(x)      (ip[-1] = OP_##x)
+
+// A quickened instruction whose guard failed turns back into the
+// generic one and runs that instead.
+#define DEQUICKEN(x) \
+    do { \
+        ip[-1] = OP_##x; \
+        ip--; \
+        NEXT; \
+    } while (0)
+
+#define QUICK_BINARY(x, op, box) \
+    do { \
+        if (!IS_NUM(PEEK(0)) || !IS_NUM(PEEK(1))) DEQUICKEN(x); \
+        double b = AS_NUM(POP()); \
+        PEEK(0) = box(AS_NUM(PEEK(0)) op b); \
+    } while (0)
+
+// The callee is checked each time, it is whatever the call site
+// loaded and may be some other function by now.
+#define QUICK_INTRINSIC(x, fn) \
+    do { \
+        if (!IS_CFN(PEEK(1)) || AS_CFN(PEEK(1))->intrinsic != OP_##x || !IS_NUM(PEEK(0))) { \
+            DEQUICKEN(CALL); \
+        } \
+        ip++; \
+        double a = AS_NUM(POP()); \
+        PEEK(0) = VAL_NUM(fn(a)); \
+    } while (0)
+
+#ifdef DEBUG_PROFILE
+#define PROFILE()       if (vm->profile != NULL) profile_step(vm->profile, frame->function, ip)
+#else
+#define PROFILE()
+#endif
+
 #ifdef _MSC_VER
 // Never try the 'computed goto' below on MSVC x86!
 #if 0 //defined(_M_IX86) || (defined(_WIN32) && !defined(_WIN64))
@@ -221,7 +625,7 @@ int vm_execute(vm_t *vm)
 #undef _CODE
     }
 #else
-#define INTERPRET       _loop: switch(READ_BYTE())
+#define INTERPRET       _loop: PROFILE(); switch(READ_BYTE())
 #define CODE(x)         case OP_##x:
 #define CODE_ERR()      default:
 #define NEXT            goto _loop
@@ -230,12 +634,13 @@ int vm_execute(vm_t *vm)
 #define INTERPRET       NEXT;
 #define CODE(x)         _OP_##x:
 #define CODE_ERR()      _err:
-#define NEXT            goto *_jtab[READ_BYTE()]
+#define NEXT            do { PROFILE(); goto *_jtab[READ_BYTE()]; } while (0)
 #define _CODE(x)        &&_OP_##x,
     static void *_jtab[OPCODE_COUNT] = { OPCODES() };
 #endif
 
     LOAD_FRAME();
+    JIT_ENTER();
 
     INTERPRET
     {
@@ -243,10 +648,10 @@ int vm_execute(vm_t *vm)
             int count = READ_BYTE();
 
             for (int i = count-1; i >= 0; i--) {
-                val_print(PEEK(i));
-                if (i > 0) printf("\t");
+                val_print(&vm->out, PEEK(i));
+                if (i > 0) output_char(&vm->out, '\t');
             }
-            printf("\n");
+            output_line(&vm->out);
 
             POPN(count);
             NEXT;
@@ -279,43 +684,77 @@ int vm_execute(vm_t *vm)
 
         CODE(CALL) {
             int argCount = READ_BYTE();
+            val_t callee = PEEK(argCount);
+
+            if (IS_CFN(callee) && AS_CFN(callee)->intrinsic != 0 &&
+                argCount == 1 && IS_NUM(PEEK(0))) {
+                ip[-2] = AS_CFN(callee)->intrinsic;
+                ip -= 2;
+                NEXT;
+            }
 
             STORE_FRAME();
-            if (!vm_call(vm, PEEK(argCount), argCount)) {
+            if (vm->sample) sampler_take(vm);
+            if (!vm_call(vm, callee, argCount)) {
                 return VM_RUNTIME_ERROR;
             }
+            SUSPEND_POINT();
 
             LOAD_FRAME();
+            JIT_ENTER();
             NEXT;
         }
 
-        CODE(RET) {
-            val_t result = POP();
+        CODE(TAILCALL) {
+            int argCount = READ_BYTE();
+            val_t callee = PEEK(argCount);
 
-            if (--vm->frameCount == 0) {
-                POP();
-                return VM_OK;
+            // Anything but a function is called as usual and returns to
+            // the RET that follows.
+            STORE_FRAME();
+            if (vm->sample) sampler_take(vm);
+            if (IS_FUN(callee)) {
+                if (!prepareTailCall(vm, AS_FUN(callee), argCount)) {
+                    return VM_RUNTIME_ERROR;
+                }
+            }
+            else if (!vm_call(vm, callee, argCount)) {
+                return VM_RUNTIME_ERROR;
             }
+            SUSPEND_POINT();
+
+            LOAD_FRAME();
+            JIT_ENTER();
+            NEXT;
+        }
+
+        CODE(RET) {
+            val_t result = POP();
 
             vm->top = frame->slots;
             PUSH(result);
 
+            if (--vm->frameCount == base) {
+                return VM_OK;
+            }
+
             LOAD_FRAME();
+            JIT_ENTER();
             NEXT;
         }
 
         CODE(NOT) {
-            PUSH(VAL_BOOL(IS_FALSEY(POP())));
+            PEEK(0) = VAL_BOOL(IS_FALSEY(PEEK(0)));
             NEXT;
         }
 
         CODE(NEG) {
             switch (AS_TYPE(PEEK(0))) {
                 case VT_BOOL:
-                    PUSH(VAL_NUM(-(char)AS_BOOL(POP())));
+                    PEEK(0) = VAL_NUM(-(char)AS_BOOL(PEEK(0)));
                     NEXT;
                 case VT_NUM:
-                    PUSH(VAL_NUM(-AS_NUM(POP())));
+                    PEEK(0) = VAL_NUM(-AS_NUM(PEEK(0)));
                     NEXT;
             }
             ERROR("Operands must be a number/boolean.");
@@ -328,9 +767,38 @@ int vm_execute(vm_t *vm)
             NEXT;
         }
 
+        CODE(NE) {
+            val_t b = POP();
+            val_t a = POP();
+            PUSH(VAL_BOOL(!val_equal(a, b)));
+            NEXT;
+        }
+
+        // Negated so that NaN compares the way LE/LT followed by NOT did.
+        CODE(GT) {
+            double x, y;
+            if (!numOperands(PEEK(1), PEEK(0), &x, &y)) {
+                ERROR("Operands must be two numbers/booleans.");
+            }
+            POP();
+            PEEK(0) = VAL_BOOL(!(x <= y));
+            NEXT;
+        }
+
+        CODE(GE) {
+            double x, y;
+            if (!numOperands(PEEK(1), PEEK(0), &x, &y)) {
+                ERROR("Operands must be two numbers/booleans.");
+            }
+            POP();
+            PEEK(0) = VAL_BOOL(!(x < y));
+            NEXT;
+        }
+
         CODE(LT) {
             switch (CMB_BYTES(AS_TYPE(PEEK(1)), AS_TYPE(PEEK(0)))) {
                 case VT_NUM_NUM: {
+                    QUICKEN(LT_NN);
                     double b = AS_NUM(POP());
                     double a = AS_NUM(POP());
                     PUSH(VAL_BOOL(a < b));
@@ -361,6 +829,7 @@ int vm_execute(vm_t *vm)
         CODE(LE) {
             switch (CMB_BYTES(AS_TYPE(PEEK(1)), AS_TYPE(PEEK(0)))) {
                 case VT_NUM_NUM: {
+                    QUICKEN(LE_NN);
                     double b = AS_NUM(POP());
                     double a = AS_NUM(POP());
                     PUSH(VAL_BOOL(a <= b));
@@ -391,6 +860,7 @@ int vm_execute(vm_t *vm)
         CODE(ADD) {
             switch (CMB_BYTES(AS_TYPE(PEEK(1)), AS_TYPE(PEEK(0)))) {
                 case VT_NUM_NUM: {
+                    QUICKEN(ADD_NN);
                     double b = AS_NUM(POP());
                     double a = AS_NUM(POP());
                     PUSH(VAL_NUM(a + b));
@@ -415,7 +885,7 @@ int vm_execute(vm_t *vm)
                     NEXT;
                 }
                 case VT_OBJ_OBJ:
-                    if (IS_STR(PEEK(0)) && IS_STR(PEEK(1))) {
+                    if (str_is(PEEK(0)) && str_is(PEEK(1))) {
                         concatenate(vm);
                         NEXT;
                     }
@@ -426,6 +896,7 @@ int vm_execute(vm_t *vm)
         CODE(SUB) {
             switch (CMB_BYTES(AS_TYPE(PEEK(1)), AS_TYPE(PEEK(0)))) {
                 case VT_NUM_NUM: {
+                    QUICKEN(SUB_NN);
                     double b = AS_NUM(POP());
                     double a = AS_NUM(POP());
                     PUSH(VAL_NUM(a - b));
@@ -456,6 +927,7 @@ int vm_execute(vm_t *vm)
         CODE(MUL) {
             switch (CMB_BYTES(AS_TYPE(PEEK(1)), AS_TYPE(PEEK(0)))) {
                 case VT_NUM_NUM: {
+                    QUICKEN(MUL_NN);
                     double b = AS_NUM(POP());
                     double a = AS_NUM(POP());
                     PUSH(VAL_NUM(a * b));
@@ -486,6 +958,7 @@ int vm_execute(vm_t *vm)
         CODE(DIV) {
             switch (CMB_BYTES(AS_TYPE(PEEK(1)), AS_TYPE(PEEK(0)))) {
                 case VT_NUM_NUM: {
+                    QUICKEN(DIV_NN);
                     double b = AS_NUM(POP());
                     double a = AS_NUM(POP());
                     PUSH(VAL_NUM(a / b));
@@ -513,29 +986,41 @@ int vm_execute(vm_t *vm)
             ERROR("Operands must be two numbers/booleans.");
         }
 
-        CODE(DEF) {
-            str_t *name = READ_STR();
-            tab_set(vm->globals, name, PEEK(0));
+        CODE(DEFS) {
+            uint16_t slot = READ_SHORT();
+            vm->slots->values[slot] = PEEK(0);
+            vm->stores++;
             POP();
             NEXT;
         }
 
-        CODE(GLD) {
-            str_t *name = READ_STR();
-            val_t value;      
-            if (!tab_get(vm->globals, name, &value)) {
-                ERROR("Undefined variable '%s'.", name->chars);
+        CODE(GLDS) {
+            uint16_t slot = READ_SHORT();
+            val_t value = vm->slots->values[slot];
+            if (IS_UNDEF(value)) {
+                ERROR("Undefined variable '%s'.", globalName(vm, slot)->chars);
             }
             PUSH(value);
             NEXT;
         }
 
-        CODE(GST) {
-            str_t *name = READ_STR();
-            if (tab_set(vm->globals, name, PEEK(0))) {
-                tab_remove(vm->globals, name);
-                ERROR("Undefined variable '%s'.", name->chars);
+        CODE(GSTS) {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEF(vm->slots->values[slot])) {
+                ERROR("Undefined variable '%s'.", globalName(vm, slot)->chars);
             }
+            vm->slots->values[slot] = PEEK(0);
+            vm->stores++;
+            NEXT;
+        }
+
+        CODE(GSTSP) {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEF(vm->slots->values[slot])) {
+                ERROR("Undefined variable '%s'.", globalName(vm, slot)->chars);
+            }
+            vm->slots->values[slot] = POP();
+            vm->stores++;
             NEXT;
         }
 
@@ -549,6 +1034,11 @@ int vm_execute(vm_t *vm)
             NEXT;
         }
 
+        CODE(STP) {
+            STACK[READ_BYTE()] = POP();
+            NEXT;
+        }
+
         CODE(JMP) {
             uint16_t offset = READ_SHORT();
             ip += offset;
@@ -561,12 +1051,31 @@ int vm_execute(vm_t *vm)
             NEXT;
         }
 
+        CODE(LOOP) {
+            uint16_t offset = READ_SHORT();
+            SAFEPOINT();
+            ip -= offset;
+            countHot(vm, frame->function);
+            JIT_ENTER();
+            NEXT;
+        }
+
+        CODE(JMPFP) {
+            uint16_t offset = READ_SHORT();
+            if (IS_FALSEY(POP())) ip += offset;
+            NEXT;
+        }
+
         CODE(MAP) {
             uint8_t count = READ_BYTE();
-            map_t *map = map_new(vm, 0, 0);
+            map_t *map = map_new(vm, count, 0);
 
-            for (val_t i = VAL_NUM(count - 1); AS_NUM(i) >= 0; AS_NUM(i) -= 1) {
-                hash_set(&map->hash, AS_RAW(i), PEEK((int)AS_NUM(i)));
+            for (int i = 0; i < count; i++) {
+                map->array[i] = PEEK(count - 1 - i);
+            }
+            map->arrayCount = count;
+            while (map->arrayCount > 0 && IS_NIL(map->array[map->arrayCount - 1])) {
+                map->arrayCount--;
             }
 
             POPN(count);
@@ -578,10 +1087,18 @@ int vm_execute(vm_t *vm)
             if (IS_MAP(PEEK(0))) {
                 map_t *map = AS_MAP(PEEK(0));
                 str_t *name = READ_STR();
+                icache_t *cache = READ_CACHE();
                 val_t value = VAL_NIL;
-                tab_get(&map->table, name, &value);
-                POP();
-                PUSH(value);
+
+                if (map->shape == cache->shape && map->shape != NULL) {
+                    value = map->fields[cache->offset];
+                    ip[-4] = OP_GET_FIELD;  // back over k, c, c
+                }
+                else {
+                    map_getstr(map, name, &value, cache);
+                }
+
+                PEEK(0) = value;
             }
             else {
                 ERROR("Operands must be a map.");
@@ -593,8 +1110,17 @@ int vm_execute(vm_t *vm)
             if (IS_MAP(PEEK(1))) {
                 map_t *map = AS_MAP(PEEK(1));
                 str_t *name = READ_STR();
+                icache_t *cache = READ_CACHE();
                 val_t value = PEEK(0);
-                tab_set(&map->table, name, value);
+
+                if (map->shape == cache->shape && map->shape != NULL && cache->next == NULL) {
+                    map->fields[cache->offset] = value;
+                    GC_BARRIER(vm->gc, map);
+                }
+                else {
+                    map_setfield(vm, map, name, value, cache);
+                }
+
                 POP();
                 POP();
                 PUSH(value);
@@ -609,19 +1135,26 @@ int vm_execute(vm_t *vm)
             if (IS_MAP(PEEK(1))) {
                 if (IS_NUM(PEEK(0))) {
                     map_t *map = AS_MAP(PEEK(1));
-                    uint64_t key = AS_RAW(PEEK(0));
+                    double key = AS_NUM(PEEK(0));
                     val_t value = VAL_NIL;
-                    hash_get(&map->hash, key, &value);
+                    int slot = map_slot(map, key);
+                    if (slot >= 0) {
+                        value = map->array[slot];
+                        QUICKEN(GETI_ARR);
+                    }
+                    else {
+                        map_getnum(map, key, &value);
+                    }
 
                     POP();
                     POP();
                     PUSH(value);
                 }
-                else if (IS_STR(PEEK(0))) {
+                else if (str_is(PEEK(0))) {
                     map_t *map = AS_MAP(PEEK(1));
-                    str_t *key = AS_STR(PEEK(0));
+                    str_t *key = AS_STR(strKey(vm, PEEK(0)));
                     val_t value = VAL_NIL;
-                    tab_get(&map->table, key, &value);
+                    map_getstr(map, key, &value, NULL);
 
                     POP();
                     POP();
@@ -641,20 +1174,27 @@ int vm_execute(vm_t *vm)
             if (IS_MAP(PEEK(2))) {
                 if (IS_NUM(PEEK(1))) {
                     map_t *map = AS_MAP(PEEK(2));
-                    uint64_t key = AS_RAW(PEEK(1));
+                    double key = AS_NUM(PEEK(1));
                     val_t value = POP();
-                    hash_set(&map->hash, key, value);
+                    int slot = map_slot(map, key);
+                    if (slot >= 0 && !IS_NIL(value)) {
+                        map->array[slot] = value;
+                        GC_BARRIER(vm->gc, map);
+                    }
+                    else {
+                        map_setnum(vm, map, key, value);
+                    }
 
                     POP();
                     POP();
                     PUSH(value);
                 }
-                else if (IS_STR(PEEK(1)))
+                else if (str_is(PEEK(1)))
                 {
                     map_t *map = AS_MAP(PEEK(2));
-                    str_t *key = AS_STR(PEEK(1));
+                    str_t *key = AS_STR(strKey(vm, PEEK(1)));
                     val_t value = POP();
-                    tab_set(&map->table, key, value);
+                    map_setstr(vm, map, key, value);
 
                     POP();
                     POP();
@@ -670,6 +1210,242 @@ int vm_execute(vm_t *vm)
             NEXT;
         }
 
+        CODE(RADD) {
+            uint8_t a = READ_BYTE();
+            val_t b = READ_RK();
+            val_t c = READ_RK();
+            double x, y;
+
+            if (numOperands(b, c, &x, &y)) {
+                STORE_R(a, VAL_NUM(x + y));
+                NEXT;
+            }
+            if (str_is(b) && str_is(c)) {
+                PUSH(b);
+                PUSH(c);
+                concatenate(vm);
+                if (a != R_PUSH) STACK[a] = POP();
+                NEXT;
+            }
+            ERROR("Operands must be two numbers/booleans/strings.");
+        }
+
+        CODE(RSUB) {
+            REGISTER_ARITH(-);
+            NEXT;
+        }
+
+        CODE(RMUL) {
+            REGISTER_ARITH(*);
+            NEXT;
+        }
+
+        CODE(RDIV) {
+            REGISTER_ARITH(/);
+            NEXT;
+        }
+
+        CODE(RGETI) {
+            uint8_t a = READ_BYTE();
+            val_t map = STACK[READ_BYTE()];
+            val_t key = READ_RK();
+            val_t value = VAL_NIL;
+
+            if (!IS_MAP(map)) {
+                ERROR("Operands must be a map.");
+            }
+
+            if (IS_NUM(key)) {
+                int slot = map_slot(AS_MAP(map), AS_NUM(key));
+                if (slot >= 0) value = AS_MAP(map)->array[slot];
+                else map_getnum(AS_MAP(map), AS_NUM(key), &value);
+            }
+            else if (str_is(key)) {
+                map_getstr(AS_MAP(map), AS_STR(strKey(vm, key)), &value, NULL);
+            }
+            else {
+                ERROR("Operands must be a number or string.");
+            }
+
+            STORE_R(a, value);
+            NEXT;
+        }
+
+        CODE(RLT) {
+            REGISTER_JUMP(OP_LT);
+            NEXT;
+        }
+
+        CODE(RLE) {
+            REGISTER_JUMP(OP_LE);
+            NEXT;
+        }
+
+        CODE(REQ) {
+            val_t b = READ_RK();
+            val_t c = READ_RK();
+            uint16_t offset = READ_SHORT();
+            if (!val_equal(b, c)) ip += offset;
+            NEXT;
+        }
+
+        CODE(RNE) {
+            val_t b = READ_RK();
+            val_t c = READ_RK();
+            uint16_t offset = READ_SHORT();
+            if (val_equal(b, c)) ip += offset;
+            NEXT;
+        }
+
+        CODE(RGT) {
+            REGISTER_JUMP(OP_GT);
+            NEXT;
+        }
+
+        CODE(RGE) {
+            REGISTER_JUMP(OP_GE);
+            NEXT;
+        }
+
+        CODE(FORPREP) {
+            uint8_t a = READ_BYTE();
+            val_t b = READ_RK();
+            uint8_t m = READ_BYTE();
+            uint16_t offset = READ_SHORT();
+            double x, y;
+            if (!numOperands(STACK[a], b, &x, &y)) {
+                ERROR("Operands must be two numbers/booleans.");
+            }
+            if (!forTest(m, x, y)) ip += offset;
+            NEXT;
+        }
+
+        CODE(FORLOOP) {
+            uint8_t a = READ_BYTE();
+            val_t b = READ_RK();
+            val_t c = READ_RK();
+            uint8_t m = READ_BYTE();
+            uint16_t offset = READ_SHORT();
+            double x, y;
+            if (!numOperands(STACK[a], c, &x, &y)) {
+                ERROR("Operands must be two numbers/booleans.");
+            }
+            STACK[a] = VAL_NUM(x + y);
+            if (!numOperands(STACK[a], b, &x, &y)) {
+                ERROR("Operands must be two numbers/booleans.");
+            }
+            if (forTest(m, x, y)) {
+                SAFEPOINT();
+                ip -= offset;
+                countHot(vm, frame->function);
+                JIT_ENTER();
+            }
+            NEXT;
+        }
+
+        CODE(ADD_NN) {
+            QUICK_BINARY(ADD, +, VAL_NUM);
+            NEXT;
+        }
+
+        CODE(SUB_NN) {
+            QUICK_BINARY(SUB, -, VAL_NUM);
+            NEXT;
+        }
+
+        CODE(MUL_NN) {
+            QUICK_BINARY(MUL, *, VAL_NUM);
+            NEXT;
+        }
+
+        CODE(DIV_NN) {
+            QUICK_BINARY(DIV, /, VAL_NUM);
+            NEXT;
+        }
+
+        CODE(LT_NN) {
+            QUICK_BINARY(LT, <, VAL_BOOL);
+            NEXT;
+        }
+
+        CODE(LE_NN) {
+            QUICK_BINARY(LE, <=, VAL_BOOL);
+            NEXT;
+        }
+
+        CODE(GETI_ARR) {
+            int slot = -1;
+            if (IS_MAP(PEEK(1)) && IS_NUM(PEEK(0))) {
+                slot = map_slot(AS_MAP(PEEK(1)), AS_NUM(PEEK(0)));
+            }
+            if (slot < 0) DEQUICKEN(GETI);
+
+            val_t value = AS_MAP(PEEK(1))->array[slot];
+            POP();
+            PEEK(0) = value;
+            NEXT;
+        }
+
+        CODE(GET_FIELD) {
+            icache_t *cache = &CACHES[(ip[1] << 8) | ip[2]];
+            map_t *map = IS_MAP(PEEK(0)) ? AS_MAP(PEEK(0)) : NULL;
+            // Caches of a function read from a dump start out empty.
+            if (map == NULL || map->shape != cache->shape || cache->shape == NULL) {
+                DEQUICKEN(GET);
+            }
+
+            ip += 3;
+            PEEK(0) = map->fields[cache->offset];
+            NEXT;
+        }
+
+        CODE(ABS) {
+            QUICK_INTRINSIC(ABS, fabs);
+            NEXT;
+        }
+
+        CODE(FLOOR) {
+            QUICK_INTRINSIC(FLOOR, floor);
+            NEXT;
+        }
+
+        CODE(SQRT) {
+            QUICK_INTRINSIC(SQRT, sqrt);
+            NEXT;
+        }
+
+        CODE(CONST_W) {
+            PUSH(CONSTS[READ_SHORT()]);
+            NEXT;
+        }
+
+        CODE(JMP_W) {
+            uint32_t offset = READ_WIDE();
+            ip += offset;
+            NEXT;
+        }
+
+        CODE(JMPF_W) {
+            uint32_t offset = READ_WIDE();
+            if (IS_FALSEY(PEEK(0))) ip += offset;
+            NEXT;
+        }
+
+        CODE(JMPFP_W) {
+            uint32_t offset = READ_WIDE();
+            if (IS_FALSEY(POP())) ip += offset;
+            NEXT;
+        }
+
+        CODE(LOOP_W) {
+            uint32_t offset = READ_WIDE();
+            SAFEPOINT();
+            ip -= offset;
+            countHot(vm, frame->function);
+            JIT_ENTER();
+            NEXT;
+        }
+
         CODE_ERR() {
             ERROR("Bad opcode, got %d!", PREV_BYTE());
         }
@@ -678,40 +1454,92 @@ int vm_execute(vm_t *vm)
     return VM_OK;
 }
 
+int vm_execute(vm_t *vm)
+{
+    int outer = vm->base;
+    vm->base = vm->frameCount - 1;
+    int status = execute(vm, vm->base);
+    vm->base = outer;
+    return status;
+}
+
+// The frames of a fiber start at 0, it runs until the first returns.
+int vm_resume(vm_t *vm)
+{
+    int outer = vm->base;
+    vm->base = 0;
+    int status = execute(vm, 0);
+    vm->base = outer;
+    return status;
+}
+
+static int runScript(vm_t *vm, fun_t *function)
+{
+    val_t script = VAL_OBJ(function);
+
+    PUSH(script);
+    vm_call(vm, script, 0);
+
+    int result = vm_execute(vm);
+    if (result == VM_OK) POP();
+    return result;
+}
+
 int vm_dofile(vm_t *vm, const char *fname)
 {
     int result = VM_COMPILE_ERROR;
     src_t *source = src_new(fname);
 
     if (source != NULL) {
-        fun_t *function = compile(vm, source);
-        if (function == NULL) return VM_COMPILE_ERROR;
-
-        val_t script = VAL_OBJ(function);
-
-        PUSH(script);
-        vm_call(vm, script, 0);
+        fun_t *function = cache_load(vm, source, fname);
+        if (function == NULL) {
+            function = compile(vm, source);
+            if (function != NULL) cache_save(vm, function, source, fname);
+        }
 
-        result = vm_execute(vm);  
+        if (function != NULL) result = runScript(vm, function);
     }
 
     src_free(source);
     return result;
 }
 
+int vm_run(vm_t *vm, struct _prog *prog)
+{
+    fun_t *function = prog_load(vm, prog);
+    if (function == NULL) return VM_COMPILE_ERROR;
+    return runScript(vm, function);
+}
+
 void set_global(vm_t *vm, const char *name, val_t value)
 {
     val_t global = VAL_OBJ(str_copy(vm, name, (int)strlen(name)));
 
     PUSH(global);
     PUSH(value);
-    tab_set(vm->globals, AS_STR(global), value);
+    int slot = global_slot(vm, AS_STR(global));
+    vm->slots->values[slot] = value;
+    vm->stores++;
     POP();
     POP();
 }
 
+int global_slot(vm_t *vm, str_t *name)
+{
+    val_t slot;
+    if (tab_get(vm->globals, name, &slot)) return AS_INT(slot);
+
+    int index = arr_add(vm->slots, VAL_UNDEF, true);
+    tab_set(vm->globals, name, VAL_NUM(index));
+    return index;
+}
+
+// Natives may push past the limit, there is no way to fail here.
 void vm_push(vm_t *vm, val_t value)
 {
+    if (vm->top == vm->stack + vm->stackCapacity) {
+        growStack(vm, 1, INT32_MAX);
+    }
     PUSH(value);
 }
 
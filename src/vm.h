@@ -5,6 +5,10 @@
 #include "chunk.h"
 #include "gc.h"
 #include "table.h"
+#include "dump.h"
+#ifdef DEBUG_PROFILE
+#include "profile.h"
+#endif
 
 typedef struct {
     fun_t *function;
@@ -12,27 +16,79 @@ typedef struct {
     val_t *slots;
 } frame_t;
 
+typedef struct {
+    struct _prog *prog;
+    fun_t *script;      // prog read into this heap, NULL until it runs here
+} loaded_t;
+
 struct _vm {
     val_t *top;
-    val_t stack[STACK_MAX];
-    frame_t frames[FRAMES_MAX];
+    val_t *stack;
+    int stackCapacity;
+    int maxStack;       // values the stack may grow to
+    frame_t *frames;
     int frameCount;
+    int frameCapacity;
+    int maxFrames;      // calls that may be nested
 
     gc_t  *gc;
     tab_t *strings;
-    tab_t *globals;
+    tab_t *globals;     // global name -> slot index
+    arr_t *slots;       // global values, resolved by the compiler
+    unsigned stores;    // bumped on every store to a global
+    int optimize;       // optimizer level scripts get compiled at
+    int jit;            // whether hot functions get compiled to machine code
+    int debug;          // whether cached code keeps the positions errors report
+    arena_t arena;      // code of the functions compiled here, freed with the vm
+    output_t out;       // what print writes to stdout
+    volatile int sample;    // set by the sampler when a stack is due
+    struct _sched *sched;   // fibers, once one got spawned
+    loaded_t *programs; // held until the vm gets closed
+    int programCount;
+    int base;           // frame the innermost vm_execute returns at
+    bool suspend;       // set by a native to suspend the running fiber
+#ifdef DEBUG_PROFILE
+    profile_t *profile; // reported to stderr at vm_close, if set
+#endif
+
+    vm_t *next;         // next vm attached to the same heap
 };
 
 vm_t *vm_create();
 void vm_close(vm_t *vm);
+// A clone owns a heap of its own holding a copy of the globals of from,
+// so it can run on another thread. Values cross over through vm_import.
 vm_t *vm_clone(vm_t *from);
+val_t vm_import(vm_t *vm, val_t value);
+
+void vm_dumpglobals(vm_t *vm, dump_t *dump);
+void vm_loadglobals(vm_t *vm, dump_t *dump);
+// The names of the global slots, for code that addresses them by slot.
+// Loading gives every name its slot, false where one has another already.
+void vm_dumpslots(vm_t *vm, dump_t *dump);
+bool vm_loadslots(vm_t *vm, dump_t *dump);
 
 int vm_dofile(vm_t *vm, const char *fname);
+// Runs a script compiled by prog_compile, without compiling it again.
+int vm_run(vm_t *vm, struct _prog *prog);
 
 void set_global(vm_t *vm, const char *name, val_t value);
+int global_slot(vm_t *vm, str_t *name);
+
+// Value of a global slot that was resolved but never defined.
+extern const ptrkind_t vm_undefined;
+#define VAL_UNDEF           VAL_PTR(&vm_undefined)
+#define IS_UNDEF(v)         (IS_PTR(v) && AS_PTR(v) == &vm_undefined)
 
+// The stack may move when it grows, the args a native got are only
+// good until it pushes or calls back into the vm.
 void vm_push(vm_t *vm, val_t value);
 val_t vm_pop(vm_t *vm);
 
+// Runs the function called through vm_call until it returns, its result
+// is left on the stack in place of the callee.
 int vm_execute(vm_t *vm);
+// Goes on with the frames of a fiber, which returns VM_SUSPENDED when
+// it waits while running the call at the top.
+int vm_resume(vm_t *vm);
 bool vm_call(vm_t *vm, val_t callee, int argCount);